@@ -0,0 +1,328 @@
+/* bench.c -- benchmark of the stream capture path
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Feeds synthesized and recorded streams through stream_validate_data,
+   stream_callback, the writer thread pipeline and the compressor in
+   transfer sized chunks, cut the same way the device cuts them.  The
+   worst case time per chunk is what matters during capture, since the
+   callback runs inside the USB event handling and a slow one makes the
+   device overflow.  */
+
+#include <config.h>
+#include <device.h>
+#include <stream.h>
+#include <simflux.h>
+#include <fluxz.h>
+#include <output.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+
+#define MAX_CHUNK_SIZES 16
+
+enum {
+  BENCH_VALIDATE,
+  BENCH_CALLBACK,
+  BENCH_PIPELINE,
+  BENCH_COMPRESS
+};
+
+struct bench_data {
+  uint8_t *data;
+  uint32_t *chunks;
+  size_t size, nchunks;
+};
+
+static unsigned opt_chunk_sizes[MAX_CHUNK_SIZES];
+static int opt_num_chunk_sizes = 0;
+static int opt_megabytes = 64;
+static int opt_repeat = 3;
+static const char *opt_output = "/dev/null";
+static int opt_backend = OUTPUT_STDIO;
+
+static struct stream_context *bench_sc;
+
+static bool parse_intoption(char *optstr, int offs, int *optval,
+			    int lo_limit, int hi_limit)
+{
+  char *e;
+  long v = strtol(optstr+offs, &e, 10);
+  if (!optstr[offs] || *e || v < lo_limit || v > hi_limit) {
+    fprintf(stderr, "Out of range %d...%d: %s\n", lo_limit, hi_limit, optstr);
+    return false;
+  }
+  *optval = v;
+  return true;
+}
+
+static int parse_options(int argc, char **argv)
+{
+  int i, v;
+  for (i=1; i<argc; i++)
+    if (argv[i][0] != '-')
+      break;
+    else switch(argv[i][1]) {
+    case 'h':
+      printf("Usage: %s [options] [stream files...]\n"
+	     "-c<size>: chunk size, may be repeated (default 512, 4096, 6400, 65536)\n"
+	     "-n<mb>  : amount of synthesized data (default 64)\n"
+	     "-r<n>   : number of passes per measurement (default 3)\n"
+	     "-o<name>: callback output file (default /dev/null)\n"
+	     "-w<out> : how the pipeline writes the file, stdio (default)\n"
+	     "          or direct\n"
+	     "Without files, a synthesized stream is used.\n", argv[0]);
+      exit(0);
+      break;
+    case 'c':
+      if (opt_num_chunk_sizes >= MAX_CHUNK_SIZES) {
+	fprintf(stderr, "Too many chunk sizes\n");
+	return -1;
+      }
+      if (!parse_intoption(argv[i], 2, &v, 256, 1<<24))
+	return -1;
+      opt_chunk_sizes[opt_num_chunk_sizes++] = v;
+      break;
+    case 'n':
+      if (!parse_intoption(argv[i], 2, &opt_megabytes, 1, 65536))
+	return -1;
+      break;
+    case 'r':
+      if (!parse_intoption(argv[i], 2, &opt_repeat, 1, 1000))
+	return -1;
+      break;
+    case 'o':
+      opt_output = argv[i]+2;
+      break;
+    case 'w':
+      if ((opt_backend = output_backend(argv[i]+2)) < 0) {
+	fprintf(stderr, "Unknown output: %s\n", argv[i]+2);
+	return -1;
+      }
+      break;
+    default:
+      fprintf(stderr, "Invalid command: %s\n", argv[i]);
+      return -1;
+    }
+  return i;
+}
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool bench_load(struct bench_data *bd, struct simflux *sf,
+		       uint32_t chunk_size, size_t limit)
+{
+  size_t allocsize = 0, chunkalloc = 0;
+  memset(bd, 0, sizeof(*bd));
+  for (;;) {
+    uint32_t l;
+    if (bd->size + chunk_size > allocsize) {
+      uint8_t *newdata;
+      allocsize = (allocsize? allocsize + (allocsize>>1) : (1<<20)) +
+	chunk_size;
+      newdata = realloc(bd->data, allocsize);
+      if (!newdata)
+	goto oom;
+      bd->data = newdata;
+    }
+    if (bd->nchunks >= chunkalloc) {
+      uint32_t *newchunks;
+      chunkalloc = (chunkalloc? chunkalloc*2 : 1024);
+      newchunks = realloc(bd->chunks, chunkalloc * sizeof(uint32_t));
+      if (!newchunks)
+	goto oom;
+      bd->chunks = newchunks;
+    }
+    if (limit && bd->size >= limit)
+      simflux_finish(sf, 0);
+    l = simflux_read(sf, bd->data + bd->size, chunk_size);
+    if (!l)
+      return true;
+    bd->chunks[bd->nchunks++] = l;
+    bd->size += l;
+  }
+ oom:
+  fprintf(stderr, "Out of memory!\n");
+  free(bd->data);
+  free(bd->chunks);
+  return false;
+}
+
+static void bench_run(const char *name, const struct bench_data *bd,
+		      uint32_t chunk_size, int path)
+{
+  static const char * const pathnames[] = {
+    "validate", "callback", "pipeline", "compress"
+  };
+  struct fluxz *z = NULL;
+  double best = 0, worst_chunk = 0, total_chunk = 0;
+  bool ok = true;
+  int rep;
+
+  for (rep = 0; rep < opt_repeat; rep++) {
+    FILE *f = NULL;
+    struct stream_job *job = NULL;
+    const uint8_t *p = bd->data;
+    uint8_t *xferbuf = NULL;
+    double start, elapsed;
+    size_t i;
+
+    if (path == BENCH_PIPELINE) {
+      /* The writer opens the file itself */
+      if (!(xferbuf = device_alloc_buffer(NULL, chunk_size)) ||
+	  !stream_writer_start(bench_sc, chunk_size)) {
+	device_free_buffer(NULL, xferbuf, chunk_size);
+	return;
+      }
+    } else if (path != BENCH_VALIDATE) {
+      f = fopen(opt_output, "wb");
+      if (!f) {
+	perror(opt_output);
+	return;
+      }
+    }
+    start = bench_now();
+    if (path == BENCH_PIPELINE) {
+      if (!(job = stream_job_begin(bench_sc, opt_output))) {
+	device_free_buffer(NULL, xferbuf, chunk_size);
+	return;
+      }
+    } else if (path == BENCH_COMPRESS) {
+      if ((!z && !(z = fluxz_new())) || !fluxz_begin(z, f)) {
+	fclose(f);
+	fluxz_free(z);
+	return;
+      }
+    } else
+      stream_reset(bench_sc, f);
+    for (i = 0; i < bd->nchunks; i++) {
+      double t0, t;
+      bool r;
+      if (path == BENCH_PIPELINE) {
+	/* Stands in for the DMA into the transfer buffer */
+	memcpy(xferbuf, p, bd->chunks[i]);
+	/* Where a capture would have given up the track, wait, so that
+	   the rest can still be measured */
+	while (!stream_spare_count(bench_sc))
+	  sched_yield();
+	t0 = bench_now();
+	r = stream_handoff(bench_sc, &xferbuf, bd->chunks[i]);
+      } else if (path == BENCH_COMPRESS) {
+	t0 = bench_now();
+	r = fluxz_write(z, p, bd->chunks[i]);
+      } else {
+	t0 = bench_now();
+	r = (path == BENCH_CALLBACK?
+	     stream_callback(bench_sc, p, bd->chunks[i]) :
+	     stream_validate_data(bench_sc, p, bd->chunks[i]));
+      }
+      t = bench_now() - t0;
+      if (t > worst_chunk)
+	worst_chunk = t;
+      total_chunk += t;
+      if (!r) {
+	if (path == BENCH_COMPRESS || !stream_succeeded(bench_sc))
+	  ok = false;
+	break;
+      }
+      p += bd->chunks[i];
+    }
+    if (path == BENCH_PIPELINE) {
+      stream_job_close(job);
+      if (!stream_job_wait(job))
+	ok = false;
+      device_free_buffer(NULL, xferbuf, chunk_size);
+    } else if (path == BENCH_COMPRESS && !fluxz_finish(z))
+      ok = false;
+    elapsed = bench_now() - start;
+    if (f)
+      fclose(f);
+    if (path == BENCH_VALIDATE || path == BENCH_CALLBACK)
+      stream_reset(bench_sc, NULL);
+    if (!best || elapsed < best)
+      best = elapsed;
+  }
+
+  fluxz_free(z);
+  printf("%-20.20s %8lu %-8s %10.1f %8.3f %9.3f %9.3f%s\n", name,
+	 (unsigned long)chunk_size, pathnames[path],
+	 bd->size / best / 1e6, best * 1e9 / bd->size,
+	 total_chunk * 1e6 / (bd->nchunks * opt_repeat), worst_chunk * 1e6,
+	 (ok? "" : "  (stream invalid)"));
+  fflush(stdout);
+}
+
+static void bench_source(const char *name, const char *filename)
+{
+  int i;
+  for (i = 0; i < opt_num_chunk_sizes; i++) {
+    struct bench_data bd;
+    struct simflux sf;
+    if (filename) {
+      if (!simflux_init_replay(&sf, filename))
+	return;
+    } else
+      simflux_init(&sf, 0, 0);
+    if (!bench_load(&bd, &sf, opt_chunk_sizes[i],
+		    (filename? 0 : (size_t)opt_megabytes << 20))) {
+      simflux_free(&sf);
+      return;
+    }
+    simflux_free(&sf);
+    bench_run(name, &bd, opt_chunk_sizes[i], BENCH_VALIDATE);
+    bench_run(name, &bd, opt_chunk_sizes[i], BENCH_CALLBACK);
+    bench_run(name, &bd, opt_chunk_sizes[i], BENCH_PIPELINE);
+    bench_run(name, &bd, opt_chunk_sizes[i], BENCH_COMPRESS);
+    free(bd.data);
+    free(bd.chunks);
+  }
+}
+
+int main (int argc, char *argv[])
+{
+  int i = parse_options(argc, argv);
+  if (i < 0)
+    return 1;
+  if (!opt_num_chunk_sizes) {
+    opt_chunk_sizes[opt_num_chunk_sizes++] = 512;
+    opt_chunk_sizes[opt_num_chunk_sizes++] = 4096;
+    opt_chunk_sizes[opt_num_chunk_sizes++] = 6400;
+    opt_chunk_sizes[opt_num_chunk_sizes++] = 65536;
+  }
+  if (!(bench_sc = stream_context_new(NULL)))
+    return 1;
+  stream_set_output(bench_sc, opt_backend);
+
+  printf("%-20s %8s %-8s %10s %8s %9s %9s\n", "source", "chunk", "path",
+	 "MB/s", "ns/byte", "mean us", "max us");
+  if (i >= argc)
+    bench_source("synthesized", NULL);
+  else
+    for (; i < argc; i++) {
+      const char *name = strrchr(argv[i], '/');
+      bench_source((name? name+1 : argv[i]), argv[i]);
+    }
+  stream_context_free(bench_sc);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+# check-capture.sh -- capture from the simulated device and check the files
+#
+# The simulated device sends the same streams on every run, so the
+# compressed and container captures must extract to exactly the plain
+# .raw files, but for the host date and time in the first OOB block.
+
+OPENDTC_SIM_FIRMWARE=1
+export OPENDTC_SIM_FIRMWARE
+unset OPENDTC_SIM_STREAM OPENDTC_SIM_RATE OPENDTC_SIM_FIFO \
+      OPENDTC_SIM_BAD_SECTOR OPENDTC_SIM_BAD_READS
+
+bin=`pwd`
+dir=check-capture.dir
+tracks="-s0 -e1"
+files="t00.0.raw t00.1.raw t01.0.raw t01.1.raw"
+# 0x0d, type 4, size 41, "host_date=yyyy.mm.dd, host_time=hh:mm:ss", NUL
+host_info=45
+
+fail()
+{
+  echo "FAIL: $*"
+  exit 1
+}
+
+capture()
+{
+  mkdir "$1" && (cd "$1" && shift &&
+    "$bin/opendtc" -ft $tracks "$@" >capture.log 2>&1) ||
+    fail "capture $*"
+}
+
+same()
+{
+  for f in $files; do
+    tail -c +`expr $host_info + 1` "plain/$f" >plain.tail &&
+      tail -c +`expr $host_info + 1` "$1/$f" | cmp plain.tail - ||
+      fail "$1/$f differs"
+  done
+}
+
+rm -rf $dir
+mkdir $dir && cd $dir || exit 1
+
+capture plain
+(cd plain && "$bin/opendtc-verify" -q -r $files) || fail "verify plain"
+test `"$bin/opendtc-verify" -i plain/t00.0.raw | grep -c revolution` = 5 ||
+  fail "index plain"
+test -f plain/t00.0.raw.idx || fail "no index sidecar"
+
+capture compressed -z
+(cd compressed && "$bin/opendtc-verify" -q t*.rawz &&
+ "$bin/opendtc-extract" t*.rawz >/dev/null) || fail "extract compressed"
+same compressed
+
+capture container -c
+(cd container && "$bin/opendtc-verify" -q t.dtc &&
+ "$bin/opendtc-extract" t.dtc >/dev/null) || fail "extract container"
+same container
+
+capture container-compressed -c -z
+(cd container-compressed && "$bin/opendtc-verify" -q t.dtc &&
+ "$bin/opendtc-extract" t.dtc >/dev/null) ||
+  fail "extract compressed container"
+same container-compressed
+
+# Resuming finds every track in the journal
+(cd plain && "$bin/opendtc" -ft $tracks -i >resume.log 2>&1) ||
+  fail "resume"
+test `grep -c "already captured" plain/resume.log` = 4 || fail "resume"
+
+cd .. && rm -rf $dir
+exit 0
@@ -0,0 +1,307 @@
+/* container.c -- single file container for the streams of a whole disk
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <config.h>
+#include <container.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+static const char container_magic[8] = "ODTCCONT";
+static const char container_index_magic[8] = "ODTCINDX";
+
+static void container_put32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void container_put64(uint8_t *p, uint64_t v)
+{
+  container_put32(p, v);
+  container_put32(p+4, v >> 32);
+}
+
+static uint32_t container_get32(const uint8_t *p)
+{
+  return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static uint64_t container_get64(const uint8_t *p)
+{
+  return container_get32(p) | ((uint64_t)container_get32(p+4) << 32);
+}
+
+static struct container *container_alloc(const char *filename)
+{
+  struct container *c = calloc(1, sizeof(struct container));
+  if (!c || !(c->filename = strdup(filename))) {
+    fprintf(stderr, "Out of memory!\n");
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+void container_free(struct container *c)
+{
+  if (!c)
+    return;
+  if (c->file)
+    fclose(c->file);
+  free(c->entries);
+  free(c->filename);
+  free(c);
+}
+
+struct container *container_create(const char *filename)
+{
+  uint8_t header[CONTAINER_HEADER_SIZE];
+  struct container *c = container_alloc(filename);
+  if (!c)
+    return NULL;
+  if (!(c->file = fopen(filename, "wb"))) {
+    perror(filename);
+    container_free(c);
+    return NULL;
+  }
+  memcpy(header, container_magic, 8);
+  container_put32(header+8, CONTAINER_VERSION);
+  container_put32(header+12, 0);
+  if (fwrite(header, 1, sizeof(header), c->file) != sizeof(header)) {
+    fprintf(stderr, "Failed to write data to file\n");
+    container_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+FILE *container_begin_entry(struct container *c, unsigned track, unsigned side)
+{
+  struct container_entry *e;
+  off_t pos;
+  if (c->failed)
+    return NULL;
+  if (c->count >= c->alloc) {
+    unsigned alloc = (c->alloc? c->alloc*2 : 168);
+    e = realloc(c->entries, alloc * sizeof(struct container_entry));
+    if (!e) {
+      fprintf(stderr, "Out of memory!\n");
+      return NULL;
+    }
+    c->entries = e;
+    c->alloc = alloc;
+  }
+  if ((pos = ftello(c->file)) < 0) {
+    perror(c->filename);
+    c->failed = true;
+    return NULL;
+  }
+  e = &c->entries[c->count];
+  e->track = track;
+  e->side = side;
+  e->flags = 0;
+  e->offset = pos;
+  e->length = 0;
+  c->writing = true;
+  return c->file;
+}
+
+bool container_end_entry(struct container *c, unsigned flags)
+{
+  struct container_entry *e = &c->entries[c->count];
+  off_t pos;
+  if (!c->writing)
+    return false;
+  c->writing = false;
+  if ((pos = ftello(c->file)) < 0) {
+    perror(c->filename);
+    c->failed = true;
+    return false;
+  }
+  e->length = pos - e->offset;
+  e->flags = flags;
+  c->count++;
+  return true;
+}
+
+/* Keeps the last capture of a track in the file, but makes the one
+   before it the one that is found */
+bool container_discard_entry(struct container *c,
+			     unsigned track, unsigned side)
+{
+  struct container_entry *e =
+    (struct container_entry *)container_find(c, track, side);
+  if (!e)
+    return false;
+  e->flags |= CONTAINER_ENTRY_DISCARDED;
+  return true;
+}
+
+bool container_finish(struct container *c)
+{
+  uint8_t buf[CONTAINER_INDEX_ENTRY_SIZE];
+  bool r = !c->failed;
+  off_t pos;
+  unsigned i;
+  if (c->writing)
+    container_end_entry(c, 0);
+  if ((pos = ftello(c->file)) < 0) {
+    perror(c->filename);
+    r = false;
+  } else {
+    for (i = 0; r && i < c->count; i++) {
+      const struct container_entry *e = &c->entries[i];
+      buf[0] = e->track;
+      buf[1] = e->side;
+      buf[2] = e->flags;
+      buf[3] = e->flags >> 8;
+      container_put32(buf+4, 0);
+      container_put64(buf+8, e->offset);
+      container_put64(buf+16, e->length);
+      if (fwrite(buf, 1, sizeof(buf), c->file) != sizeof(buf))
+	r = false;
+    }
+    container_put64(buf, pos);
+    container_put32(buf+8, c->count);
+    container_put32(buf+12, CONTAINER_VERSION);
+    memcpy(buf+16, container_index_magic, 8);
+    if (r && fwrite(buf, 1, CONTAINER_FOOTER_SIZE, c->file) !=
+	CONTAINER_FOOTER_SIZE)
+      r = false;
+    if (!r)
+      fprintf(stderr, "Failed to write data to file\n");
+  }
+  if (fclose(c->file)) {
+    perror(c->filename);
+    r = false;
+  }
+  c->file = NULL;
+  container_free(c);
+  return r;
+}
+
+struct container *container_open(const char *filename)
+{
+  uint8_t buf[CONTAINER_INDEX_ENTRY_SIZE];
+  struct container *c = container_alloc(filename);
+  off_t end, index;
+  unsigned i, count;
+  if (!c)
+    return NULL;
+  if (!(c->file = fopen(filename, "rb"))) {
+    perror(filename);
+    container_free(c);
+    return NULL;
+  }
+  if (fread(buf, 1, CONTAINER_HEADER_SIZE, c->file) != CONTAINER_HEADER_SIZE ||
+      memcmp(buf, container_magic, 8)) {
+    fprintf(stderr, "%s: Not a stream container\n", filename);
+    goto fail;
+  }
+  if (container_get32(buf+8) != CONTAINER_VERSION) {
+    fprintf(stderr, "%s: Unsupported container version %u\n", filename,
+	    (unsigned)container_get32(buf+8));
+    goto fail;
+  }
+  if (fseeko(c->file, -CONTAINER_FOOTER_SIZE, SEEK_END) ||
+      (end = ftello(c->file)) < 0 ||
+      fread(buf, 1, CONTAINER_FOOTER_SIZE, c->file) != CONTAINER_FOOTER_SIZE ||
+      memcmp(buf+16, container_index_magic, 8)) {
+    fprintf(stderr, "%s: Container was not finished\n", filename);
+    goto fail;
+  }
+  index = container_get64(buf);
+  count = container_get32(buf+8);
+  if (index < CONTAINER_HEADER_SIZE || index > end ||
+      (uint64_t)(end - index) != (uint64_t)count * CONTAINER_INDEX_ENTRY_SIZE) {
+    fprintf(stderr, "%s: Bad container index\n", filename);
+    goto fail;
+  }
+  if (count && !(c->entries = calloc(count, sizeof(struct container_entry)))) {
+    fprintf(stderr, "Out of memory!\n");
+    goto fail;
+  }
+  c->alloc = count;
+  if (fseeko(c->file, index, SEEK_SET)) {
+    perror(filename);
+    goto fail;
+  }
+  for (i = 0; i < count; i++) {
+    struct container_entry *e = &c->entries[i];
+    if (fread(buf, 1, sizeof(buf), c->file) != sizeof(buf)) {
+      fprintf(stderr, "%s: Truncated container index\n", filename);
+      goto fail;
+    }
+    e->track = buf[0];
+    e->side = buf[1];
+    e->flags = buf[2] | (buf[3]<<8);
+    e->offset = container_get64(buf+8);
+    e->length = container_get64(buf+16);
+    if (e->offset < CONTAINER_HEADER_SIZE || e->offset > (uint64_t)index ||
+	e->length > (uint64_t)index - e->offset) {
+      fprintf(stderr, "%s: Bad container index\n", filename);
+      goto fail;
+    }
+  }
+  c->count = count;
+  return c;
+
+ fail:
+  container_free(c);
+  return NULL;
+}
+
+const struct container_entry *container_find(const struct container *c,
+					     unsigned track, unsigned side)
+{
+  unsigned i;
+  /* A track captured more than once is represented by its last entry
+     that was not discarded */
+  for (i = c->count; i-- > 0; )
+    if (c->entries[i].track == track && c->entries[i].side == side &&
+	!(c->entries[i].flags & CONTAINER_ENTRY_DISCARDED))
+      return &c->entries[i];
+  return NULL;
+}
+
+bool container_copy_entry(struct container *c,
+			  const struct container_entry *e, FILE *out)
+{
+  uint8_t buf[65536];
+  uint64_t left = e->length;
+  if (fseeko(c->file, e->offset, SEEK_SET)) {
+    perror(c->filename);
+    return false;
+  }
+  while (left > 0) {
+    size_t n = (left > sizeof(buf)? sizeof(buf) : left);
+    if (fread(buf, 1, n, c->file) != n) {
+      fprintf(stderr, "%s: Truncated container\n", c->filename);
+      return false;
+    }
+    if (fwrite(buf, 1, n, out) != n) {
+      fprintf(stderr, "Failed to write data to file\n");
+      return false;
+    }
+    left -= n;
+  }
+  return true;
+}
@@ -0,0 +1,76 @@
+/* container.h: single file container for the streams of a whole disk
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_CONTAINER_H
+# define OPENDTC_CONTAINER_H
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stdio.h>
+
+/* Layout, all integers little endian:
+
+     header  "ODTCCONT", u32 version, u32 reserved
+     entries the bytes of each track's .raw file, back to back
+     index   per entry: u8 track, u8 side, u16 flags, u32 reserved,
+                        u64 offset, u64 length
+     footer  u64 index offset, u32 entry count, u32 version, "ODTCINDX"
+
+   Entries are appended while capturing; the index and footer are
+   written last, so a container without a footer was never finished. */
+
+# define CONTAINER_VERSION 1
+# define CONTAINER_HEADER_SIZE 16
+# define CONTAINER_INDEX_ENTRY_SIZE 24
+# define CONTAINER_FOOTER_SIZE 24
+
+/* Entry flags */
+# define CONTAINER_ENTRY_COMPLETE 1
+# define CONTAINER_ENTRY_COMPRESSED 2
+# define CONTAINER_ENTRY_DISCARDED 4
+
+struct container_entry {
+  unsigned track, side, flags;
+  uint64_t offset, length;
+};
+
+struct container {
+  char *filename;
+  FILE *file;
+  bool writing, failed;
+  struct container_entry *entries;
+  unsigned count, alloc;
+};
+
+extern struct container *container_create(const char *filename);
+extern FILE *container_begin_entry(struct container *c,
+				   unsigned track, unsigned side);
+extern bool container_end_entry(struct container *c, unsigned flags);
+extern bool container_discard_entry(struct container *c,
+				    unsigned track, unsigned side);
+extern bool container_finish(struct container *c);
+
+extern struct container *container_open(const char *filename);
+extern const struct container_entry *container_find(const struct container *c,
+						    unsigned track,
+						    unsigned side);
+extern bool container_copy_entry(struct container *c,
+				 const struct container_entry *e, FILE *out);
+
+extern void container_free(struct container *c);
+
+#endif /* OPENDTC_CONTAINER_H */
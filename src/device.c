@@ -22,6 +22,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <alloca.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #define KRYOFLUX_VID       0x03eb
 #define KRYOFLUX_PID       0x6124
@@ -30,12 +37,32 @@
 #define FW_FILENAME "firmware.bin"
 
 #define FW_LOAD_ADDRESS     0x00202000UL
-#define FW_WRITE_CHUNK_SIZE 16384
-#define FW_READ_CHUNK_SIZE  6400
+
+/* The image goes out in a single bulk transfer, so that the host
+   controller sends the packets back to back; the timeout allows for
+   the full speed USB of the bootloader */
+#define FW_TIMEOUT(size)    (2000 + (size) / 500)
+
+/* Milliseconds to wait for the board to come back with the firmware,
+   and between attempts when the bootloader answers instead */
+#define RENUMERATION_TIMEOUT 10000
+#define RENUMERATION_POLL    50
 
 #define ASYNC_READ_BUFFER_SIZE  6400
 #define ASYNC_READ_BUFFER_COUNT 100
 
+/* Auto-tuning starts out deep, and then keeps enough transfers queued
+   to cover twice the longest service gap seen on the first track */
+#define ASYNC_AUTOTUNE_INITIAL_COUNT   256
+#define ASYNC_AUTOTUNE_MIN_COMPLETIONS 8
+#define ASYNC_AUTOTUNE_MARGIN          2.0
+#define ASYNC_MIN_BUFFER_COUNT         4
+#define ASYNC_MAX_BUFFER_COUNT         1024
+
+/* Full revolutions streamed per track; the firmware counts index pulses */
+#define DEFAULT_REVOLUTIONS 5
+#define MAX_REVOLUTIONS     254
+
 #define REQTYPE_IN_VENDOR_OTHER 0xc3
 
 #define REQUEST_RESET     0x05
@@ -50,59 +77,143 @@
 #define REQUEST_STATUS    0x80
 #define REQUEST_INFO      0x81
 
-static usbapi_handle usbhdl = USBAPI_INVALID_HANDLE;
-static bool usbifcclaimed = false;
-static bool motor_on = false, stream_on = false;
-static usbapi_async_handle asynchdl = USBAPI_INVALID_ASYNC_HANDLE;
-
-static void device_close(void)
+#define REQUEST_REPLY_SIZE 512
+#define REQUEST_TIMEOUT    5000
+
+/* How a stream off from device_request_stream_off went */
+enum {
+  DEVICE_STOP_NONE,
+  DEVICE_STOP_PENDING,
+  DEVICE_STOP_DONE,
+  DEVICE_STOP_FAILED
+};
+
+/* Requests sent together by device_batch_send */
+#define DEVICE_MAX_BATCH 4
+
+struct device_batch {
+  unsigned count;
+  struct {
+    uint8_t request;
+    uint16_t index;
+    int *state;
+  } reqs[DEVICE_MAX_BATCH];
+};
+
+struct device_buffer {
+  uint8_t *buf;
+  uint32_t size;
+};
+
+/* Everything about one board; several can be driven at once, from one
+   capture thread each */
+struct device {
+  unsigned board;
+  usbapi_handle usbhdl;
+  bool usbifcclaimed;
+  bool motor_on, stream_on;
+  /* Settings the board last acknowledged, -1 when not known */
+  int motor, side, track;
+  usbapi_async_handle asynchdl;
+  pthread_mutex_t asynclock;
+  int async_count;
+  uint32_t async_size;
+  bool async_autotune;
+  /* The transfer settings the last capture was started with */
+  int capture_count;
+  uint32_t capture_size;
+  bool capture_tuning;
+  unsigned revolutions;
+  bool revolution_limit;
+  /* The stream off sent by device_request_stream_off */
+  struct usbapi_control stop_req;
+  uint8_t stop_reply[REQUEST_REPLY_SIZE];
+  atomic_int stop_state;
+  struct device_buffer *bufpool;
+  unsigned bufpool_count, bufpool_alloc;
+  /* The transfers of the last capture */
+  struct telemetry_transfers transfers;
+};
+
+/* Open devices, closed at exit */
+static struct device *devices[DEVICE_MAX_BOARDS];
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool usb_initialized = false;
+
+/* The firmware image, mapped on first use and shared by all boards */
+static const uint8_t *firmware = NULL;
+static uint32_t firmware_size = 0;
+static bool firmware_verify = true;
+static pthread_mutex_t firmware_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* For the USB event thread, started along with the first device */
+static bool event_realtime = false;
+static int event_cpu = -1;
+
+static void device_release_buffers(struct device *dev);
+static void device_free_async_read(struct device *dev);
+
+static void device_shutdown(struct device *dev)
 {
-  if (usbhdl != USBAPI_INVALID_HANDLE) {
-    if (stream_on) {
-      device_stream_off();
-      stream_on = false;
+  if (dev->usbhdl != USBAPI_INVALID_HANDLE) {
+    if (dev->stream_on ||
+	atomic_load(&dev->stop_state) == DEVICE_STOP_PENDING) {
+      device_stream_off(dev);
+      dev->stream_on = false;
     }
-    if (asynchdl != USBAPI_INVALID_ASYNC_HANDLE) {
-      usbapi_async_cancel(usbhdl, asynchdl);
-      device_finish_async_read();
+    if (dev->asynchdl != USBAPI_INVALID_ASYNC_HANDLE) {
+      usbapi_async_cancel(dev->usbhdl, dev->asynchdl);
+      device_finish_async_read(dev);
+      device_free_async_read(dev);
     }
-    if (motor_on) {
-      device_motor_off();
-      motor_on = false;
+    device_release_buffers(dev);
+    if (dev->motor_on) {
+      device_motor_off(dev);
+      dev->motor_on = false;
     }
-    if (usbifcclaimed) {
-      usbapi_release_interface(usbhdl, KRYOFLUX_INTERFACE);
-      usbifcclaimed = false;
+    if (dev->usbifcclaimed) {
+      usbapi_release_interface(dev->usbhdl, KRYOFLUX_INTERFACE);
+      dev->usbifcclaimed = false;
     }
-    usbapi_close(usbhdl);
-    usbhdl = USBAPI_INVALID_HANDLE;
+    usbapi_close(dev->usbhdl);
+    dev->usbhdl = USBAPI_INVALID_HANDLE;
   }
 }
 
 static void device_exit(void)
 {
-  device_close();
+  unsigned i;
+  pthread_mutex_lock(&devices_lock);
+  for (i = 0; i < DEVICE_MAX_BOARDS; i++)
+    if (devices[i])
+      device_shutdown(devices[i]);
+  pthread_mutex_unlock(&devices_lock);
   usbapi_exit();
+  if (firmware) {
+    munmap((void *)firmware, firmware_size);
+    firmware = NULL;
+  }
 }
 
-static bool device_claim_interface(void)
+static bool device_claim_interface(struct device *dev)
 {
-  return (usbifcclaimed = usbapi_claim_interface(usbhdl, KRYOFLUX_INTERFACE));
+  return (dev->usbifcclaimed =
+	  usbapi_claim_interface(dev->usbhdl, KRYOFLUX_INTERFACE));
 }
 
-static bool device_send_bl_string(const char *s)
+static bool device_send_bl_string(struct device *dev, const char *s)
 {
   unsigned l = strlen(s);
   uint8_t *outbuf = alloca(l);
   memcpy(outbuf, s, l);
-  return usbapi_sync_bulk_out(usbhdl, 1, outbuf, l, 1000);
+  return usbapi_sync_bulk_out(dev->usbhdl, 1, outbuf, l, 1000);
 }
 
-static bool device_recv_bl_string(char *buf, unsigned size)
+static bool device_recv_bl_string(struct device *dev, char *buf, unsigned size)
 {
   unsigned tot = 0;
   while (tot < size) {
-    int32_t l = usbapi_sync_bulk_in(usbhdl, 2, (uint8_t *)buf+tot,
+    int32_t l = usbapi_sync_bulk_in(dev->usbhdl, 2, (uint8_t *)buf+tot,
 				    size-tot, 1000);
     if (l<0)
       return false;
@@ -116,16 +227,12 @@ static bool device_recv_bl_string(char *buf, unsigned size)
   return true;
 }
 
-static int32_t device_control_in(uint8_t request, uint16_t index, bool silent)
+/* The board answers with name=value, value being the low byte of the
+   index it was given */
+static bool device_check_reply(uint8_t *buf, int32_t l, uint16_t index)
 {
-  uint8_t buf[512];
-  int32_t l;
   char *p, *e;
-  l = usbapi_sync_control_in(usbhdl, REQTYPE_IN_VENDOR_OTHER, request,
-			     0, index, buf, sizeof(buf), 5000, silent);
-  if (l<0)
-    return l;
-  buf[(l>=sizeof(buf)? sizeof(buf)-1:l)] = 0;
+  buf[(l>=REQUEST_REPLY_SIZE? REQUEST_REPLY_SIZE-1:l)] = 0;
 #ifdef DEVICE_DEBUG
   printf("Device says: %s\n", buf);
 #endif
@@ -136,34 +243,97 @@ static int32_t device_control_in(uint8_t request, uint16_t index, bool silent)
     p = "";
   if (strtol(p, &e, 10) != (index & 0xff) || e == p) {
     fprintf(stderr, "Device request failed\n");
-    return -1;
+    return false;
   }
+  return true;
+}
+
+static int32_t device_control_in(struct device *dev, uint8_t request,
+				 uint16_t index, bool silent)
+{
+  uint8_t buf[REQUEST_REPLY_SIZE];
+  int32_t l;
+  l = usbapi_sync_control_in(dev->usbhdl, REQTYPE_IN_VENDOR_OTHER, request,
+			     0, index, buf, sizeof(buf), REQUEST_TIMEOUT,
+			     silent);
+  if (l<0)
+    return l;
+  if (!device_check_reply(buf, l, index))
+    return -1;
   return l;
 }
 
-static bool device_try_check_status(void)
+/* A request with a state is left out if the board already has that
+   setting, and the state is updated from the reply */
+static void device_batch_add(struct device_batch *b, uint8_t request,
+			     uint16_t index, int *state)
 {
-  return device_control_in(REQUEST_STATUS, 0, true)>=0;
+  if (state && *state == index)
+    return;
+  b->reqs[b->count].request = request;
+  b->reqs[b->count].index = index;
+  b->reqs[b->count].state = state;
+  b->count++;
 }
 
-static bool device_do_request(uint8_t request, uint16_t index)
+/* All requests are queued at once, so each reaches the board as soon
+   as it is done with the one before, without a round trip through the
+   host in between */
+static bool device_batch_send(struct device *dev, struct device_batch *b)
 {
-  return device_control_in(request, index, false)>=0;
+  struct usbapi_control ctl[DEVICE_MAX_BATCH];
+  uint8_t buf[DEVICE_MAX_BATCH][REQUEST_REPLY_SIZE];
+  unsigned i;
+  bool r, ok;
+
+  if (!b->count)
+    return true;
+  for (i = 0; i < b->count; i++) {
+    ctl[i].request = b->reqs[i].request;
+    ctl[i].value = 0;
+    ctl[i].index = b->reqs[i].index;
+    ctl[i].buf = buf[i];
+    ctl[i].size = REQUEST_REPLY_SIZE;
+  }
+  r = usbapi_control_in_batch(dev->usbhdl, REQTYPE_IN_VENDOR_OTHER,
+			      ctl, b->count, REQUEST_TIMEOUT);
+  for (i = 0; i < b->count; i++) {
+    ok = ctl[i].len >= 0 && device_check_reply(buf[i], ctl[i].len,
+					       ctl[i].index);
+    if (!ok)
+      r = false;
+    if (b->reqs[i].state)
+      *b->reqs[i].state = (ok? ctl[i].index : -1);
+  }
+  b->count = 0;
+  return r;
 }
 
-static bool device_check_fw_present(void)
+static bool device_try_check_status(struct device *dev)
 {
-  bool last_present, present = device_try_check_status();
+  return device_control_in(dev, REQUEST_STATUS, 0, true)>=0;
+}
+
+static bool device_do_request(struct device *dev, uint8_t request,
+			      uint16_t index)
+{
+  return device_control_in(dev, request, index, false)>=0;
+}
+
+static bool device_check_fw_present(struct device *dev)
+{
+  bool last_present, present = device_try_check_status(dev);
   do {
     last_present = present;
-    present = device_try_check_status();
+    present = device_try_check_status(dev);
   } while(present != last_present);
   return present;
 }
 
-static bool device_query_fw(const char *id, char *buf, unsigned size)
+static bool device_query_fw(struct device *dev, const char *id,
+			    char *buf, unsigned size)
 {
-  if (device_send_bl_string(id) && device_recv_bl_string(buf, 512)) {
+  if (device_send_bl_string(dev, id) && device_recv_bl_string(dev, buf, 512)) {
 #ifdef DEVICE_DEBUG
     printf("Device response to %s: %s", id, buf);
 #endif
@@ -172,142 +342,152 @@ static bool device_query_fw(const char *id, char *buf, unsigned size)
     return false;
 }
 
-static bool device_upload_firmware(uint8_t *fw, uint32_t fw_size)
+static bool device_upload_firmware(struct device *dev,
+				   const uint8_t *fw, uint32_t fw_size)
 {
   char buf[512];
   uint32_t offs;
-  bool vfy_failed;
-  char *fw_vfy;
+  uint8_t *fw_vfy;
 
-  if (!device_query_fw("N#", buf, 512) ||
-      !device_query_fw("V#", buf, 512)) {
+  if (!device_query_fw(dev, "N#", buf, 512) ||
+      !device_query_fw(dev, "V#", buf, 512)) {
     return false;
   }
 
   snprintf(buf, sizeof(buf), "S%08lx,%08lx#",
 	   (unsigned long)FW_LOAD_ADDRESS, (unsigned long)fw_size);
-  if (!device_send_bl_string(buf))
+  if (!device_send_bl_string(dev, buf))
     return false;
 
-  for (offs = 0; offs < fw_size; offs += FW_WRITE_CHUNK_SIZE) {
-    uint32_t chunk = (offs+FW_WRITE_CHUNK_SIZE >= fw_size?
-		      fw_size-offs : FW_WRITE_CHUNK_SIZE);
-    if (!usbapi_sync_bulk_out(usbhdl, 1, fw+offs, chunk, 2000))
-      return false;
-  }
-
-  snprintf(buf, sizeof(buf), "R%08lx,%08lx#",
-	   (unsigned long)FW_LOAD_ADDRESS, (unsigned long)fw_size);
-  if (!device_send_bl_string(buf))
+  if (!usbapi_sync_bulk_out(dev->usbhdl, 1, (uint8_t *)fw, fw_size,
+			    FW_TIMEOUT(fw_size)))
     return false;
 
-  fw_vfy = malloc(FW_READ_CHUNK_SIZE);
-  if (!fw_vfy) {
-    fprintf(stderr, "Out of memory!\n");
-    return false;
-  }
+  if (firmware_verify) {
+    snprintf(buf, sizeof(buf), "R%08lx,%08lx#",
+	     (unsigned long)FW_LOAD_ADDRESS, (unsigned long)fw_size);
+    if (!device_send_bl_string(dev, buf))
+      return false;
 
-  vfy_failed = false;
-  for (offs = 0; offs < fw_size; ) {
-    uint32_t chunk = (offs+FW_READ_CHUNK_SIZE >= fw_size?
-		      fw_size-offs : FW_READ_CHUNK_SIZE);
-    int32_t l = usbapi_sync_bulk_in(usbhdl, 2, fw_vfy, chunk, 2000);
-    if (l<0) {
-      free (fw_vfy);
+    fw_vfy = malloc(fw_size);
+    if (!fw_vfy) {
+      fprintf(stderr, "Out of memory!\n");
       return false;
     }
-    if (l>0) {
-      if (memcmp(fw_vfy, fw+offs, l))
-	vfy_failed = true;
+
+    /* Whatever the bootloader sends at once is taken in one read */
+    for (offs = 0; offs < fw_size; ) {
+      int32_t l = usbapi_sync_bulk_in(dev->usbhdl, 2, fw_vfy+offs,
+				      fw_size-offs, FW_TIMEOUT(fw_size));
+      if (l<0) {
+	free (fw_vfy);
+	return false;
+      }
+      offs += l;
     }
-    offs += l;
-  }
 
-  free(fw_vfy);
-  if (vfy_failed) {
-    fprintf(stderr, "Firmware verify failed!\n");
-    return false;
+    if (memcmp(fw_vfy, fw, fw_size)) {
+      free(fw_vfy);
+      fprintf(stderr, "Firmware verify failed!\n");
+      return false;
+    }
+    free(fw_vfy);
   }
 
   snprintf(buf, sizeof(buf), "G%08lx#", (unsigned long)FW_LOAD_ADDRESS);
-  if (!device_send_bl_string(buf))
+  if (!device_send_bl_string(dev, buf))
     return false;
 
   return true;
 }
 
-static uint8_t *device_load_firmware(uint32_t *psize)
+/* The file is mapped rather than read, and only once however many
+   boards need it */
+static const uint8_t *device_load_firmware(uint32_t *psize)
 {
-  uint32_t size = 0, allocsize = 0;
-  uint8_t *buf = NULL;
-  size_t l;
   const char *filename = FW_FILENAME;
-  FILE *f;
-
-  f = fopen(filename, "rb");
-  if (!f) {
-    perror(filename);
-    return NULL;
-  }
-  do {
-    if (size >= allocsize) {
-      uint8_t *newbuf;
-      allocsize = (size? size + (size>>1) : 8192);
-      newbuf = realloc(buf, allocsize);
-      if (newbuf == NULL) {
-	fprintf(stderr, "Out of memory!\n");
-	fclose(f);
-	free(buf);
-	return NULL;
-      } else {
-	buf = newbuf;
-      }
-    }
-    l = fread(buf+size, 1, allocsize-size, f);
-    size += l;
-    if (ferror(f)) {
+  const uint8_t *fw;
+  struct stat st;
+  void *m;
+  int fd;
+
+  pthread_mutex_lock(&firmware_lock);
+  if (!firmware) {
+    if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st)) {
       perror(filename);
-      fclose(f);
-      free(buf);
-      return NULL;
+      if (fd >= 0)
+	close(fd);
+    } else if (!st.st_size || st.st_size > UINT32_MAX) {
+      fprintf(stderr, "%s: Bad firmware size\n", filename);
+      close(fd);
+    } else {
+      m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (m == MAP_FAILED)
+	perror(filename);
+      else {
+	firmware = m;
+	firmware_size = st.st_size;
+      }
     }
-  } while (!feof(f));
-  fclose(f);
-  *psize = size;
-  return buf;
+  }
+  fw = firmware;
+  *psize = firmware_size;
+  pthread_mutex_unlock(&firmware_lock);
+  return fw;
 }
 
-static bool device_install_firmware(void)
+static bool device_install_firmware(struct device *dev)
 {
-  bool ret;
   uint32_t fw_size;
-  uint8_t *fw = device_load_firmware(&fw_size);
+  const uint8_t *fw = device_load_firmware(&fw_size);
   if (!fw)
     return false;
-  ret = device_upload_firmware(fw, fw_size);
-  free(fw);
-  return ret;
+  return device_upload_firmware(dev, fw, fw_size);
 }
 
-static bool device_reset(void)
+static bool device_reset(struct device *dev)
 {
-  return
-    device_do_request(REQUEST_RESET, 0) &&
-    device_do_request(REQUEST_INFO, 1) &&
-    device_do_request(REQUEST_INFO, 2);
+  struct device_batch b = { 0 };
+  dev->motor = dev->side = dev->track = -1;
+  if (!device_do_request(dev, REQUEST_RESET, 0))
+    return false;
+  device_batch_add(&b, REQUEST_INFO, 1, NULL);
+  device_batch_add(&b, REQUEST_INFO, 2, NULL);
+  return device_batch_send(dev, &b);
 }
 
-bool device_init(void)
+/* The bootloader can still be found for a moment after the jump to the
+   firmware, so a board not answering as the firmware is let go and
+   waited for again */
+static bool device_reconnect(struct device *dev)
 {
-  if (!usbapi_init())
-    return false;
-  atexit(device_exit);
-  usbhdl = usbapi_open(KRYOFLUX_VID, KRYOFLUX_PID, 0);
-  if (usbhdl == USBAPI_INVALID_HANDLE ||
-      !device_claim_interface())
+  double deadline = telemetry_now() + RENUMERATION_TIMEOUT * 1e-3, left;
+  for (;;) {
+    left = deadline - telemetry_now();
+    dev->usbhdl = usbapi_wait_open(KRYOFLUX_VID, KRYOFLUX_PID, dev->board,
+				   (left > 0? left * 1e3 : 0));
+    if (dev->usbhdl == USBAPI_INVALID_HANDLE)
+      return false;
+    if (device_claim_interface(dev) && device_check_fw_present(dev))
+      return true;
+    device_shutdown(dev);
+    if (telemetry_now() >= deadline) {
+      fprintf(stderr, "Device renumerated without working firmware!\n");
+      return false;
+    }
+    usleep(RENUMERATION_POLL * 1000);
+  }
+}
+
+static bool device_init(struct device *dev)
+{
+  dev->usbhdl = usbapi_open(KRYOFLUX_VID, KRYOFLUX_PID, dev->board);
+  if (dev->usbhdl == USBAPI_INVALID_HANDLE ||
+      !device_claim_interface(dev))
     return false;
 
-  if (device_check_fw_present()) {
+  if (device_check_fw_present(dev)) {
 #ifdef DEVICE_DEBUG
     printf("Device has FW already\n");
 #endif
@@ -315,87 +495,384 @@ bool device_init(void)
 #ifdef DEVICE_DEBUG
     printf("No FW uploaded in device\n");
 #endif
-    if (!device_install_firmware())
+    if (!device_install_firmware(dev))
       return false;
 
     /* Need to reopen the device after renumeration */
-    device_close();
-    sleep(1);
-    usbhdl = usbapi_open(KRYOFLUX_VID, KRYOFLUX_PID, 0);
-    if (usbhdl == USBAPI_INVALID_HANDLE ||
-	!device_claim_interface())
+    device_shutdown(dev);
+    if (!device_reconnect(dev))
       return false;
+  }
 
-    if (!device_check_fw_present()) {
-      fprintf(stderr, "Device renumerated without working firmware!\n");
-      return false;
+  return device_reset(dev);
+}
+
+/* Opens the board'th KryoFlux on the bus, loading the firmware if
+   needed.  The libusb context is shared by all boards. */
+struct device *device_open(unsigned board)
+{
+  struct device *dev;
+  if (board >= DEVICE_MAX_BOARDS) {
+    fprintf(stderr, "Board number %u out of range\n", board);
+    return NULL;
+  }
+  pthread_mutex_lock(&devices_lock);
+  if (devices[board]) {
+    pthread_mutex_unlock(&devices_lock);
+    fprintf(stderr, "Board %u is already open\n", board);
+    return NULL;
+  }
+  if (!usb_initialized) {
+    if (!usbapi_init()) {
+      pthread_mutex_unlock(&devices_lock);
+      return NULL;
     }
+    atexit(device_exit);
+    usb_initialized = true;
+    /* As when the thread fails later on, the capture threads can still
+       handle the events themselves, for every board alike */
+    if (!usbapi_start_event_thread(event_realtime, event_cpu))
+      fprintf(stderr, "Handling USB events without the event thread\n");
+  }
+  if (!(dev = calloc(1, sizeof(struct device)))) {
+    pthread_mutex_unlock(&devices_lock);
+    fprintf(stderr, "Out of memory!\n");
+    return NULL;
+  }
+  dev->board = board;
+  dev->usbhdl = USBAPI_INVALID_HANDLE;
+  dev->asynchdl = USBAPI_INVALID_ASYNC_HANDLE;
+  pthread_mutex_init(&dev->asynclock, NULL);
+  atomic_init(&dev->stop_state, DEVICE_STOP_NONE);
+  dev->async_count = ASYNC_READ_BUFFER_COUNT;
+  dev->async_size = ASYNC_READ_BUFFER_SIZE;
+  dev->revolutions = DEFAULT_REVOLUTIONS;
+  dev->revolution_limit = true;
+  devices[board] = dev;
+  pthread_mutex_unlock(&devices_lock);
+
+  if (!device_init(dev)) {
+    device_close(dev);
+    return NULL;
   }
+  return dev;
+}
 
-  return device_reset();
+/* Without verification, the image is not read back after uploading;
+   the firmware still has to answer once the board has renumerated */
+void device_set_firmware_verify(bool verify)
+{
+  firmware_verify = verify;
 }
 
-bool device_configure(int device, int density, int min_track, int max_track)
+/* Takes effect if called before the first device is opened */
+void device_set_event_thread(bool realtime, int cpu)
 {
-  return
-    device_do_request(REQUEST_DEVICE, device) &&
-    device_do_request(REQUEST_DENSITY, density) &&
-    device_do_request(REQUEST_MIN_TRACK, min_track) &&
-    device_do_request(REQUEST_MAX_TRACK, max_track);
+  event_realtime = realtime;
+  event_cpu = cpu;
 }
 
-bool device_motor_on(int side, int track)
+void device_close(struct device *dev)
 {
-  motor_on = true;
+  if (!dev)
+    return;
+  pthread_mutex_lock(&devices_lock);
+  devices[dev->board] = NULL;
+  pthread_mutex_unlock(&devices_lock);
+  device_shutdown(dev);
+  pthread_mutex_destroy(&dev->asynclock);
+  free(dev);
+}
 
-  return
-    device_do_request(REQUEST_MOTOR, 1) &&
-    device_do_request(REQUEST_SIDE, side) &&
-    device_do_request(REQUEST_TRACK, track);
+bool device_configure(struct device *dev, int device, int density,
+		      int min_track, int max_track)
+{
+  struct device_batch b = { 0 };
+  device_batch_add(&b, REQUEST_DEVICE, device, NULL);
+  device_batch_add(&b, REQUEST_DENSITY, density, NULL);
+  device_batch_add(&b, REQUEST_MIN_TRACK, min_track, NULL);
+  device_batch_add(&b, REQUEST_MAX_TRACK, max_track, NULL);
+  return device_batch_send(dev, &b);
 }
 
-bool device_motor_off(void)
+/* Only what differs from the last call is sent, so stepping from one
+   track to the next is usually a single request */
+bool device_motor_on(struct device *dev, int side, int track)
 {
-  if (device_do_request(REQUEST_MOTOR, 0)) {
-    motor_on = false;
+  struct device_batch b = { 0 };
+  dev->motor_on = true;
+
+  device_batch_add(&b, REQUEST_MOTOR, 1, &dev->motor);
+  device_batch_add(&b, REQUEST_SIDE, side, &dev->side);
+  device_batch_add(&b, REQUEST_TRACK, track, &dev->track);
+  return device_batch_send(dev, &b);
+}
+
+bool device_motor_off(struct device *dev)
+{
+  struct device_batch b = { 0 };
+  device_batch_add(&b, REQUEST_MOTOR, 0, &dev->motor);
+  if (device_batch_send(dev, &b)) {
+    dev->motor_on = false;
     return true;
   } else
     return false;
 }
 
-bool device_stream_on(void)
+bool device_stream_on(struct device *dev)
 {
-  stream_on = true;
+  dev->stream_on = true;
+  atomic_store(&dev->stop_state, DEVICE_STOP_NONE);
 
-  return device_do_request(REQUEST_STREAM, 0x601);
+  return device_do_request(dev, REQUEST_STREAM,
+			   (dev->revolution_limit?
+			    (dev->revolutions + 1) << 8 : 0) | 1);
 }
 
-bool device_stream_off(void)
+/* Also waits out a stream off from device_request_stream_off, which
+   went ahead of this one on the control pipe */
+bool device_stream_off(struct device *dev)
 {
-  if (device_do_request(REQUEST_STREAM, 0)) {
-    stream_on = false;
+  if (device_do_request(dev, REQUEST_STREAM, 0)) {
+    dev->stream_on = false;
     return true;
   } else
     return false;
 }
 
-bool device_start_async_read(bool (*callback)(const uint8_t *, uint32_t))
+static void device_stream_off_done(void *ctx, struct usbapi_control *req)
 {
-  asynchdl = usbapi_async_bulk_in(usbhdl, 2, ASYNC_READ_BUFFER_COUNT,
-				  ASYNC_READ_BUFFER_SIZE, 2000, callback);
-  if (asynchdl == USBAPI_INVALID_ASYNC_HANDLE)
-    return false;
+  struct device *dev = ctx;
+  if (req->len >= 0 && device_check_reply(req->buf, req->len, req->index)) {
+    atomic_store(&dev->stop_state, DEVICE_STOP_DONE);
+    return;
+  }
+  /* Otherwise the stream would run on until the transfers time out */
+  atomic_store(&dev->stop_state, DEVICE_STOP_FAILED);
+  device_cancel_async_read(dev);
+}
 
-  return true;
+/* Asks the board to end the stream without waiting for the reply, so
+   that it can be called from any thread while streaming, including
+   one the USB callback may be waiting for.  Only the first call after
+   device_stream_on sends anything. */
+bool device_request_stream_off(struct device *dev)
+{
+  int state = DEVICE_STOP_NONE;
+  if (!atomic_compare_exchange_strong(&dev->stop_state, &state,
+				      DEVICE_STOP_PENDING))
+    return true;
+  dev->stop_req.request = REQUEST_STREAM;
+  dev->stop_req.value = 0;
+  dev->stop_req.index = 0;
+  dev->stop_req.buf = dev->stop_reply;
+  dev->stop_req.size = REQUEST_REPLY_SIZE;
+  if (usbapi_control_in_async(dev->usbhdl, REQTYPE_IN_VENDOR_OTHER,
+			      &dev->stop_req, REQUEST_TIMEOUT,
+			      device_stream_off_done, dev))
+    return true;
+  atomic_store(&dev->stop_state, DEVICE_STOP_FAILED);
+  return false;
+}
+
+void device_set_revolutions(struct device *dev, unsigned revs)
+{
+  dev->revolutions = (revs < 1? 1 :
+		      (revs > MAX_REVOLUTIONS? MAX_REVOLUTIONS : revs));
+}
+
+unsigned device_get_revolutions(struct device *dev)
+{
+  return dev->revolutions;
+}
+
+/* Without the limit, the firmware streams until told to stop */
+void device_set_revolution_limit(struct device *dev, bool limit)
+{
+  dev->revolution_limit = limit;
+}
+
+uint32_t device_async_buffer_size(struct device *dev)
+{
+  return dev->async_size;
+}
+
+/* A count of 0 selects auto-tuning.  Takes effect on the next capture. */
+void device_set_async_params(struct device *dev, int count, uint32_t size)
+{
+  if (dev->asynchdl != USBAPI_INVALID_ASYNC_HANDLE)
+    device_free_async_read(dev);
+  dev->async_autotune = (count == 0);
+  dev->async_count = (count? count : ASYNC_AUTOTUNE_INITIAL_COUNT);
+  dev->async_size = size;
+}
+
+void device_get_async_params(struct device *dev, int *count, uint32_t *size,
+			     bool *tuning)
+{
+  *count = dev->async_count;
+  *size = dev->async_size;
+  *tuning = dev->async_autotune;
+}
+
+/* Unlike device_get_async_params, not changed by tuning at the end of
+   the capture */
+void device_get_capture_params(struct device *dev, int *count,
+			       uint32_t *size, bool *tuning)
+{
+  *count = dev->capture_count;
+  *size = dev->capture_size;
+  *tuning = dev->capture_tuning;
+}
+
+static void device_autotune(struct device *dev)
+{
+  const struct telemetry_transfers *stats = &dev->transfers;
+  double rate, stall, need;
+  int count;
+
+  if (stats->completions < ASYNC_AUTOTUNE_MIN_COMPLETIONS ||
+      stats->duration <= 0)
+    return;
+  rate = stats->bytes / stats->duration;
+  stall = (stats->gaps.max > stats->callbacks.max?
+	   stats->gaps.max : stats->callbacks.max);
+  need = rate * stall * ASYNC_AUTOTUNE_MARGIN;
+  /* One more to round the division up, and one for the transfer
+     being serviced */
+  count = (int)(need / dev->async_size) + 2;
+  if (count < ASYNC_MIN_BUFFER_COUNT)
+    count = ASYNC_MIN_BUFFER_COUNT;
+  if (count > ASYNC_MAX_BUFFER_COUNT)
+    count = ASYNC_MAX_BUFFER_COUNT;
+#ifdef DEVICE_DEBUG
+  printf("Autotune: %.0f bytes/s, gap %.3f ms, callback %.3f ms -> %d\n",
+	 rate, stats->gaps.max*1e3, stats->callbacks.max*1e3, count);
+#endif
+  dev->async_autotune = false;
+  if (count != dev->async_count) {
+    device_free_async_read(dev);
+    dev->async_count = count;
+  }
+}
+
+/* Buffers are kept in a pool for the lifetime of the device handle, so
+   that captures after the first one do not allocate anything.  Only to
+   be called from the thread running the capture.  Without a device the
+   buffers come straight from the USB layer. */
+uint8_t *device_alloc_buffer(struct device *dev, uint32_t size)
+{
+  unsigned i;
+  if (!dev)
+    return usbapi_alloc_buffer(USBAPI_INVALID_HANDLE, size);
+  for (i = dev->bufpool_count; i-- > 0; )
+    if (dev->bufpool[i].size == size) {
+      uint8_t *buf = dev->bufpool[i].buf;
+      dev->bufpool[i] = dev->bufpool[--dev->bufpool_count];
+      return buf;
+    }
+  return usbapi_alloc_buffer(dev->usbhdl, size);
+}
+
+void device_free_buffer(struct device *dev, uint8_t *buf, uint32_t size)
+{
+  if (buf == NULL)
+    return;
+  if (!dev) {
+    usbapi_free_buffer(USBAPI_INVALID_HANDLE, buf, size);
+    return;
+  }
+  if (dev->bufpool_count >= dev->bufpool_alloc) {
+    struct device_buffer *newpool =
+      realloc(dev->bufpool,
+	      (dev->bufpool_alloc*2 + 64) * sizeof(struct device_buffer));
+    if (newpool == NULL) {
+      usbapi_free_buffer(dev->usbhdl, buf, size);
+      return;
+    }
+    dev->bufpool = newpool;
+    dev->bufpool_alloc = dev->bufpool_alloc*2 + 64;
+  }
+  dev->bufpool[dev->bufpool_count].buf = buf;
+  dev->bufpool[dev->bufpool_count].size = size;
+  dev->bufpool_count++;
+}
+
+static void device_release_buffers(struct device *dev)
+{
+  while (dev->bufpool_count > 0) {
+    --dev->bufpool_count;
+    usbapi_free_buffer(dev->usbhdl, dev->bufpool[dev->bufpool_count].buf,
+		       dev->bufpool[dev->bufpool_count].size);
+  }
+  free(dev->bufpool);
+  dev->bufpool = NULL;
+  dev->bufpool_alloc = 0;
+}
+
+/* The transfers are allocated on the first capture and then reused for
+   every following track until the device is closed */
+bool device_start_async_read(struct device *dev,
+			     bool (*callback)(void *, uint8_t **, uint32_t),
+			     void *ctx)
+{
+  memset(&dev->transfers, 0, sizeof(dev->transfers));
+  dev->capture_count = dev->async_count;
+  dev->capture_size = dev->async_size;
+  dev->capture_tuning = dev->async_autotune;
+  if (dev->asynchdl == USBAPI_INVALID_ASYNC_HANDLE) {
+    usbapi_async_handle hdl =
+      usbapi_async_alloc_bulk_in(dev->usbhdl, 2, dev->async_count,
+				 dev->async_size, 2000);
+    if (hdl == USBAPI_INVALID_ASYNC_HANDLE)
+      return false;
+
+    pthread_mutex_lock(&dev->asynclock);
+    dev->asynchdl = hdl;
+    pthread_mutex_unlock(&dev->asynclock);
+  }
+
+  return usbapi_async_submit(dev->usbhdl, dev->asynchdl, callback, ctx);
 }
 
-bool device_finish_async_read(void)
+/* May be called from another thread than the one running the capture */
+bool device_cancel_async_read(struct device *dev)
 {
   bool r = true;
-  if (asynchdl != USBAPI_INVALID_ASYNC_HANDLE) {
-    r = usbapi_async_finish(usbhdl, asynchdl);
-    asynchdl = USBAPI_INVALID_ASYNC_HANDLE;
+  pthread_mutex_lock(&dev->asynclock);
+  if (dev->asynchdl != USBAPI_INVALID_ASYNC_HANDLE)
+    r = usbapi_async_cancel(dev->usbhdl, dev->asynchdl);
+  pthread_mutex_unlock(&dev->asynclock);
+  return r;
+}
+
+bool device_finish_async_read(struct device *dev)
+{
+  bool r = true;
+  if (dev->asynchdl != USBAPI_INVALID_ASYNC_HANDLE) {
+    r = usbapi_async_finish(dev->usbhdl, dev->asynchdl);
+    usbapi_async_get_stats(dev->usbhdl, dev->asynchdl, &dev->transfers);
+    if (atomic_load(&dev->stop_state) == DEVICE_STOP_FAILED)
+      r = false;
+    if (r && dev->async_autotune)
+      device_autotune(dev);
   }
   return r;
 }
 
+static void device_free_async_read(struct device *dev)
+{
+  usbapi_async_handle hdl;
+  pthread_mutex_lock(&dev->asynclock);
+  hdl = dev->asynchdl;
+  dev->asynchdl = USBAPI_INVALID_ASYNC_HANDLE;
+  pthread_mutex_unlock(&dev->asynclock);
+  usbapi_async_free(dev->usbhdl, hdl);
+}
+
+/* The transfers of the capture last finished */
+void device_get_transfer_stats(struct device *dev,
+			       struct telemetry_transfers *stats)
+{
+  *stats = dev->transfers;
+}
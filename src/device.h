@@ -20,15 +20,44 @@
 
 # include <stdint.h>
 # include <stdbool.h>
+# include <telemetry.h>
 
-extern bool device_init(void);
-extern bool device_configure(int device, int density,
+/* Boards are numbered in bus order, starting from 0 */
+# define DEVICE_MAX_BOARDS 16
+
+struct device;
+
+extern struct device *device_open(unsigned board);
+extern void device_close(struct device *dev);
+extern void device_set_event_thread(bool realtime, int cpu);
+extern void device_set_firmware_verify(bool verify);
+extern bool device_configure(struct device *dev, int device, int density,
 			     int min_track, int max_track);
-extern bool device_motor_on(int side, int track);
-extern bool device_motor_off(void);
-extern bool device_stream_on(void);
-extern bool device_stream_off(void);
-extern bool device_start_async_read(bool (*callback)(const uint8_t *, uint32_t));
-extern bool device_finish_async_read(void);
+extern bool device_motor_on(struct device *dev, int side, int track);
+extern bool device_motor_off(struct device *dev);
+extern bool device_stream_on(struct device *dev);
+extern bool device_stream_off(struct device *dev);
+extern bool device_request_stream_off(struct device *dev);
+extern void device_set_revolutions(struct device *dev, unsigned revs);
+extern unsigned device_get_revolutions(struct device *dev);
+extern void device_set_revolution_limit(struct device *dev, bool limit);
+extern void device_set_async_params(struct device *dev,
+				    int count, uint32_t size);
+extern void device_get_async_params(struct device *dev, int *count,
+				    uint32_t *size, bool *tuning);
+extern void device_get_capture_params(struct device *dev, int *count,
+				      uint32_t *size, bool *tuning);
+extern uint32_t device_async_buffer_size(struct device *dev);
+extern uint8_t *device_alloc_buffer(struct device *dev, uint32_t size);
+extern void device_free_buffer(struct device *dev,
+			       uint8_t *buf, uint32_t size);
+extern bool device_start_async_read(struct device *dev,
+				    bool (*callback)(void *, uint8_t **,
+						     uint32_t),
+				    void *ctx);
+extern bool device_cancel_async_read(struct device *dev);
+extern bool device_finish_async_read(struct device *dev);
+extern void device_get_transfer_stats(struct device *dev,
+				      struct telemetry_transfers *stats);
 
 #endif /* OPENDTC_DEVICE_H */
@@ -0,0 +1,193 @@
+/* extract.c -- extract per track stream files from a container
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <config.h>
+#include <container.h>
+#include <fluxz.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <alloca.h>
+
+static const char *opt_filename = NULL;
+static bool opt_list = false;
+static struct fluxz *fluxz = NULL;
+
+static int parse_options(int argc, char **argv)
+{
+  int i;
+  for (i=1; i<argc; i++)
+    if (argv[i][0] != '-')
+      break;
+    else switch(argv[i][1]) {
+    case 'h':
+      printf("Usage: %s [options] container.dtc\n"
+	     "       %s stream.rawz...\n"
+	     "-f<name>: set filename of the extracted files\n"
+	     "          (default: container name without .dtc)\n"
+	     "-l      : list the tracks instead of extracting them\n"
+	     "Compressed streams are restored to their original .raw form.\n",
+	     argv[0], argv[0]);
+      exit(0);
+      break;
+    case 'f':
+      opt_filename = argv[i]+2;
+      break;
+    case 'l':
+      opt_list = true;
+      break;
+    default:
+      fprintf(stderr, "Invalid command: %s\n", argv[i]);
+      return -1;
+    }
+  return i;
+}
+
+static bool extract_entry(struct container *c, const struct container_entry *e,
+			  const char *filename_base)
+{
+  int fnbufsize = strlen(filename_base)+10;
+  char *fnbuf = alloca(fnbufsize);
+  FILE *f;
+  bool r;
+  snprintf(fnbuf, fnbufsize, "%s%02u.%u.raw", filename_base,
+	   e->track, e->side);
+  if (!(f = fopen(fnbuf, "wb"))) {
+    perror(fnbuf);
+    return false;
+  }
+  if (e->flags & CONTAINER_ENTRY_COMPRESSED) {
+    if (fseeko(c->file, e->offset, SEEK_SET)) {
+      perror(c->filename);
+      r = false;
+    } else
+      r = fluxz_decompress(fluxz, c->file, f);
+  } else
+    r = container_copy_entry(c, e, f);
+  if (fclose(f)) {
+    perror(fnbuf);
+    r = false;
+  }
+  return r;
+}
+
+static bool is_compressed_file(const char *filename)
+{
+  uint8_t header[FLUXZ_HEADER_SIZE];
+  FILE *f = fopen(filename, "rb");
+  bool r;
+  if (!f)
+    return false;
+  r = (fread(header, 1, sizeof(header), f) == sizeof(header) &&
+       fluxz_is_compressed(header, sizeof(header)));
+  fclose(f);
+  return r;
+}
+
+static bool decompress_file(const char *filename)
+{
+  size_t l = strlen(filename);
+  char *outname = alloca(l+5);
+  FILE *in, *out;
+  bool r;
+  strcpy(outname, filename);
+  if (l > 5 && !strcmp(outname+l-5, ".rawz"))
+    outname[l-1] = 0;
+  else
+    strcpy(outname+l, ".raw");
+  if (!(in = fopen(filename, "rb"))) {
+    perror(filename);
+    return false;
+  }
+  if (!(out = fopen(outname, "wb"))) {
+    perror(outname);
+    fclose(in);
+    return false;
+  }
+  printf("%s -> %s\n", filename, outname);
+  r = fluxz_decompress(fluxz, in, out);
+  fclose(in);
+  if (fclose(out)) {
+    perror(outname);
+    r = false;
+  }
+  return r;
+}
+
+int main (int argc, char *argv[])
+{
+  struct container *c;
+  char *base;
+  unsigned i;
+  bool ok = true;
+  int arg = parse_options(argc, argv);
+  if (arg < 0)
+    return 1;
+  if (arg >= argc) {
+    fprintf(stderr, "No container specified\n");
+    return 1;
+  }
+  if (!(fluxz = fluxz_new()))
+    return 1;
+  if (is_compressed_file(argv[arg])) {
+    for (; arg < argc; arg++)
+      if (!decompress_file(argv[arg]))
+	ok = false;
+    fluxz_free(fluxz);
+    return (ok? 0 : 1);
+  }
+  if (arg != argc-1) {
+    fprintf(stderr, "Only one container at a time\n");
+    fluxz_free(fluxz);
+    return 1;
+  }
+  if (!(c = container_open(argv[arg]))) {
+    fluxz_free(fluxz);
+    return 1;
+  }
+  if (opt_filename)
+    base = strdup(opt_filename);
+  else {
+    size_t l = strlen(argv[arg]);
+    base = strdup(argv[arg]);
+    if (base && l > 4 && !strcmp(base+l-4, ".dtc"))
+      base[l-4] = 0;
+  }
+  if (!base) {
+    fprintf(stderr, "Out of memory!\n");
+    container_free(c);
+    fluxz_free(fluxz);
+    return 1;
+  }
+  for (i = 0; i < c->count; i++) {
+    const struct container_entry *e = &c->entries[i];
+    if (container_find(c, e->track, e->side) != e)
+      /* Superseded by a later capture of the same track */
+      continue;
+    printf("%02u.%u    : %10llu bytes%s%s\n", e->track, e->side,
+	   (unsigned long long)e->length,
+	   ((e->flags & CONTAINER_ENTRY_COMPRESSED)? ", compressed" : ""),
+	   ((e->flags & CONTAINER_ENTRY_COMPLETE)? "" : ", incomplete"));
+    if (!opt_list && !extract_entry(c, e, base))
+      ok = false;
+  }
+  free(base);
+  container_free(c);
+  fluxz_free(fluxz);
+  return (ok? 0 : 1);
+}
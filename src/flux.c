@@ -0,0 +1,347 @@
+/* flux.c -- decoding of KryoFlux streams into flux intervals
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* The decoder does not check the framing; that is the parser's job.
+   It tolerates what it can and sets failed on allocation failures or
+   an index block that can no longer be placed.
+
+   An index block names the stream position of the first flux after
+   the pulse and the number of ticks from the previous flux to the
+   pulse.  The block may come before or after that flux in the stream,
+   so the start positions of the most recent fluxes are kept. */
+
+#include <config.h>
+#include <flux.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+struct flux_track *flux_track_new(void)
+{
+  struct flux_track *t = calloc(1, sizeof(struct flux_track));
+  if (!t) {
+    fprintf(stderr, "Out of memory!\n");
+    return NULL;
+  }
+  t->sck = FLUX_DEFAULT_SCK;
+  t->ick = FLUX_DEFAULT_ICK;
+  return t;
+}
+
+void flux_track_free(struct flux_track *t)
+{
+  if (!t)
+    return;
+  free(t->ticks);
+  free(t->long_pos);
+  free(t->long_ticks);
+  free(t->index_flux);
+  free(t->index_offset);
+  free(t);
+}
+
+static bool flux_grow(void **array, uint32_t *alloc, uint32_t count,
+		      size_t elemsize, uint32_t initial)
+{
+  uint32_t n;
+  void *p;
+  if (count < *alloc)
+    return true;
+  n = (*alloc? *alloc*2 : initial);
+  if (!(p = realloc(*array, n * elemsize)))
+    return false;
+  *array = p;
+  *alloc = n;
+  return true;
+}
+
+uint32_t flux_track_interval(const struct flux_track *t, uint32_t i)
+{
+  uint32_t lo = 0, hi = t->long_count;
+  if (t->ticks[i] != FLUX_LONG)
+    return t->ticks[i];
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (t->long_pos[mid] < i)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return t->long_ticks[lo];
+}
+
+unsigned flux_track_revolutions(const struct flux_track *t)
+{
+  return (t->index_count > 1? t->index_count - 1 : 0);
+}
+
+uint64_t flux_track_revolution_ticks(const struct flux_track *t, unsigned rev)
+{
+  uint64_t ticks = 0;
+  uint32_t i;
+  for (i = t->index_flux[rev]; i < t->index_flux[rev+1]; i++)
+    ticks += flux_track_interval(t, i);
+  return ticks - t->index_offset[rev] + t->index_offset[rev+1];
+}
+
+static bool flux_add_index(struct flux_decoder *d, uint32_t flux,
+			   uint32_t offset)
+{
+  struct flux_track *t = d->track;
+  uint32_t alloc = t->index_alloc;
+  if (!flux_grow((void **)&t->index_flux, &alloc, t->index_count,
+		 sizeof(uint32_t), 16) ||
+      !flux_grow((void **)&t->index_offset, &t->index_alloc, t->index_count,
+		 sizeof(uint32_t), 16)) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  t->index_flux[t->index_count] = flux;
+  t->index_offset[t->index_count] = offset;
+  t->index_count++;
+  return true;
+}
+
+static bool flux_emit(struct flux_decoder *d, uint32_t value, uint32_t pos)
+{
+  struct flux_track *t = d->track;
+  uint32_t n = t->count;
+  unsigned i, j;
+  if (!flux_grow((void **)&t->ticks, &t->alloc, n, sizeof(uint16_t), 65536)) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  if (value >= FLUX_LONG) {
+    uint32_t alloc = t->long_alloc;
+    if (!flux_grow((void **)&t->long_pos, &alloc, t->long_count,
+		   sizeof(uint32_t), 64) ||
+	!flux_grow((void **)&t->long_ticks, &t->long_alloc, t->long_count,
+		   sizeof(uint32_t), 64)) {
+      fprintf(stderr, "Out of memory!\n");
+      return false;
+    }
+    t->long_pos[t->long_count] = n;
+    t->long_ticks[t->long_count] = value;
+    t->long_count++;
+    t->ticks[n] = FLUX_LONG;
+  } else
+    t->ticks[n] = value;
+  t->count++;
+  d->recent_pos[n % FLUX_RECENT] = pos;
+
+  for (i = j = 0; i < d->pending_count; i++)
+    if (d->pending_pos[i] <= pos) {
+      if (!flux_add_index(d, n, d->pending_offset[i]))
+	return false;
+    } else {
+      d->pending_pos[j] = d->pending_pos[i];
+      d->pending_offset[j] = d->pending_offset[i];
+      j++;
+    }
+  d->pending_count = j;
+  return true;
+}
+
+static bool flux_index(struct flux_decoder *d, uint32_t pos, uint32_t offset)
+{
+  struct flux_track *t = d->track;
+  uint32_t lo, hi;
+  if (!t->count || d->recent_pos[(t->count-1) % FLUX_RECENT] < pos) {
+    /* The flux has not been seen yet */
+    if (d->pending_count >= FLUX_MAX_PENDING)
+      return false;
+    d->pending_pos[d->pending_count] = pos;
+    d->pending_offset[d->pending_count] = offset;
+    d->pending_count++;
+    return true;
+  }
+  lo = (t->count > FLUX_RECENT? t->count - FLUX_RECENT : 0);
+  hi = t->count - 1;
+  if (d->recent_pos[lo % FLUX_RECENT] > pos && lo > 0)
+    /* Too far back */
+    return false;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (d->recent_pos[mid % FLUX_RECENT] < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return flux_add_index(d, lo, offset);
+}
+
+static uint32_t flux_get32(const uint8_t *p)
+{
+  return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static void flux_info(struct flux_decoder *d)
+{
+  const char *s;
+  unsigned l = (d->oob_got < sizeof(d->oob)? d->oob_got : sizeof(d->oob)-1);
+  d->oob[l] = 0;
+  if ((s = strstr((char *)d->oob, "sck=")))
+    d->track->sck = strtod(s+4, NULL);
+  if ((s = strstr((char *)d->oob, "ick=")))
+    d->track->ick = strtod(s+4, NULL);
+}
+
+static void flux_oob(struct flux_decoder *d)
+{
+  d->in_oob = false;
+  switch (d->oob_type) {
+  case 2:
+    /* Index */
+    if (d->oob_got >= 8 && !flux_index(d, flux_get32(d->oob),
+				       flux_get32(d->oob+4)))
+      d->failed = true;
+    break;
+  case 4:
+    /* KFInfo */
+    flux_info(d);
+    break;
+  }
+}
+
+static unsigned flux_code_length(uint8_t c)
+{
+  if (c <= 7)
+    return 2;
+  if (c >= 0xe)
+    return 1;
+  switch (c) {
+  case 0x0b:
+    return 1;
+  case 0x0c:
+    return 3;
+  case 0x0d:
+    return 4;
+  default:
+    /* Nop1-Nop3 */
+    return c - 7;
+  }
+}
+
+/* Handles one complete code, or the header of an OOB block */
+static bool flux_code(struct flux_decoder *d, const uint8_t *p, unsigned l)
+{
+  uint32_t value;
+  if (*p == 0x0d) {
+    unsigned size = p[2] | (p[3] << 8);
+    if (p[1] == 0x0d && size == 0x0d0d) {
+      d->done = true;
+      return true;
+    }
+    d->in_oob = true;
+    d->oob_type = p[1];
+    d->oob_size = size;
+    d->oob_got = 0;
+    if (!size)
+      flux_oob(d);
+    return true;
+  }
+  if (!d->overflow)
+    d->flux_pos = d->streampos;
+  d->streampos += l;
+  if (*p >= 0xe)
+    value = *p;
+  else if (*p <= 7)
+    value = (p[0] << 8) | p[1];
+  else if (*p == 0x0c)
+    value = (p[1] << 8) | p[2];
+  else {
+    if (*p == 0x0b)
+      d->overflow += 0x10000;
+    return true;
+  }
+  value += d->overflow;
+  d->overflow = 0;
+  return flux_emit(d, value, d->flux_pos);
+}
+
+void flux_decoder_init(struct flux_decoder *d, struct flux_track *t)
+{
+  memset(d, 0, offsetof(struct flux_decoder, oob));
+  d->track = t;
+  d->pending_count = 0;
+}
+
+bool flux_decoder_feed(struct flux_decoder *d,
+		       const uint8_t *data, uint32_t len)
+{
+  while (len > 0 && !d->done && !d->failed) {
+    unsigned l;
+    if (d->in_oob) {
+      uint32_t n = d->oob_size - d->oob_got;
+      if (n > len)
+	n = len;
+      if (d->oob_got < sizeof(d->oob))
+	memcpy(d->oob + d->oob_got, data,
+	       (d->oob_got + n > sizeof(d->oob)?
+		sizeof(d->oob) - d->oob_got : n));
+      d->oob_got += n;
+      data += n;
+      len -= n;
+      if (d->oob_got == d->oob_size)
+	flux_oob(d);
+      continue;
+    }
+    if (d->carry_len) {
+      l = flux_code_length(d->carry[0]);
+      while (d->carry_len < l && len > 0) {
+	d->carry[d->carry_len++] = *data++;
+	--len;
+      }
+      if (d->carry_len < l)
+	break;
+      d->carry_len = 0;
+      if (!flux_code(d, d->carry, l))
+	d->failed = true;
+      continue;
+    }
+    if (*data >= 0xe) {
+      /* Fast path for the common case */
+      if (d->overflow) {
+	if (!flux_code(d, data, 1))
+	  d->failed = true;
+      } else if (!flux_emit(d, *data, d->streampos++))
+	d->failed = true;
+      data++;
+      --len;
+      continue;
+    }
+    l = flux_code_length(*data);
+    if (l > len) {
+      memcpy(d->carry, data, len);
+      d->carry_len = len;
+      break;
+    }
+    if (!flux_code(d, data, l))
+      d->failed = true;
+    data += l;
+    len -= l;
+  }
+  return !d->failed;
+}
+
+bool flux_decoder_finish(struct flux_decoder *d)
+{
+  /* Index pulses after the last flux have no interval to go in */
+  d->pending_count = 0;
+  return !d->failed;
+}
@@ -0,0 +1,89 @@
+/* flux.h: decoding of KryoFlux streams into flux intervals
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_FLUX_H
+# define OPENDTC_FLUX_H
+
+# include <stdint.h>
+# include <stdbool.h>
+
+# define FLUX_DEFAULT_SCK (18432000.0 * 73 / 14 / 4)
+# define FLUX_DEFAULT_ICK (FLUX_DEFAULT_SCK / 8)
+
+/* Intervals that don't fit in 16 bits are stored as FLUX_LONG */
+# define FLUX_LONG 0xffff
+
+struct flux_track {
+  /* Flux intervals in sample clock ticks, in stream order */
+  uint16_t *ticks;
+  uint32_t count, alloc;
+
+  /* The intervals stored as FLUX_LONG: their position and full value */
+  uint32_t *long_pos, *long_ticks;
+  uint32_t long_count, long_alloc;
+
+  /* Index pulses: the interval each one falls in, and how many ticks
+     into that interval it came */
+  uint32_t *index_flux, *index_offset;
+  uint32_t index_count, index_alloc;
+
+  /* Clocks from the KFInfo block, or the defaults */
+  double sck, ick;
+};
+
+# define FLUX_RECENT 4096
+# define FLUX_MAX_PENDING 8
+
+/* Streaming decoder state; bytes can be fed in arbitrary pieces */
+struct flux_decoder {
+  struct flux_track *track;
+  bool done, failed;
+  uint32_t streampos;
+
+  /* Ovl16 seen for the flux being decoded, and where it began */
+  uint32_t overflow, flux_pos;
+
+  /* A code split between two feeds */
+  uint8_t carry[4];
+  unsigned carry_len;
+
+  /* OOB block being received */
+  bool in_oob;
+  unsigned oob_type, oob_size, oob_got;
+  uint8_t oob[256];
+
+  /* Where recent fluxes began, to place index blocks that come late */
+  uint32_t recent_pos[FLUX_RECENT];
+
+  /* Index blocks for fluxes not decoded yet */
+  uint32_t pending_pos[FLUX_MAX_PENDING], pending_offset[FLUX_MAX_PENDING];
+  unsigned pending_count;
+};
+
+extern struct flux_track *flux_track_new(void);
+extern void flux_track_free(struct flux_track *t);
+extern uint32_t flux_track_interval(const struct flux_track *t, uint32_t i);
+extern unsigned flux_track_revolutions(const struct flux_track *t);
+extern uint64_t flux_track_revolution_ticks(const struct flux_track *t,
+					    unsigned rev);
+
+extern void flux_decoder_init(struct flux_decoder *d, struct flux_track *t);
+extern bool flux_decoder_feed(struct flux_decoder *d,
+			      const uint8_t *data, uint32_t len);
+extern bool flux_decoder_finish(struct flux_decoder *d);
+
+#endif /* OPENDTC_FLUX_H */
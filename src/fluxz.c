@@ -0,0 +1,330 @@
+/* fluxz.c -- lossless compression of KryoFlux streams
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Most of a stream is Flux1 samples, one byte per cell, and on a
+   formatted track the cells fall into two or three narrow clusters.
+   An adaptive binary range coder, with each byte coded as a path down
+   a bit tree whose probabilities depend on the previous byte, gets
+   close to the entropy of such data and adapts to the density and
+   drive speed by itself.  The rarer multi byte codes and OOB blocks go
+   through the same model and cost a little more. */
+
+#include <config.h>
+#include <fluxz.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define FLUXZ_PROB_BITS 11
+#define FLUXZ_PROB_INIT (1 << (FLUXZ_PROB_BITS-1))
+#define FLUXZ_MOVE_BITS 4
+#define FLUXZ_TOP (1u << 24)
+
+/* A probability never drops below 15/2048, so no bit costs more than
+   eight bits, plus the final flush */
+#define FLUXZ_CODED_MAX (8*FLUXZ_BLOCK_SIZE + 16)
+
+struct fluxz {
+  uint16_t prob[256][256];
+  uint8_t prev;
+
+  /* Where the coded bytes go */
+  bool (*sink)(void *ctx, const uint8_t *data, uint32_t len);
+  void *ctx;
+  uint8_t *raw, *coded;
+  uint32_t rawlen, codedlen, codedpos;
+  uint64_t total_raw, total_coded;
+
+  /* Range coder state */
+  uint64_t low;
+  uint32_t range, code;
+  uint8_t cache;
+  uint32_t cache_size;
+};
+
+static void fluxz_put32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t fluxz_get32(const uint8_t *p)
+{
+  return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static void fluxz_reset_model(struct fluxz *z)
+{
+  unsigned i, j;
+  for (i = 0; i < 256; i++)
+    for (j = 0; j < 256; j++)
+      z->prob[i][j] = FLUXZ_PROB_INIT;
+  z->prev = 0;
+}
+
+struct fluxz *fluxz_new(void)
+{
+  struct fluxz *z = calloc(1, sizeof(struct fluxz));
+  if (!z || !(z->raw = malloc(FLUXZ_BLOCK_SIZE)) ||
+      !(z->coded = malloc(FLUXZ_CODED_MAX))) {
+    fprintf(stderr, "Out of memory!\n");
+    fluxz_free(z);
+    return NULL;
+  }
+  return z;
+}
+
+void fluxz_free(struct fluxz *z)
+{
+  if (!z)
+    return;
+  free(z->raw);
+  free(z->coded);
+  free(z);
+}
+
+/* Encoder */
+
+static void fluxz_shift_low(struct fluxz *z)
+{
+  if ((uint32_t)z->low < 0xff000000u || (z->low >> 32)) {
+    uint8_t carry = z->low >> 32;
+    uint8_t temp = z->cache;
+    do {
+      z->coded[z->codedlen++] = temp + carry;
+      temp = 0xff;
+    } while (--z->cache_size);
+    z->cache = z->low >> 24;
+  }
+  z->cache_size++;
+  z->low = (z->low & 0x00ffffffu) << 8;
+}
+
+static void fluxz_encode_byte(struct fluxz *z, uint8_t c)
+{
+  uint16_t *prob = z->prob[z->prev];
+  unsigned node = 1;
+  int i;
+  for (i = 7; i >= 0; --i) {
+    unsigned bit = (c >> i) & 1;
+    uint16_t *p = &prob[node];
+    uint32_t bound = (z->range >> FLUXZ_PROB_BITS) * *p;
+    if (!bit) {
+      z->range = bound;
+      *p += ((1 << FLUXZ_PROB_BITS) - *p) >> FLUXZ_MOVE_BITS;
+    } else {
+      z->low += bound;
+      z->range -= bound;
+      *p -= *p >> FLUXZ_MOVE_BITS;
+    }
+    while (z->range < FLUXZ_TOP) {
+      z->range <<= 8;
+      fluxz_shift_low(z);
+    }
+    node = (node << 1) | bit;
+  }
+  z->prev = c;
+}
+
+static bool fluxz_flush_block(struct fluxz *z)
+{
+  uint8_t header[8];
+  uint32_t i;
+  if (!z->rawlen)
+    return true;
+  z->low = 0;
+  z->range = 0xffffffffu;
+  z->cache = 0;
+  z->cache_size = 1;
+  z->codedlen = 0;
+  for (i = 0; i < z->rawlen; i++)
+    fluxz_encode_byte(z, z->raw[i]);
+  for (i = 0; i < 5; i++)
+    fluxz_shift_low(z);
+  fluxz_put32(header, z->rawlen);
+  fluxz_put32(header+4, z->codedlen);
+  if (!z->sink(z->ctx, header, 8) ||
+      !z->sink(z->ctx, z->coded, z->codedlen))
+    return false;
+  z->total_raw += z->rawlen;
+  z->total_coded += z->codedlen + 8;
+  z->rawlen = 0;
+  return true;
+}
+
+static bool fluxz_write_sink(void *ctx, const uint8_t *data, uint32_t len)
+{
+  if (fwrite(data, 1, len, (FILE *)ctx) != len) {
+    fprintf(stderr, "Failed to write data to file\n");
+    return false;
+  }
+  return true;
+}
+
+/* The sink reports its own errors */
+bool fluxz_begin_sink(struct fluxz *z,
+		      bool (*sink)(void *ctx, const uint8_t *data,
+				   uint32_t len),
+		      void *ctx)
+{
+  uint8_t header[FLUXZ_HEADER_SIZE];
+  fluxz_reset_model(z);
+  z->sink = sink;
+  z->ctx = ctx;
+  z->rawlen = 0;
+  z->total_raw = 0;
+  z->total_coded = FLUXZ_HEADER_SIZE;
+  memcpy(header, FLUXZ_MAGIC, 7);
+  header[7] = FLUXZ_VERSION;
+  return sink(ctx, header, sizeof(header));
+}
+
+bool fluxz_begin(struct fluxz *z, FILE *out)
+{
+  return fluxz_begin_sink(z, fluxz_write_sink, out);
+}
+
+bool fluxz_write(struct fluxz *z, const uint8_t *data, size_t len)
+{
+  while (len > 0) {
+    size_t n = FLUXZ_BLOCK_SIZE - z->rawlen;
+    if (n > len)
+      n = len;
+    memcpy(z->raw + z->rawlen, data, n);
+    z->rawlen += n;
+    data += n;
+    len -= n;
+    if (z->rawlen == FLUXZ_BLOCK_SIZE && !fluxz_flush_block(z))
+      return false;
+  }
+  return true;
+}
+
+bool fluxz_finish(struct fluxz *z)
+{
+  uint8_t trailer[8];
+  if (!fluxz_flush_block(z))
+    return false;
+  memset(trailer, 0, sizeof(trailer));
+  if (!z->sink(z->ctx, trailer, sizeof(trailer)))
+    return false;
+  z->total_coded += sizeof(trailer);
+  z->sink = NULL;
+  return true;
+}
+
+void fluxz_get_sizes(const struct fluxz *z, uint64_t *raw, uint64_t *coded)
+{
+  *raw = z->total_raw;
+  *coded = z->total_coded;
+}
+
+/* Decoder */
+
+bool fluxz_is_compressed(const uint8_t *header, size_t len)
+{
+  return len >= FLUXZ_HEADER_SIZE && !memcmp(header, FLUXZ_MAGIC, 7);
+}
+
+static uint8_t fluxz_next_coded(struct fluxz *z)
+{
+  /* A corrupt block may run past its end; the lengths are checked by
+     the caller */
+  return (z->codedpos < z->codedlen? z->coded[z->codedpos++] : 0);
+}
+
+static uint8_t fluxz_decode_byte(struct fluxz *z)
+{
+  uint16_t *prob = z->prob[z->prev];
+  unsigned node = 1;
+  while (node < 0x100) {
+    uint16_t *p = &prob[node];
+    uint32_t bound = (z->range >> FLUXZ_PROB_BITS) * *p;
+    if (z->code < bound) {
+      z->range = bound;
+      *p += ((1 << FLUXZ_PROB_BITS) - *p) >> FLUXZ_MOVE_BITS;
+      node <<= 1;
+    } else {
+      z->code -= bound;
+      z->range -= bound;
+      *p -= *p >> FLUXZ_MOVE_BITS;
+      node = (node << 1) | 1;
+    }
+    while (z->range < FLUXZ_TOP) {
+      z->range <<= 8;
+      z->code = (z->code << 8) | fluxz_next_coded(z);
+    }
+  }
+  return z->prev = node;
+}
+
+bool fluxz_decode(struct fluxz *z, FILE *in,
+		  bool (*sink)(void *ctx, const uint8_t *data, uint32_t len),
+		  void *ctx)
+{
+  uint8_t header[8];
+  if (fread(header, 1, FLUXZ_HEADER_SIZE, in) != FLUXZ_HEADER_SIZE ||
+      !fluxz_is_compressed(header, FLUXZ_HEADER_SIZE)) {
+    fprintf(stderr, "Not a compressed stream\n");
+    return false;
+  }
+  if (header[7] != FLUXZ_VERSION) {
+    fprintf(stderr, "Unsupported compressed stream version %u\n", header[7]);
+    return false;
+  }
+  fluxz_reset_model(z);
+  for (;;) {
+    uint32_t i;
+    if (fread(header, 1, 8, in) != 8) {
+      fprintf(stderr, "Truncated compressed stream\n");
+      return false;
+    }
+    z->rawlen = fluxz_get32(header);
+    z->codedlen = fluxz_get32(header+4);
+    if (!z->rawlen && !z->codedlen)
+      return true;
+    if (z->rawlen > FLUXZ_BLOCK_SIZE || z->codedlen > FLUXZ_CODED_MAX ||
+	z->codedlen < 5) {
+      fprintf(stderr, "Corrupt compressed stream\n");
+      return false;
+    }
+    if (fread(z->coded, 1, z->codedlen, in) != z->codedlen) {
+      fprintf(stderr, "Truncated compressed stream\n");
+      return false;
+    }
+    z->codedpos = 0;
+    z->range = 0xffffffffu;
+    z->code = 0;
+    for (i = 0; i < 5; i++)
+      z->code = (z->code << 8) | fluxz_next_coded(z);
+    for (i = 0; i < z->rawlen; i++)
+      z->raw[i] = fluxz_decode_byte(z);
+    if (z->codedpos + 4 < z->codedlen) {
+      fprintf(stderr, "Corrupt compressed stream\n");
+      return false;
+    }
+    if (!sink(ctx, z->raw, z->rawlen))
+      return false;
+  }
+}
+
+bool fluxz_decompress(struct fluxz *z, FILE *in, FILE *out)
+{
+  return fluxz_decode(z, in, fluxz_write_sink, out);
+}
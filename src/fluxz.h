@@ -0,0 +1,58 @@
+/* fluxz.h: lossless compression of KryoFlux streams
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_FLUXZ_H
+# define OPENDTC_FLUXZ_H
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stdio.h>
+
+/* Layout: "ODTCFLZ" and a version byte, then blocks of u32 raw length,
+   u32 coded length (little endian) and the coded bytes, terminated by
+   a block with both lengths zero.  Each block is range coded on its
+   own, but the model carries over from block to block, so a file can
+   only be decoded from the start. */
+
+# define FLUXZ_MAGIC "ODTCFLZ"
+# define FLUXZ_VERSION 1
+# define FLUXZ_HEADER_SIZE 8
+# define FLUXZ_BLOCK_SIZE 65536
+
+struct fluxz;
+
+extern struct fluxz *fluxz_new(void);
+extern void fluxz_free(struct fluxz *z);
+
+extern bool fluxz_begin(struct fluxz *z, FILE *out);
+extern bool fluxz_begin_sink(struct fluxz *z,
+			     bool (*sink)(void *ctx, const uint8_t *data,
+					  uint32_t len),
+			     void *ctx);
+extern bool fluxz_write(struct fluxz *z, const uint8_t *data, size_t len);
+extern bool fluxz_finish(struct fluxz *z);
+extern void fluxz_get_sizes(const struct fluxz *z,
+			    uint64_t *raw, uint64_t *coded);
+
+extern bool fluxz_is_compressed(const uint8_t *header, size_t len);
+extern bool fluxz_decompress(struct fluxz *z, FILE *in, FILE *out);
+extern bool fluxz_decode(struct fluxz *z, FILE *in,
+			 bool (*sink)(void *ctx, const uint8_t *data,
+				      uint32_t len),
+			 void *ctx);
+
+#endif /* OPENDTC_FLUXZ_H */
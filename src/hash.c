@@ -0,0 +1,185 @@
+/* hash.c -- digests of stream files
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* SHA-256 as in FIPS 180-4.  The digests are worked out on the writer
+   as the file is written, at a few ns per byte, well above the rate
+   the device streams at. */
+
+#include <config.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char * const hash_names[] = {
+  [HASH_NONE] = "none",
+  [HASH_SHA256] = "sha256",
+};
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256 *s, const uint8_t *p)
+{
+  uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+  unsigned i;
+  for (i = 0; i < 16; i++)
+    w[i] = ((uint32_t)p[4*i] << 24) | ((uint32_t)p[4*i+1] << 16) |
+      ((uint32_t)p[4*i+2] << 8) | p[4*i+3];
+  for (; i < 64; i++)
+    w[i] = w[i-16] + (ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3)) +
+      w[i-7] + (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10));
+  a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+  e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+  for (i = 0; i < 64; i++) {
+    t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+      sha256_k[i] + w[i];
+    t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+  s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256_init(struct sha256 *s)
+{
+  static const uint32_t h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(s->h, h0, sizeof(h0));
+  s->len = 0;
+}
+
+static void sha256_update(struct sha256 *s, const uint8_t *data, size_t len)
+{
+  unsigned fill = s->len % 64, n;
+  s->len += len;
+  if (fill) {
+    n = 64 - fill;
+    if (n > len)
+      n = len;
+    memcpy(s->buf + fill, data, n);
+    data += n;
+    len -= n;
+    if (fill + n < 64)
+      return;
+    sha256_block(s, s->buf);
+  }
+  /* Whole blocks straight from the data */
+  for (; len >= 64; data += 64, len -= 64)
+    sha256_block(s, data);
+  memcpy(s->buf, data, len);
+}
+
+static void sha256_final(struct sha256 *s, uint8_t *digest)
+{
+  uint64_t bits = s->len * 8;
+  unsigned fill = s->len % 64, i;
+  s->buf[fill++] = 0x80;
+  if (fill > 56) {
+    memset(s->buf + fill, 0, 64 - fill);
+    sha256_block(s, s->buf);
+    fill = 0;
+  }
+  memset(s->buf + fill, 0, 56 - fill);
+  for (i = 0; i < 8; i++)
+    s->buf[56 + i] = bits >> (56 - 8*i);
+  sha256_block(s, s->buf);
+  for (i = 0; i < 32; i++)
+    digest[i] = s->h[i/4] >> (24 - 8*(i%4));
+}
+
+int hash_algorithm(const char *name)
+{
+  int i;
+  for (i = 0; i < sizeof(hash_names)/sizeof(hash_names[0]); i++)
+    if (!strcmp(name, hash_names[i]))
+      return i;
+  return -1;
+}
+
+const char *hash_name(int alg)
+{
+  return hash_names[alg];
+}
+
+void hash_init(struct hash *h, int alg)
+{
+  h->alg = alg;
+  if (alg == HASH_SHA256)
+    sha256_init(&h->u.sha256);
+}
+
+void hash_update(struct hash *h, const uint8_t *data, size_t len)
+{
+  if (h->alg == HASH_SHA256)
+    sha256_update(&h->u.sha256, data, len);
+}
+
+/* An empty string with HASH_NONE */
+void hash_final(struct hash *h, char *hex)
+{
+  uint8_t digest[32];
+  unsigned i, n = 0;
+  if (h->alg == HASH_SHA256) {
+    sha256_final(&h->u.sha256, digest);
+    n = 32;
+  }
+  for (i = 0; i < n; i++)
+    sprintf(hex + 2*i, "%02x", digest[i]);
+  hex[2*n] = 0;
+}
+
+bool hash_file(int alg, const char *filename, char *hex)
+{
+  uint8_t buf[65536];
+  struct hash h;
+  size_t n;
+  bool r;
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    perror(filename);
+    return false;
+  }
+  hash_init(&h, alg);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    hash_update(&h, buf, n);
+  if (!(r = !ferror(f)))
+    perror(filename);
+  fclose(f);
+  hash_final(&h, hex);
+  return r;
+}
@@ -0,0 +1,54 @@
+/* hash.h: digests of stream files
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_HASH_H
+# define OPENDTC_HASH_H
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stddef.h>
+
+enum {
+  HASH_NONE,
+  HASH_SHA256
+};
+
+/* Room for the digest of any of them in hex, with the terminator */
+# define HASH_HEX_SIZE 65
+
+struct sha256 {
+  uint32_t h[8];
+  uint64_t len;
+  uint8_t buf[64];
+};
+
+struct hash {
+  int alg;
+  union {
+    struct sha256 sha256;
+  } u;
+};
+
+extern int hash_algorithm(const char *name);
+extern const char *hash_name(int alg);
+extern void hash_init(struct hash *h, int alg);
+extern void hash_update(struct hash *h, const uint8_t *data, size_t len);
+extern void hash_final(struct hash *h, char *hex);
+/* Reads the whole file; false if it could not be read */
+extern bool hash_file(int alg, const char *filename, char *hex);
+
+#endif /* OPENDTC_HASH_H */
@@ -0,0 +1,179 @@
+/* journal.c -- record of the tracks captured so far
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* The journal is only a hint: a track is taken as done only if its file
+   still has the recorded size and CRC, so a line written just before a
+   crash, or for a file that was later lost, merely costs a capture. */
+
+#include <config.h>
+#include <journal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+struct journal_entry {
+  bool valid;
+  uint64_t size;
+  uint32_t crc;
+  char digest[JOURNAL_DIGEST_SIZE];  /* empty if none */
+};
+
+struct journal {
+  char *filename;
+  FILE *file;
+  struct journal_entry entries[JOURNAL_TRACKS][2];
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void journal_crc_init(void)
+{
+  uint32_t c;
+  unsigned i, k;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (k = 0; k < 8; k++)
+      c = (c & 1? (c >> 1) ^ 0xedb88320u : c >> 1);
+    crc_table[i] = c;
+  }
+}
+
+/* The CRC-32 of zip and PNG; start from 0 */
+uint32_t journal_crc(uint32_t crc, const uint8_t *data, size_t len)
+{
+  pthread_once(&crc_once, journal_crc_init);
+  crc = ~crc;
+  while (len--)
+    crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static void journal_set(struct journal *j, unsigned track, unsigned side,
+			uint64_t size, uint32_t crc, const char *digest)
+{
+  struct journal_entry *e = &j->entries[track][side];
+  e->valid = true;
+  e->size = size;
+  e->crc = crc;
+  snprintf(e->digest, sizeof(e->digest), "%s", (digest? digest : ""));
+}
+
+static void journal_read(struct journal *j, FILE *f)
+{
+  char line[256], digest[JOURNAL_DIGEST_SIZE];
+  unsigned track, side, crc;
+  unsigned long long size;
+  int n;
+  while (fgets(line, sizeof(line), f))
+    if ((n = sscanf(line, "%u.%u %llu %x %95s", &track, &side, &size, &crc,
+		    digest)) >= 4 && track < JOURNAL_TRACKS && side < 2)
+      journal_set(j, track, side, size, crc, (n > 4? digest : NULL));
+}
+
+struct journal *journal_open(const char *filename, bool resume)
+{
+  struct journal *j = calloc(1, sizeof(struct journal));
+  FILE *f;
+  if (!j || !(j->filename = strdup(filename))) {
+    fprintf(stderr, "Out of memory!\n");
+    free(j);
+    return NULL;
+  }
+  if (resume) {
+    if ((f = fopen(filename, "r"))) {
+      journal_read(j, f);
+      fclose(f);
+    } else if (errno != ENOENT)
+      perror(filename);
+  }
+  if (!(j->file = fopen(filename, (resume? "a" : "w")))) {
+    perror(filename);
+    free(j->filename);
+    free(j);
+    return NULL;
+  }
+  return j;
+}
+
+bool journal_close(struct journal *j)
+{
+  bool r = true;
+  if (!j)
+    return true;
+  if (fclose(j->file)) {
+    perror(j->filename);
+    r = false;
+  }
+  free(j->filename);
+  free(j);
+  return r;
+}
+
+/* Flushed right away, so that the line survives the program */
+bool journal_add(struct journal *j, unsigned track, unsigned side,
+		 uint64_t size, uint32_t crc, const char *digest)
+{
+  if (track >= JOURNAL_TRACKS || side >= 2)
+    return true;
+  journal_set(j, track, side, size, crc, digest);
+  if (fprintf(j->file, "%02u.%u %llu %08x%s%s\n", track, side,
+	      (unsigned long long)size, (unsigned)crc,
+	      (digest? " " : ""), (digest? digest : "")) < 0 ||
+      fflush(j->file)) {
+    perror(j->filename);
+    return false;
+  }
+  return true;
+}
+
+const char *journal_digest(struct journal *j, unsigned track,
+			  unsigned side, const char *alg)
+{
+  const struct journal_entry *e;
+  size_t l = strlen(alg);
+  if (track >= JOURNAL_TRACKS || side >= 2 ||
+      !(e = &j->entries[track][side])->valid ||
+      strncmp(e->digest, alg, l) || e->digest[l] != ':')
+    return NULL;
+  return e->digest + l + 1;
+}
+
+bool journal_check(struct journal *j, unsigned track, unsigned side,
+		   const char *filename)
+{
+  const struct journal_entry *e;
+  uint8_t buf[65536];
+  uint64_t size = 0;
+  uint32_t crc = 0;
+  size_t n;
+  FILE *f;
+  if (track >= JOURNAL_TRACKS || side >= 2 ||
+      !(e = &j->entries[track][side])->valid ||
+      !(f = fopen(filename, "rb")))
+    return false;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    size += n;
+    if (size > e->size)
+      break;
+    crc = journal_crc(crc, buf, n);
+  }
+  fclose(f);
+  return size == e->size && crc == e->crc;
+}
@@ -0,0 +1,50 @@
+/* journal.h: record of the tracks captured so far
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_JOURNAL_H
+# define OPENDTC_JOURNAL_H
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stddef.h>
+
+/* Layout: a text line per complete track file, "tt.s size crc" with
+   the size in decimal and the CRC-32 of the file in hex, and then the
+   digest of the file as "alg:hex" if one was made.  Lines are only
+   ever appended; a later line for a track replaces an earlier. */
+
+# define JOURNAL_TRACKS 84
+# define JOURNAL_DIGEST_SIZE 96
+
+struct journal;
+
+/* With resume, the lines already there are kept and read; otherwise
+   the journal starts out empty */
+extern struct journal *journal_open(const char *filename, bool resume);
+extern bool journal_close(struct journal *j);
+extern bool journal_add(struct journal *j, unsigned track, unsigned side,
+			uint64_t size, uint32_t crc, const char *digest);
+/* Whether filename is still the file recorded for the track */
+extern bool journal_check(struct journal *j, unsigned track, unsigned side,
+			  const char *filename);
+/* The digest recorded with alg, or NULL */
+extern const char *journal_digest(struct journal *j, unsigned track,
+				  unsigned side, const char *alg);
+
+extern uint32_t journal_crc(uint32_t crc, const uint8_t *data, size_t len);
+
+#endif /* OPENDTC_JOURNAL_H */
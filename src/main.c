@@ -18,11 +18,21 @@
 #include <config.h>
 #include <device.h>
 #include <stream.h>
+#include <container.h>
+#include <flux.h>
+#include <sector.h>
+#include <output.h>
+#include <journal.h>
+#include <hash.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <alloca.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 static int opt_device = 0;
 static int opt_density = 0;
@@ -32,7 +42,29 @@ static int opt_starttrack = -1;
 static int opt_endtrack = -1;
 static int opt_side_mode = 2;
 static int opt_track_distance = 1;
-static const char *opt_filename = NULL;
+static const char *opt_filenames[DEVICE_MAX_BOARDS];
+static int opt_num_boards = 0;
+static bool opt_verbose = false;
+static bool opt_pipeline = false;
+static bool opt_container = false;
+static bool opt_compress = false;
+static bool opt_sectors = false;
+static int opt_retries = 0;
+static int opt_revolutions = 5;
+static bool opt_early_stop = false;
+static int opt_queue_depth = 100;
+static int opt_buffer_size = 6400;
+static int opt_event_cpu = -1;
+static bool opt_realtime = false;
+static const char *opt_telemetry = NULL;
+static bool opt_fw_verify = true;
+static int opt_output = OUTPUT_STDIO;
+static int opt_durability = STREAM_SYNC_NONE;
+static bool opt_resume = false;
+static int opt_hash = HASH_NONE;
+
+/* JSON lines, one per track captured */
+static FILE *telemetry_log = NULL;
 
 static bool parse_intoption(char *optstr, int offs, int *optval,
 			    int lo_limit, int hi_limit)
@@ -57,7 +89,8 @@ static bool parse_options(int argc, char **argv)
     } else switch(argv[i][1]) {
     case 'h':
       printf("Commands:\n"
-	     "-f<name>: set filename\n"
+	     "-f<name>: set filename; repeat to capture from several devices\n"
+	     "          at once, the n-th name going with the n-th device\n"
 	     "-d<id>  : select drive (default 0)\n"
 	     "-dd<val>: set drive density line (default 0)\n"
 	     "          0=L, 1=H\n"
@@ -66,11 +99,40 @@ static bool parse_options(int argc, char **argv)
 	     "-g<side>: set single sided mode\n"
 	     "          0=side 0, 1=side 1, 2=both sides\n"
 	     "-k<step>: set track distance\n"
-	     "          1=80 tracks, 2=40 tracks (default 1)\n");
+	     "          1=80 tracks, 2=40 tracks (default 1)\n"
+	     "-q<n>   : set number of queued USB transfers (default 100)\n"
+	     "          0=tune automatically on the first track\n"
+	     "-b<size>: set USB transfer size, multiple of 64 (default 6400)\n"
+	     "-v      : report capture statistics per track\n"
+	     "-p      : step to the next track while the last one is written\n"
+	     "-c      : write all tracks to a single container file <name>.dtc\n"
+	     "-z      : compress the streams (.rawz, opendtc-extract restores them)\n"
+	     "-m      : decode MFM/FM sectors and report bad ones (implies -p)\n"
+	     "-r<n>   : re-read weak tracks up to n times at the end (implies -m)\n"
+	     "-n<revs>: set number of revolutions to capture (default 5)\n"
+	     "-a      : stop streaming as soon as the revolutions are in\n"
+	     "-u<cpu> : pin the USB event thread to a CPU\n"
+	     "-l      : run the USB event thread with real-time priority\n"
+	     "          and lock the memory (needs privileges)\n"
+	     "-j<name>: append timing statistics of each track to <name>\n"
+	     "          as JSON lines\n"
+	     "-w      : upload the firmware without reading it back\n"
+	     "-o<out> : how the stream files are written (default stdio)\n"
+	     "          stdio=buffered, direct=async, bypassing the page cache\n"
+	     "-y<sync>: when the stream files are synced to disk (default 0)\n"
+	     "          0=never, 1=each track, 2=all at the end of the disk\n"
+	     "-i      : resume, skipping the tracks <name>.journal shows\n"
+	     "          as captured whose files are unchanged\n"
+	     "-x<alg> : list the digests of the stream files in <name>.<alg>,\n"
+	     "          worked out while writing; alg is sha256\n");
       exit(0);
       break;
     case 'f':
-      opt_filename = argv[i]+2;
+      if (opt_num_boards >= DEVICE_MAX_BOARDS) {
+	fprintf(stderr, "Too many filenames\n");
+	return false;
+      }
+      opt_filenames[opt_num_boards++] = argv[i]+2;
       break;
     case 'd':
       if (argv[i][2] == 'd') {
@@ -97,6 +159,86 @@ static bool parse_options(int argc, char **argv)
       if (!parse_intoption(argv[i], 2, &opt_track_distance, 1, 2))
 	return false;
       break;
+    case 'q':
+      if (!parse_intoption(argv[i], 2, &opt_queue_depth, 0, 1024))
+	return false;
+      if (opt_queue_depth == 1) {
+	fprintf(stderr, "At least two transfers must be queued\n");
+	return false;
+      }
+      break;
+    case 'b':
+      if (!parse_intoption(argv[i], 2, &opt_buffer_size, 512, 1048576))
+	return false;
+      if (opt_buffer_size % 64) {
+	fprintf(stderr, "Transfer size must be a multiple of 64\n");
+	return false;
+      }
+      break;
+    case 'v':
+      opt_verbose = true;
+      break;
+    case 'p':
+      opt_pipeline = true;
+      break;
+    case 'c':
+      opt_container = true;
+      break;
+    case 'z':
+      opt_compress = true;
+      break;
+    case 'm':
+      opt_sectors = true;
+      opt_pipeline = true;
+      break;
+    case 'n':
+      if (!parse_intoption(argv[i], 2, &opt_revolutions, 1, 127))
+	return false;
+      break;
+    case 'a':
+      opt_early_stop = true;
+      break;
+    case 'u':
+      if (!parse_intoption(argv[i], 2, &opt_event_cpu, 0, 1023))
+	return false;
+      break;
+    case 'l':
+      opt_realtime = true;
+      break;
+    case 'j':
+      opt_telemetry = argv[i]+2;
+      break;
+    case 'w':
+      opt_fw_verify = false;
+      break;
+    case 'i':
+      opt_resume = true;
+      break;
+    case 'x':
+      if ((opt_hash = hash_algorithm(argv[i]+2)) < 0) {
+	fprintf(stderr, "Unknown hash: %s\n", argv[i]+2);
+	return false;
+      }
+      break;
+    case 'y':
+      if (!parse_intoption(argv[i], 2, &opt_durability,
+			   STREAM_SYNC_NONE, STREAM_SYNC_DISK))
+	return false;
+      break;
+    case 'o':
+      if ((opt_output = output_backend(argv[i]+2)) < 0) {
+	fprintf(stderr, "Unknown output: %s\n", argv[i]+2);
+	return false;
+      }
+      break;
+    case 'r':
+      if (!parse_intoption(argv[i], 2, &opt_retries, 0, 8))
+	return false;
+      if (opt_retries) {
+	opt_sectors = true;
+	opt_pipeline = true;
+      }
+      break;
     default:
       fprintf(stderr, "Invalid command: %s\n", argv[i]);
       return false;
@@ -104,31 +246,533 @@ static bool parse_options(int argc, char **argv)
   return true;
 }
 
-static bool capture_tracks(const char *filename_base, int start_track,
-			   int end_track, int side_mode, int track_distance)
-{
+/* What a capture of a track came out like */
+struct track_quality {
+  bool ok;
+  unsigned revs, found, good;
+};
+
+/* Tracks to be read again once the pass over the disk is done */
+struct weak_track {
   int track, side;
-  int fnbufsize = strlen(filename_base)+10;
+  struct track_quality quality;
+};
+
+/* One device and the disk in it; each board is captured on a thread of
+   its own when there are several */
+struct board {
+  unsigned index;
+  const char *filename;
+  struct device *dev;
+  struct stream_context *sc;
+  struct journal *journal;  /* NULL with a container */
+  /* Of the files of the tracks, for the manifest; empty if none */
+  char digests[JOURNAL_TRACKS][2][HASH_HEX_SIZE];
+  pthread_t thread;
+  bool ok;
+  struct weak_track weak_tracks[2*84];
+  unsigned weak_count;
+  /* Output is passed on a line at a time when boards share stdout */
+  char line[256];
+  unsigned linelen;
+};
+
+static struct board boards[DEVICE_MAX_BOARDS];
+static unsigned board_count = 0;
+
+static void board_emit(struct board *b)
+{
+  /* One call per line, so that lines from different boards don't mix */
+  printf("[%u] %.*s", b->index, (int)b->linelen, b->line);
+  b->linelen = 0;
+}
+
+static void board_printf(struct board *b, const char *fmt, ...)
+{
+  va_list va;
+  char *nl;
+  int l;
+  va_start(va, fmt);
+  if (board_count < 2) {
+    vprintf(fmt, va);
+    va_end(va);
+    return;
+  }
+  l = vsnprintf(b->line + b->linelen, sizeof(b->line) - b->linelen, fmt, va);
+  va_end(va);
+  if (l < 0)
+    return;
+  b->linelen += l;
+  if (b->linelen >= sizeof(b->line)) {
+    /* Cut short, but still ends the line */
+    b->linelen = sizeof(b->line) - 1;
+    b->line[b->linelen - 1] = '\n';
+  }
+  while ((nl = memchr(b->line, '\n', b->linelen))) {
+    unsigned rest = b->linelen - (nl + 1 - b->line);
+    b->linelen = nl + 1 - b->line;
+    board_emit(b);
+    memmove(b->line, nl + 1, rest);
+    b->linelen = rest;
+  }
+}
+
+static void board_flush(struct board *b)
+{
+  if (board_count < 2)
+    fflush(stdout);
+}
+
+static bool track_is_weak(const struct track_quality *q, unsigned revs)
+{
+  return !q->ok || q->revs < revs || q->good < q->found;
+}
+
+static bool track_is_better(const struct track_quality *a,
+			    const struct track_quality *b)
+{
+  if (a->ok != b->ok)
+    return a->ok;
+  if (a->good != b->good)
+    return a->good > b->good;
+  return a->revs > b->revs;
+}
+
+static void report_sectors(struct board *b,
+			   const struct sector_report *report)
+{
+  unsigned i;
+  if (!report->found) {
+    board_printf(b, ", no sectors found");
+    return;
+  }
+  board_printf(b, ", %s, %u/%u sectors good",
+	       sector_format_name(report->format),
+	       report->good, report->found);
+  for (i = 0; i < report->found - report->good && i < SECTOR_MAX; i++)
+    board_printf(b, "%s%u", (i? " " : ", bad: "), report->bad[i]);
+}
+
+static void report_telemetry(struct board *b, const struct stream_stats *stats)
+{
+  const struct telemetry_transfers *usb = &stats->usb;
+  if (usb->duration > 0)
+    board_printf(b, ", USB %.0f kB/s", usb->bytes / usb->duration / 1e3);
+  if (usb->completions)
+    board_printf(b, ", gaps p99 %.2f max %.2f ms, callbacks max %.0f us, "
+		 "%u in flight at least", telemetry_percentile(&usb->gaps, 0.99)
+		 * 1e3, usb->gaps.max * 1e3, usb->callbacks.max * 1e6,
+		 usb->in_flight_min);
+  if (stats->writes.count)
+    board_printf(b, ", writes p99 %.2f max %.2f ms",
+		 telemetry_percentile(&stats->writes, 0.99) * 1e3,
+		 stats->writes.max * 1e3);
+}
+
+static void report_track(struct board *b, struct track_quality *q)
+{
+  struct sector_job *sectors = stream_take_sectors(b->sc);
+  struct flux_track *flux = NULL;
+  board_printf(b, "ok");
+  q->ok = true;
+  if (sectors) {
+    struct sector_report report;
+    flux = sector_wait(sectors, &report);
+    report_sectors(b, &report);
+    q->found = report.found;
+    q->good = report.good;
+  }
+  if (!flux)
+    flux = stream_take_flux(b->sc);
+  if (flux)
+    q->revs = flux_track_revolutions(flux);
+  if (opt_verbose) {
+    struct stream_stats stats;
+    int count, next_count;
+    uint32_t size, next_size;
+    bool tuning, next_tuning;
+    stream_get_stats(b->sc, &stats);
+    device_get_capture_params(b->dev, &count, &size, &tuning);
+    device_get_async_params(b->dev, &next_count, &next_size, &next_tuning);
+    board_printf(b, ", writer queue peak %u/%u, %u stalls, "
+		 "transfers %dx%u%s", stats.peak, stats.size, stats.stalls,
+		 count, (unsigned)size, (tuning? " (tuning)" : ""));
+    if (tuning && !next_tuning)
+      board_printf(b, ", retuned to %d", next_count);
+    if (stats.raw)
+      board_printf(b, ", compressed to %u%%",
+		   (unsigned)(stats.coded * 100 / stats.raw));
+    report_telemetry(b, &stats);
+    if (flux) {
+      unsigned revs = flux_track_revolutions(flux);
+      if (revs) {
+	uint64_t ticks = 0;
+	unsigned r;
+	for (r = 0; r < revs; r++)
+	  ticks += flux_track_revolution_ticks(flux, r);
+	board_printf(b, ", %u revolutions at %.2f rpm", revs,
+		     60.0 * flux->sck * revs / ticks);
+      }
+    }
+  }
+  flux_track_free(flux);
+  board_printf(b, "\n");
+}
+
+static void log_track(struct board *b, int track, int side, int attempt,
+		      const struct track_quality *q)
+{
+  struct stream_stats stats;
+  if (!telemetry_log)
+    return;
+  stream_get_stats(b->sc, &stats);
+  /* Whole lines, also with several boards */
+  flockfile(telemetry_log);
+  fprintf(telemetry_log, "{\"time\":%lld,\"board\":%u,\"track\":%d,"
+	  "\"side\":%d,\"attempt\":%d,\"ok\":%s,\"revolutions\":%u,"
+	  "\"sectors_found\":%u,\"sectors_good\":%u,\"queue_size\":%u,"
+	  "\"queue_peak\":%u,\"stalls\":%u,", (long long)time(NULL),
+	  b->index, track, side, attempt, (q->ok? "true" : "false"), q->revs,
+	  q->found, q->good, stats.size, stats.peak, stats.stalls);
+  telemetry_write_transfers(telemetry_log, "usb", &stats.usb);
+  putc(',', telemetry_log);
+  telemetry_write_histogram(telemetry_log, "writes", &stats.writes);
+  fprintf(telemetry_log, "}\n");
+  fflush(telemetry_log);
+  funlockfile(telemetry_log);
+}
+
+/* With retries, a track that failed is judged like a weak one instead
+   of ending the run */
+static bool collect_track(struct board *b, struct stream_job *job,
+			  int track, int side, int attempt,
+			  struct track_quality *q)
+{
+  bool ok = stream_capture_end(job);
+  memset(q, 0, sizeof(*q));
+  if (ok)
+    report_track(b, q);
+  log_track(b, track, side, attempt, q);
+  if (ok)
+    return true;
+  if (!opt_retries)
+    return false;
+  board_printf(b, "failed\n");
+  return true;
+}
+
+/* Records the file of the track last collected */
+static void journal_track(struct board *b, int track, int side)
+{
+  struct stream_stats stats;
+  char digest[JOURNAL_DIGEST_SIZE];
+  if (!b->journal)
+    return;
+  stream_get_stats(b->sc, &stats);
+  if (opt_hash != HASH_NONE) {
+    strcpy(b->digests[track][side], stats.digest);
+    snprintf(digest, sizeof(digest), "%s:%s", hash_name(opt_hash),
+	     stats.digest);
+  }
+  journal_add(b->journal, track, side, stats.written, stats.crc,
+	      (opt_hash != HASH_NONE? digest : NULL));
+}
+
+/* For a track skipped when resuming; only read back if the journal has
+   no digest of it */
+static void journal_skipped_track(struct board *b, int track, int side,
+				  const char *filename)
+{
+  const char *digest;
+  if (opt_hash == HASH_NONE)
+    return;
+  if ((digest = journal_digest(b->journal, track, side, hash_name(opt_hash))))
+    snprintf(b->digests[track][side], HASH_HEX_SIZE, "%s", digest);
+  else if (!hash_file(opt_hash, filename, b->digests[track][side]))
+    b->digests[track][side][0] = 0;
+}
+
+/* In the format of sha256sum and the like, with the names relative to
+   the manifest */
+static bool write_manifest(struct board *b)
+{
+  int fnbufsize = strlen(b->filename)+16;
+  char *fnbuf = alloca(fnbufsize);
+  const char *base = strrchr(b->filename, '/');
+  unsigned track, side;
+  bool r = true;
+  FILE *f;
+  snprintf(fnbuf, fnbufsize, "%s.%s", b->filename, hash_name(opt_hash));
+  if (!(f = fopen(fnbuf, "w"))) {
+    perror(fnbuf);
+    return false;
+  }
+  base = (base? base+1 : b->filename);
+  for (track = 0; track < JOURNAL_TRACKS; track++)
+    for (side = 0; side < 2; side++)
+      if (b->digests[track][side][0])
+	fprintf(f, "%s  %s%02u.%u.raw%s\n", b->digests[track][side], base,
+		track, side, (opt_compress? "z" : ""));
+  if (fclose(f)) {
+    perror(fnbuf);
+    r = false;
+  }
+  return r;
+}
+
+static bool collect_pass_track(struct board *b, struct stream_job *job,
+			       int track, int side)
+{
+  struct track_quality q;
+  if (!collect_track(b, job, track, side, 0, &q))
+    return false;
+  if (q.ok)
+    journal_track(b, track, side);
+  if (opt_retries && track_is_weak(&q, device_get_revolutions(b->dev)) &&
+      b->weak_count < sizeof(b->weak_tracks) / sizeof(b->weak_tracks[0])) {
+    b->weak_tracks[b->weak_count].track = track;
+    b->weak_tracks[b->weak_count].side = side;
+    b->weak_tracks[b->weak_count].quality = q;
+    b->weak_count++;
+  }
+  return true;
+}
+
+/* In pipelined mode, the result of a track is collected after the head
+   has been stepped to the next one and that one has been streamed */
+static bool finish_pending(struct board *b, struct stream_job **pending,
+			   int track, int side)
+{
+  struct stream_job *job = *pending;
+  if (!job)
+    return true;
+  *pending = NULL;
+  board_printf(b, "%02d.%d    : ", track, side);
+  board_flush(b);
+  return collect_pass_track(b, job, track, side);
+}
+
+static bool capture_tracks(struct board *b, int start_track,
+			   int end_track, int side_mode, int track_distance,
+			   struct container *container)
+{
+  int track, side, pending_track = 0, pending_side = 0;
+  struct stream_job *pending = NULL;
+  int fnbufsize = strlen(b->filename)+10;
   char *fnbuf = alloca(fnbufsize);
   for (track = start_track; track <= end_track; track += track_distance) {
     for (side = 0; side < 2; side ++) {
+      struct stream_job *job;
       if (side_mode < 2 && side != side_mode)
 	continue;
-      printf("%02d.%d    : ", track, side);
-      fflush(stdout);
-      snprintf(fnbuf, fnbufsize, "%s%02d.%d.raw", filename_base, track, side);
-      if (!device_motor_on(side, track))
+      if (!container)
+	snprintf(fnbuf, fnbufsize, "%s%02d.%d.raw%s", b->filename, track, side,
+		 (opt_compress? "z" : ""));
+      if (opt_resume && b->journal &&
+	  journal_check(b->journal, track, side, fnbuf)) {
+	if (!finish_pending(b, &pending, pending_track, pending_side))
+	  return false;
+	journal_skipped_track(b, track, side, fnbuf);
+	board_printf(b, "%02d.%d    : already captured\n", track, side);
+	continue;
+      }
+      if (!opt_pipeline) {
+	board_printf(b, "%02d.%d    : ", track, side);
+	board_flush(b);
+      }
+      if (!device_motor_on(b->dev, side, track)) {
+	finish_pending(b, &pending, pending_track, pending_side);
 	return false;
-      if (!stream_capture(fnbuf))
+      }
+      if (container)
+	job = stream_capture_begin_entry(b->sc, container, track, side);
+      else
+	job = stream_capture_begin(b->sc, fnbuf);
+      if (!finish_pending(b, &pending, pending_track, pending_side)) {
+	if (job)
+	  stream_capture_end(job);
+	return false;
+      }
+      if (!job)
+	return false;
+      if (opt_pipeline) {
+	pending = job;
+	pending_track = track;
+	pending_side = side;
+	continue;
+      }
+      if (!collect_pass_track(b, job, track, side))
 	return false;
-      printf("ok\n");
     }
   }
-  return device_motor_off();
+  return finish_pending(b, &pending, pending_track, pending_side);
+}
+
+/* Each attempt streams twice the revolutions of the one before, and
+   approaches the track from the other direction: from above on odd
+   attempts, from track 0 on even ones.  The best capture is kept. */
+static bool retry_track(struct board *b, struct weak_track *w,
+			struct container *container, unsigned revs)
+{
+  int fnbufsize = strlen(b->filename)+24;
+  char *fnbuf = alloca(fnbufsize), *retrybuf = alloca(fnbufsize);
+  char *partbuf = alloca(fnbufsize);
+  int attempt, best = 0;
+  snprintf(fnbuf, fnbufsize, "%s%02d.%d.raw%s", b->filename, w->track,
+	   w->side, (opt_compress? "z" : ""));
+  snprintf(retrybuf, fnbufsize, "%s.retry", fnbuf);
+  for (attempt = 1;
+       attempt <= opt_retries && track_is_weak(&w->quality, revs); attempt++) {
+    struct stream_job *job;
+    struct track_quality q;
+    int approach = (attempt & 1? w->track + 4 : 0);
+    device_set_revolutions(b->dev, revs << attempt);
+    board_printf(b, "%02d.%d r%d : ", w->track, w->side, attempt);
+    board_flush(b);
+    if (!device_motor_on(b->dev, w->side, (approach > opt_maxtrack?
+					   opt_maxtrack : approach)) ||
+	!device_motor_on(b->dev, w->side, w->track))
+      return false;
+    if (container)
+      job = stream_capture_begin_entry(b->sc, container, w->track, w->side);
+    else
+      job = stream_capture_begin(b->sc, retrybuf);
+    if (!job)
+      return false;
+    collect_track(b, job, w->track, w->side, attempt, &q);
+    if (!stream_sync(b->sc))
+      return false;
+    if (track_is_better(&q, &w->quality)) {
+      if (!container && rename(retrybuf, fnbuf)) {
+	perror(fnbuf);
+	return false;
+      }
+      journal_track(b, w->track, w->side);
+      w->quality = q;
+      best = attempt;
+    } else if (container)
+      container_discard_entry(container, w->track, w->side);
+    else
+      unlink(retrybuf);
+  }
+  if (!container) {
+    /* What failed attempts left behind, and a failed first capture that
+       has been replaced */
+    snprintf(partbuf, fnbufsize, "%s" STREAM_PARTIAL_SUFFIX, retrybuf);
+    unlink(partbuf);
+    if (best) {
+      snprintf(partbuf, fnbufsize, "%s" STREAM_PARTIAL_SUFFIX, fnbuf);
+      unlink(partbuf);
+    }
+  }
+  if (best)
+    board_printf(b, "%02d.%d    : kept attempt %d\n", w->track, w->side, best);
+  else
+    board_printf(b, "%02d.%d    : kept the first capture\n",
+		 w->track, w->side);
+  return true;
+}
+
+static bool retry_tracks(struct board *b, struct container *container)
+{
+  unsigned revs = device_get_revolutions(b->dev);
+  unsigned i, failed = 0, weak = 0;
+  bool r = true;
+  if (b->weak_count)
+    board_printf(b, "\nRetrying %u weak track%s\n", b->weak_count,
+		 (b->weak_count == 1? "" : "s"));
+  for (i = 0; r && i < b->weak_count; i++)
+    r = retry_track(b, &b->weak_tracks[i], container, revs);
+  device_set_revolutions(b->dev, revs);
+  for (i = 0; i < b->weak_count; i++)
+    if (!b->weak_tracks[i].quality.ok)
+      failed++;
+    else if (track_is_weak(&b->weak_tracks[i].quality, revs))
+      weak++;
+  if (failed || weak)
+    board_printf(b, "%u track%s failed, %u still weak\n", failed,
+		 (failed == 1? "" : "s"), weak);
+  return r && !failed;
+}
+
+static bool capture_disk(struct board *b, int start_track,
+			 int end_track, int side_mode, int track_distance)
+{
+  struct container *container = NULL;
+  bool r;
+  if (opt_container) {
+    int fnbufsize = strlen(b->filename)+5;
+    char *fnbuf = alloca(fnbufsize);
+    snprintf(fnbuf, fnbufsize, "%s.dtc", b->filename);
+    if (!(container = container_create(fnbuf)))
+      return false;
+  } else {
+    int fnbufsize = strlen(b->filename)+9;
+    char *fnbuf = alloca(fnbufsize);
+    snprintf(fnbuf, fnbufsize, "%s.journal", b->filename);
+    if (!(b->journal = journal_open(fnbuf, opt_resume)))
+      return false;
+    memset(b->digests, 0, sizeof(b->digests));
+  }
+  r = capture_tracks(b, start_track, end_track, side_mode,
+		     track_distance, container);
+  if (!stream_sync(b->sc))
+    r = false;
+  if (r && opt_retries)
+    r = retry_tracks(b, container);
+  if (r)
+    r = device_motor_off(b->dev);
+  /* Also after a failure, listing the tracks that did make it */
+  if (!container && opt_hash != HASH_NONE && !write_manifest(b))
+    r = false;
+  /* Finish the container even after a failure, so that the tracks
+     captured so far can be extracted */
+  if (container && !container_finish(container))
+    r = false;
+  if (!journal_close(b->journal))
+    r = false;
+  b->journal = NULL;
+  return r;
+}
+
+static void *board_main(void *arg)
+{
+  struct board *b = arg;
+  b->ok = capture_disk(b, opt_starttrack, opt_endtrack,
+		       opt_side_mode, opt_track_distance);
+  if (b->linelen) {
+    /* A line left unfinished by a failure */
+    board_printf(b, "\n");
+  }
+  if (!b->ok && board_count > 1)
+    board_printf(b, "Capture failed\n");
+  return NULL;
+}
+
+static bool board_open(struct board *b, unsigned index, const char *filename)
+{
+  b->index = index;
+  b->filename = filename;
+  if (!(b->dev = device_open(index)) ||
+      !(b->sc = stream_context_new(b->dev)))
+    return false;
+  device_set_async_params(b->dev, opt_queue_depth, opt_buffer_size);
+  stream_set_compression(b->sc, opt_compress);
+  stream_set_output(b->sc, opt_output);
+  stream_set_durability(b->sc, opt_durability);
+  stream_set_hash(b->sc, opt_hash);
+  stream_set_flux_decoding(b->sc, opt_verbose);
+  stream_set_sector_decoding(b->sc, opt_sectors);
+  device_set_revolutions(b->dev, opt_revolutions);
+  stream_set_early_stop(b->sc, opt_early_stop);
+  return device_configure(b->dev, opt_device, opt_density,
+			  opt_mintrack, opt_maxtrack);
 }
 
 int main (int argc, char *argv[])
 {
+  unsigned i, started;
+  bool ok = true;
   printf("Open DiskTool Console v" VERSION "\n");
   printf("This program is free software: you can redistribute it and/or modify\n"
 	 "it under the terms of the GNU General Public License as published by\n"
@@ -137,21 +781,66 @@ int main (int argc, char *argv[])
 
   if (!parse_options(argc, argv))
     return 1;
-  if (opt_filename == NULL) {
+  if (!opt_num_boards) {
     fprintf(stderr, "No filename specified\n");
     return 1;
   }
-  if (!device_init())
+  if (opt_resume && opt_container) {
+    fprintf(stderr, "Resuming needs separate stream files, not -c\n");
     return 1;
-  if (!device_configure(opt_device, opt_density, opt_mintrack, opt_maxtrack))
+  }
+  if (opt_hash != HASH_NONE && opt_container) {
+    fprintf(stderr, "Digests are made of separate stream files, not -c\n");
     return 1;
+  }
+  board_count = opt_num_boards;
+  device_set_event_thread(opt_realtime, opt_event_cpu);
+  device_set_firmware_verify(opt_fw_verify);
+  if (opt_telemetry && !(telemetry_log = fopen(opt_telemetry, "a"))) {
+    perror(opt_telemetry);
+    return 1;
+  }
+  for (i = 0; i < board_count; i++)
+    if (!board_open(&boards[i], i, opt_filenames[i]))
+      return 1;
+  if (opt_sectors) {
+    /* One pool for all boards */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!sector_pool_start(cpus < 1? 1 : cpus))
+      return 1;
+  }
   if (opt_starttrack < 0)
     opt_starttrack = opt_mintrack;
   if (opt_endtrack < 0)
     opt_endtrack = opt_maxtrack;
-  if (!capture_tracks(opt_filename, opt_starttrack, opt_endtrack,
-		      opt_side_mode, opt_track_distance))
+  if (board_count == 1)
+    board_main(&boards[0]);
+  else {
+    for (started = 0; started < board_count; started++)
+      if (pthread_create(&boards[started].thread, NULL, board_main,
+			 &boards[started])) {
+	fprintf(stderr, "Failed to start capture thread\n");
+	ok = false;
+	break;
+      }
+    for (i = 0; i < started; i++)
+      pthread_join(boards[i].thread, NULL);
+  }
+  for (i = 0; i < board_count; i++)
+    if (!boards[i].ok)
+      ok = false;
+  if (!ok)
+    return 1;
+  for (i = 0; i < board_count; i++) {
+    stream_context_free(boards[i].sc);
+    device_close(boards[i].dev);
+  }
+  if (opt_sectors)
+    sector_pool_stop();
+  if (telemetry_log && fclose(telemetry_log)) {
+    perror(opt_telemetry);
     return 1;
+  }
 
   printf("\nEnjoy your shiny new disk image!\n");
   printf("Please consider helping SPS to preserve media:\n");
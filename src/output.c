@@ -0,0 +1,211 @@
+/* output.c -- ways of writing stream files
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* The direct backend gathers the stream into blocks of OUTPUT_BLOCK
+   bytes.  A full block is handed to POSIX AIO and the other one is
+   filled meanwhile, so the writer thread only waits for the disk if it
+   gets a whole block ahead.  With O_DIRECT the blocks go from memory
+   to the disk without a copy in the page cache; the last one is padded
+   to OUTPUT_ALIGN and the padding cut off again.  The file is returned
+   as a stdio stream, so compression and the rest of stream.c need not
+   know about any of this. */
+
+#include <config.h>
+#include <output.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <aio.h>
+#include <sys/types.h>
+
+#define OUTPUT_BLOCK (1024*1024)
+#define OUTPUT_ALIGN 4096
+
+static const char * const output_names[] = {
+  [OUTPUT_STDIO] = "stdio",
+  [OUTPUT_DIRECT] = "direct",
+};
+
+struct output_direct {
+  int fd;
+  uint8_t *block[2];
+  unsigned cur;        /* the block being filled */
+  uint32_t fill;
+  off_t offset;        /* where it goes in the file */
+  uint64_t size;
+  struct aiocb cb;     /* the write of the other block */
+  bool pending;
+};
+
+int output_backend(const char *name)
+{
+  int i;
+  for (i = 0; i < sizeof(output_names)/sizeof(output_names[0]); i++)
+    if (!strcmp(name, output_names[i]))
+      return i;
+  return -1;
+}
+
+static bool output_direct_wait(struct output_direct *o)
+{
+  const struct aiocb *list[1] = { &o->cb };
+  ssize_t ret;
+  int err;
+  if (!o->pending)
+    return true;
+  o->pending = false;
+  while ((err = aio_error(&o->cb)) == EINPROGRESS)
+    aio_suspend(list, 1, NULL);
+  ret = aio_return(&o->cb);
+  if (err || ret != o->cb.aio_nbytes) {
+    errno = (err? err : EIO);
+    return false;
+  }
+  return true;
+}
+
+/* Starts writing len bytes of the current block and switches to the
+   other one */
+static bool output_direct_flush(struct output_direct *o, uint32_t len)
+{
+  if (!output_direct_wait(o))
+    return false;
+  memset(&o->cb, 0, sizeof(o->cb));
+  o->cb.aio_fildes = o->fd;
+  o->cb.aio_buf = o->block[o->cur];
+  o->cb.aio_nbytes = len;
+  o->cb.aio_offset = o->offset;
+  if (aio_write(&o->cb))
+    return false;
+  o->pending = true;
+  o->offset += len;
+  o->cur ^= 1;
+  o->fill = 0;
+  return true;
+}
+
+static ssize_t output_direct_write(void *cookie, const char *buf, size_t size)
+{
+  struct output_direct *o = cookie;
+  size_t done = 0, n;
+  while (done < size) {
+    n = OUTPUT_BLOCK - o->fill;
+    if (n > size - done)
+      n = size - done;
+    memcpy(o->block[o->cur] + o->fill, buf + done, n);
+    o->fill += n;
+    done += n;
+    if (o->fill == OUTPUT_BLOCK && !output_direct_flush(o, OUTPUT_BLOCK))
+      return -1;
+  }
+  o->size += size;
+  return size;
+}
+
+static void output_direct_free(struct output_direct *o)
+{
+  free(o->block[0]);
+  free(o->block[1]);
+  free(o);
+}
+
+static int output_direct_close(void *cookie)
+{
+  struct output_direct *o = cookie;
+  uint32_t tail = (o->fill + OUTPUT_ALIGN - 1) & ~(OUTPUT_ALIGN - 1);
+  bool r = true;
+  int err = 0;
+
+  if (o->fill) {
+    memset(o->block[o->cur] + o->fill, 0, tail - o->fill);
+    r = output_direct_flush(o, tail);
+  }
+  if (!output_direct_wait(o))
+    r = false;
+  /* Also gives back what was preallocated beyond the end */
+  if (r && ftruncate(o->fd, o->size))
+    r = false;
+  if (!r)
+    err = errno;
+  if (close(o->fd) && r) {
+    r = false;
+    err = errno;
+  }
+  output_direct_free(o);
+  errno = err;
+  return (r? 0 : -1);
+}
+
+static FILE *output_open_direct(const char *filename, uint64_t expected)
+{
+  static const cookie_io_functions_t funcs = {
+    .write = output_direct_write,
+    .close = output_direct_close,
+  };
+  struct output_direct *o = calloc(1, sizeof(struct output_direct));
+  FILE *f;
+  int err;
+
+  if (!o ||
+      posix_memalign((void **)&o->block[0], OUTPUT_ALIGN, OUTPUT_BLOCK) ||
+      posix_memalign((void **)&o->block[1], OUTPUT_ALIGN, OUTPUT_BLOCK)) {
+    if (o)
+      output_direct_free(o);
+    errno = ENOMEM;
+    return NULL;
+  }
+  o->fd = -1;
+#ifdef O_DIRECT
+  o->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0666);
+#endif
+  /* Not every file system takes O_DIRECT */
+  if (o->fd < 0 &&
+      (o->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666)) < 0) {
+    err = errno;
+    output_direct_free(o);
+    errno = err;
+    return NULL;
+  }
+#ifdef FALLOC_FL_KEEP_SIZE
+  /* Only a hint; file systems without it just allocate as they go */
+  if (expected)
+    fallocate(o->fd, FALLOC_FL_KEEP_SIZE, 0, expected);
+#endif
+  if (!(f = fopencookie(o, "w", funcs))) {
+    err = errno;
+    close(o->fd);
+    output_direct_free(o);
+    errno = err;
+    return NULL;
+  }
+  /* Whole blocks are gathered in the cookie already */
+  setvbuf(f, NULL, _IONBF, 0);
+  return f;
+}
+
+FILE *output_open(const char *filename, int backend, uint64_t expected)
+{
+  switch (backend) {
+  case OUTPUT_DIRECT:
+    return output_open_direct(filename, expected);
+  default:
+    return fopen(filename, "wb");
+  }
+}
@@ -0,0 +1,37 @@
+/* output.h: ways of writing stream files
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_OUTPUT_H
+# define OPENDTC_OUTPUT_H
+
+# include <stdint.h>
+# include <stdio.h>
+
+enum {
+  OUTPUT_STDIO,   /* buffered by stdio and the page cache */
+  OUTPUT_DIRECT   /* large aligned blocks written asynchronously,
+		     bypassing the page cache where possible */
+};
+
+extern int output_backend(const char *name);
+/* Opens filename for writing; expected is the likely size of the file,
+   or 0 if not known.  Everything is written by the time fclose
+   returns, which reports any error. */
+extern FILE *output_open(const char *filename, int backend,
+			 uint64_t expected);
+
+#endif /* OPENDTC_OUTPUT_H */
@@ -0,0 +1,232 @@
+/* parser.c -- KryoFlux stream parser
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <config.h>
+#include <parser.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+/* Almost all of a stream is Flux1 samples, so runs of them are skipped
+   with vector compares, and only other codes go through the state
+   machine below.  The instruction set is picked when the program
+   starts. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define PARSER_SIMD_X86
+# include <immintrin.h>
+#endif
+
+static uint32_t stream_scan_samples_scalar(const uint8_t *data, uint32_t len)
+{
+  uint32_t n = 0;
+  while (n < len && data[n] >= 0xe)
+    n++;
+  return n;
+}
+
+#ifdef PARSER_SIMD_X86
+
+__attribute__((target("sse2")))
+static uint32_t stream_scan_samples_sse2(const uint8_t *data, uint32_t len)
+{
+  const __m128i limit = _mm_set1_epi8(0xe);
+  uint32_t n = 0;
+  for (; n + 16 <= len; n += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + n));
+    /* v >= 0xe exactly where max(v, 0xe) == v */
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, limit),
+						     v));
+    if (mask != 0xffff)
+      return n + __builtin_ctz(~mask);
+  }
+  return n + stream_scan_samples_scalar(data + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static uint32_t stream_scan_samples_avx2(const uint8_t *data, uint32_t len)
+{
+  const __m256i limit = _mm256_set1_epi8(0xe);
+  uint32_t n = 0;
+  for (; n + 32 <= len; n += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(data + n));
+    uint32_t mask = _mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_max_epu8(v, limit), v));
+    if (mask != 0xffffffffu)
+      return n + __builtin_ctz(~mask);
+  }
+  return n + stream_scan_samples_sse2(data + n, len - n);
+}
+
+static uint32_t (*stream_scan_samples)(const uint8_t *, uint32_t) =
+  stream_scan_samples_scalar;
+
+__attribute__((constructor))
+static void stream_parser_select_scanner(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    stream_scan_samples = stream_scan_samples_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    stream_scan_samples = stream_scan_samples_sse2;
+}
+
+#else
+
+# define stream_scan_samples stream_scan_samples_scalar
+
+#endif
+
+void stream_parser_init(struct stream_parser *p)
+{
+  p->complete = p->result_found = false;
+  p->streampos = 0;
+  p->skipcount = 0;
+  p->index_count = 0;
+  p->index_pos = 0;
+  p->error[0] = 0;
+  p->oob = NULL;
+  p->oob_ctx = NULL;
+}
+
+static bool stream_parser_error(struct stream_parser *p, const char *fmt, ...)
+{
+  va_list va;
+  va_start(va, fmt);
+  vsnprintf(p->error, sizeof(p->error), fmt, va);
+  va_end(va);
+  return false;
+}
+
+bool stream_parser_feed(struct stream_parser *p,
+			const uint8_t *data, uint32_t len)
+{
+  if (p->skipcount) {
+    uint32_t n = (p->skipcount > len? len : p->skipcount);
+    p->skipcount -= n;
+    data += n;
+    len -= n;
+    p->streampos += n;
+  }
+  while (len > 0) {
+    if (*data <= 7) {
+      /* Value */
+      if (len < 2) {
+	p->skipcount += 2-len;
+	p->streampos += len;
+	return true;
+      }
+      p->streampos += 2;
+      data += 2;
+      len -= 2;
+    } else if (*data >= 0xe) {
+      /* Samples */
+      uint32_t n = stream_scan_samples(data, len);
+      data += n;
+      len -= n;
+      p->streampos += n;
+    } else switch(*data) {
+    default:
+      /* Nop1-Nop3 */
+      ; int noffset = *data - 7;
+      if (len < noffset) {
+	p->skipcount += noffset-len;
+	p->streampos += len;
+	return true;
+      }
+      p->streampos += noffset;
+      data += noffset;
+      len -= noffset;
+      break;
+    case 0x0b:
+      /* Overflow16 */
+      data ++;
+      --len;
+      p->streampos ++;
+      break;
+    case 0x0c:
+      /* Value16 */
+      if (len < 3) {
+	p->skipcount += 3-len;
+	p->streampos += len;
+	return true;
+      }
+      data += 3;
+      len -= 3;
+      p->streampos += 3;
+      break;
+    case 0x0d:
+      if (len < 4) {
+	return stream_parser_error(p, "No room for OOB header");
+      }
+      unsigned type = data[1];
+      unsigned size = data[2] | (data[3] << 8);
+      if (type == 0x0d && size == 0x0d0d) {
+	if (!p->result_found) {
+	  return stream_parser_error(p, "End of data marker encountered "
+				     "before end of stream marker");
+	}
+	p->complete = true;
+	return true;
+      }
+      if (len-4 < size) {
+	return stream_parser_error(p, "No room for OOB data");
+      }
+      if (type == 1 || type == 3) {
+	unsigned long streampos;
+	if (size < 4) {
+	  return stream_parser_error(p, "No room for stream position");
+	}
+	streampos = data[4] | (data[5]<<8) | (data[6]<<16) | (data[7]<<24);
+	if (streampos != p->streampos) {
+	  return stream_parser_error(p, "Bad stream position %lu != %lu",
+				     streampos, p->streampos);
+	}
+      }
+      if (type == 2 && size >= 4) {
+	p->index_count++;
+	p->index_pos = data[4] | (data[5]<<8) | (data[6]<<16) |
+	  ((unsigned long)data[7]<<24);
+      }
+      if (type == 3) {
+	unsigned long result;
+	if (size < 8) {
+	  return stream_parser_error(p, "No room for result value");
+	}
+	p->result_found = true;
+	result = data[8] | (data[9]<<8) | (data[10]<<16) | (data[11]<<24);
+	if (result != 0) {
+	  switch(result) {
+	  case 1:
+	    return stream_parser_error(p, "Buffering problem - data transfer "
+				       "delivery to host could not keep up "
+				       "with disk read");
+	  case 2:
+	    return stream_parser_error(p, "No index signal detected");
+	  default:
+	    return stream_parser_error(p, "Unknown stream end result %lu",
+				       result);
+	  }
+	}
+      }
+      if (p->oob)
+	p->oob(p->oob_ctx, data, p->streampos);
+      data += size+4;
+      len -= size+4;
+      break;
+    }
+  }
+  return true;
+}
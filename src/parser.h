@@ -0,0 +1,45 @@
+/* parser.h: KryoFlux stream parser
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_PARSER_H
+# define OPENDTC_PARSER_H
+
+# include <stdint.h>
+# include <stdbool.h>
+
+/* All state of one stream being parsed; any number of streams can be
+   parsed at the same time, in any threads */
+struct stream_parser {
+  bool complete, result_found;
+  unsigned long streampos;
+  uint32_t skipcount;
+  /* Index blocks seen, and the stream position named by the last one */
+  unsigned index_count;
+  unsigned long index_pos;
+  /* Why stream_parser_feed failed */
+  char error[128];
+  /* If set after stream_parser_init, called with each OOB block, header
+     included, and the stream position it came at */
+  void (*oob)(void *ctx, const uint8_t *block, unsigned long streampos);
+  void *oob_ctx;
+};
+
+extern void stream_parser_init(struct stream_parser *p);
+extern bool stream_parser_feed(struct stream_parser *p,
+			       const uint8_t *data, uint32_t len);
+
+#endif /* OPENDTC_PARSER_H */
@@ -0,0 +1,467 @@
+/* reader.c -- random access to captured streams
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A stream position counts only the bytes outside OOB blocks, so the
+   file offset of a position is the position plus the size of all OOB
+   blocks before it.  The index keeps, for each OOB block, its stream
+   position and the offset just past it, which makes that a binary
+   search.  Plain .raw files are mapped; compressed streams can only be
+   decoded from the start, so they are decoded into memory once. */
+
+#include <config.h>
+#include <reader.h>
+#include <parser.h>
+#include <fluxz.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static const char reader_index_magic[7] = "ODTCIDX";
+
+struct stream_reader_oob {
+  uint32_t streampos;
+  uint64_t end;  /* file offset past the block */
+};
+
+struct stream_reader {
+  char *filename;
+  uint8_t *data;
+  uint64_t size, alloc;  /* alloc only while decoding */
+  bool mapped, complete, failed;
+  uint32_t end;  /* stream position at the end of the data */
+  struct stat st;
+  struct stream_reader_oob *oob;
+  unsigned oob_count, oob_alloc;
+  struct stream_reader_index *index;
+  unsigned index_count, index_alloc;
+  unsigned revolutions;
+};
+
+static void reader_put32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void reader_put64(uint8_t *p, uint64_t v)
+{
+  reader_put32(p, v);
+  reader_put32(p+4, v >> 32);
+}
+
+static uint32_t reader_get32(const uint8_t *p)
+{
+  return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static uint64_t reader_get64(const uint8_t *p)
+{
+  return reader_get32(p) | ((uint64_t)reader_get32(p+4) << 32);
+}
+
+static bool reader_grow(void **array, unsigned *alloc, unsigned count,
+			size_t size)
+{
+  void *n;
+  unsigned a;
+  if (count < *alloc)
+    return true;
+  a = (*alloc? *alloc * 2 : 256);
+  if (!(n = realloc(*array, a * size)))
+    return false;
+  *array = n;
+  *alloc = a;
+  return true;
+}
+
+static void stream_reader_oob(void *ctx, const uint8_t *block,
+			      unsigned long streampos)
+{
+  struct stream_reader *r = ctx;
+  unsigned size = block[2] | (block[3] << 8);
+  if (r->failed)
+    return;
+  if (!reader_grow((void **)&r->oob, &r->oob_alloc, r->oob_count,
+		   sizeof(struct stream_reader_oob))) {
+    r->failed = true;
+    return;
+  }
+  r->oob[r->oob_count].streampos = streampos;
+  r->oob[r->oob_count++].end = (block - r->data) + 4 + size;
+  if (block[1] != 2 || size < 12)
+    return;
+  if (!reader_grow((void **)&r->index, &r->index_alloc, r->index_count,
+		   sizeof(struct stream_reader_index))) {
+    r->failed = true;
+    return;
+  }
+  r->index[r->index_count].streampos = reader_get32(block+4);
+  r->index[r->index_count].sample_counter = reader_get32(block+8);
+  r->index[r->index_count++].index_counter = reader_get32(block+12);
+}
+
+static bool stream_reader_parse(struct stream_reader *r)
+{
+  struct stream_parser p;
+  const uint8_t *data = r->data;
+  uint64_t len = r->size;
+  bool ok = true;
+  stream_parser_init(&p);
+  p.oob = stream_reader_oob;
+  p.oob_ctx = r;
+  while (ok && len > 0 && !p.complete) {
+    uint32_t n = (len > 0x40000000? 0x40000000 : len);
+    ok = stream_parser_feed(&p, data, n);
+    data += n;
+    len -= n;
+  }
+  if (r->failed) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  if (!ok) {
+    fprintf(stderr, "%s: %s\n", r->filename, p.error);
+    return false;
+  }
+  r->complete = p.complete;
+  r->end = p.streampos;
+  return true;
+}
+
+static char *stream_reader_index_name(const struct stream_reader *r)
+{
+  size_t len = strlen(r->filename) + sizeof(READER_INDEX_SUFFIX);
+  char *name = malloc(len);
+  if (name)
+    snprintf(name, len, "%s" READER_INDEX_SUFFIX, r->filename);
+  return name;
+}
+
+static bool stream_reader_load_index(struct stream_reader *r, FILE *f)
+{
+  uint8_t buf[READER_INDEX_HEADER_SIZE];
+  unsigned i, oob_count, index_count;
+  if (fread(buf, 1, sizeof(buf), f) != sizeof(buf) ||
+      memcmp(buf, reader_index_magic, 7) ||
+      buf[7] != READER_INDEX_VERSION ||
+      reader_get64(buf+8) != (uint64_t)r->st.st_size ||
+      reader_get64(buf+16) != (uint64_t)r->st.st_mtim.tv_sec ||
+      reader_get32(buf+24) != (uint32_t)r->st.st_mtim.tv_nsec)
+    return false;
+  r->complete = (reader_get32(buf+28) & READER_INDEX_COMPLETE) != 0;
+  r->end = reader_get32(buf+32);
+  oob_count = reader_get32(buf+36);
+  index_count = reader_get32(buf+40);
+  if (r->end > r->size || oob_count > r->size / 4 ||
+      index_count > oob_count)
+    return false;
+  if ((oob_count &&
+       !(r->oob = calloc(oob_count, sizeof(struct stream_reader_oob)))) ||
+      (index_count &&
+       !(r->index = calloc(index_count,
+			   sizeof(struct stream_reader_index))))) {
+    r->failed = true;
+    return false;
+  }
+  for (i = 0; i < oob_count; i++) {
+    struct stream_reader_oob *o = &r->oob[i];
+    if (fread(buf, 1, 12, f) != 12)
+      return false;
+    o->streampos = reader_get32(buf);
+    o->end = reader_get64(buf+4);
+    if (o->streampos > r->end || o->end > r->size ||
+	(i && (o->streampos < o[-1].streampos || o->end <= o[-1].end)))
+      return false;
+  }
+  r->oob_count = r->oob_alloc = oob_count;
+  for (i = 0; i < index_count; i++) {
+    struct stream_reader_index *x = &r->index[i];
+    if (fread(buf, 1, 12, f) != 12)
+      return false;
+    x->streampos = reader_get32(buf);
+    x->sample_counter = reader_get32(buf+4);
+    x->index_counter = reader_get32(buf+8);
+  }
+  r->index_count = r->index_alloc = index_count;
+  return true;
+}
+
+/* A sidecar is only a cache, so not being able to write one is no error */
+static void stream_reader_save_index(const struct stream_reader *r,
+				     const char *name)
+{
+  uint8_t buf[READER_INDEX_HEADER_SIZE];
+  size_t len = strlen(name) + 24;
+  char *tmpname = malloc(len);
+  unsigned i;
+  FILE *f;
+  int fd;
+  if (!tmpname)
+    return;
+  snprintf(tmpname, len, "%s.%ld", name, (long)getpid());
+  if ((fd = open(tmpname, O_WRONLY|O_CREAT|O_EXCL, 0666)) < 0) {
+    free(tmpname);
+    return;
+  }
+  if (!(f = fdopen(fd, "wb"))) {
+    close(fd);
+    goto fail;
+  }
+  memcpy(buf, reader_index_magic, 7);
+  buf[7] = READER_INDEX_VERSION;
+  reader_put64(buf+8, r->st.st_size);
+  reader_put64(buf+16, r->st.st_mtim.tv_sec);
+  reader_put32(buf+24, r->st.st_mtim.tv_nsec);
+  reader_put32(buf+28, (r->complete? READER_INDEX_COMPLETE : 0));
+  reader_put32(buf+32, r->end);
+  reader_put32(buf+36, r->oob_count);
+  reader_put32(buf+40, r->index_count);
+  fwrite(buf, 1, sizeof(buf), f);
+  for (i = 0; i < r->oob_count; i++) {
+    reader_put32(buf, r->oob[i].streampos);
+    reader_put64(buf+4, r->oob[i].end);
+    fwrite(buf, 1, 12, f);
+  }
+  for (i = 0; i < r->index_count; i++) {
+    reader_put32(buf, r->index[i].streampos);
+    reader_put32(buf+4, r->index[i].sample_counter);
+    reader_put32(buf+8, r->index[i].index_counter);
+    fwrite(buf, 1, 12, f);
+  }
+  if (ferror(f) | fclose(f) || rename(tmpname, name))
+    goto fail;
+  free(tmpname);
+  return;
+
+ fail:
+  unlink(tmpname);
+  free(tmpname);
+}
+
+static bool stream_reader_build(struct stream_reader *r, bool sidecar)
+{
+  char *name = NULL;
+  bool loaded = false;
+  FILE *f;
+  unsigned i;
+  if (sidecar) {
+    if (!(name = stream_reader_index_name(r))) {
+      fprintf(stderr, "Out of memory!\n");
+      return false;
+    }
+    if ((f = fopen(name, "rb"))) {
+      bool ok = stream_reader_load_index(r, f);
+      fclose(f);
+      if (r->failed) {
+	fprintf(stderr, "Out of memory!\n");
+	free(name);
+	return false;
+      }
+      if (!ok) {
+	/* Stale or damaged; start over */
+	free(r->oob);
+	free(r->index);
+	r->oob = NULL;
+	r->index = NULL;
+	r->oob_count = r->oob_alloc = r->index_count = r->index_alloc = 0;
+      } else
+	loaded = true;
+    }
+  }
+  if (!loaded && !stream_reader_parse(r)) {
+    free(name);
+    return false;
+  }
+  /* As in the flux decoder, a pulse with no flux after it, at the end
+     of the stream, does not end a revolution */
+  for (i = 0; i < r->index_count; i++)
+    if (r->index[i].streampos < r->end &&
+	stream_reader_seek(r, r->index[i].streampos, &r->index[i].offset))
+      r->revolutions = i;
+    else
+      r->index[i].offset = r->size;
+  if (sidecar && !loaded)
+    stream_reader_save_index(r, name);
+  free(name);
+  return true;
+}
+
+static bool stream_reader_sink(void *ctx, const uint8_t *data, uint32_t len)
+{
+  struct stream_reader *r = ctx;
+  if (r->size + len > r->alloc) {
+    uint64_t a = (r->alloc? r->alloc : 1 << 20);
+    uint8_t *n;
+    while (a < r->size + len)
+      a *= 2;
+    if (!(n = realloc(r->data, a)))
+      return false;
+    r->data = n;
+    r->alloc = a;
+  }
+  memcpy(r->data + r->size, data, len);
+  r->size += len;
+  return true;
+}
+
+static bool stream_reader_decode(struct stream_reader *r, int fd)
+{
+  struct fluxz *z = fluxz_new();
+  FILE *f = fdopen(fd, "rb");
+  bool ok;
+  if (!z || !f) {
+    fluxz_free(z);
+    if (f)
+      fclose(f);
+    else
+      close(fd);
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  ok = fluxz_decode(z, f, stream_reader_sink, r);
+  fluxz_free(z);
+  fclose(f);
+  if (!ok)
+    fprintf(stderr, "%s: Bad compressed stream\n", r->filename);
+  return ok;
+}
+
+struct stream_reader *stream_reader_open(const char *filename, bool sidecar)
+{
+  struct stream_reader *r = calloc(1, sizeof(struct stream_reader));
+  void *m;
+  int fd;
+  if (!r || !(r->filename = strdup(filename))) {
+    fprintf(stderr, "Out of memory!\n");
+    free(r);
+    return NULL;
+  }
+  if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &r->st)) {
+    perror(filename);
+    if (fd >= 0)
+      close(fd);
+    goto fail;
+  }
+  if (!r->st.st_size) {
+    fprintf(stderr, "%s: Empty stream\n", filename);
+    close(fd);
+    goto fail;
+  }
+  m = mmap(NULL, r->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (m == MAP_FAILED) {
+    perror(filename);
+    close(fd);
+    goto fail;
+  }
+  if (fluxz_is_compressed(m, r->st.st_size)) {
+    munmap(m, r->st.st_size);
+    if (!stream_reader_decode(r, fd))
+      goto fail;
+  } else {
+    close(fd);
+    r->data = m;
+    r->size = r->st.st_size;
+    r->mapped = true;
+  }
+  if (!stream_reader_build(r, sidecar))
+    goto fail;
+  return r;
+
+ fail:
+  stream_reader_close(r);
+  return NULL;
+}
+
+void stream_reader_close(struct stream_reader *r)
+{
+  if (!r)
+    return;
+  if (r->mapped)
+    munmap(r->data, r->size);
+  else
+    free(r->data);
+  free(r->oob);
+  free(r->index);
+  free(r->filename);
+  free(r);
+}
+
+const uint8_t *stream_reader_data(const struct stream_reader *r,
+				  uint64_t *len)
+{
+  *len = r->size;
+  return r->data;
+}
+
+bool stream_reader_complete(const struct stream_reader *r)
+{
+  return r->complete;
+}
+
+unsigned stream_reader_index_count(const struct stream_reader *r)
+{
+  return r->index_count;
+}
+
+const struct stream_reader_index *
+stream_reader_index(const struct stream_reader *r, unsigned n)
+{
+  return (n < r->index_count? &r->index[n] : NULL);
+}
+
+unsigned stream_reader_revolutions(const struct stream_reader *r)
+{
+  return r->revolutions;
+}
+
+/* The bytes from the flux of one index pulse up to that of the next,
+   OOB blocks included */
+bool stream_reader_revolution(const struct stream_reader *r, unsigned rev,
+			      const uint8_t **data, uint64_t *len)
+{
+  if (rev >= r->revolutions)
+    return false;
+  *data = r->data + r->index[rev].offset;
+  *len = r->index[rev+1].offset - r->index[rev].offset;
+  return true;
+}
+
+/* OOB blocks at the position itself come before it */
+bool stream_reader_seek(const struct stream_reader *r, uint32_t streampos,
+			uint64_t *offset)
+{
+  unsigned lo = 0, hi = r->oob_count;
+  if (streampos > r->end)
+    return false;
+  while (lo < hi) {
+    unsigned mid = lo + (hi - lo) / 2;
+    if (r->oob[mid].streampos <= streampos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *offset = (lo? streampos + (r->oob[lo-1].end - r->oob[lo-1].streampos) :
+	     streampos);
+  return true;
+}
@@ -0,0 +1,70 @@
+/* reader.h: random access to captured streams
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_READER_H
+# define OPENDTC_READER_H
+
+# include <stdint.h>
+# include <stdbool.h>
+
+/* Sidecar index, "<file>.idx", all integers little endian:
+
+     header  "ODTCIDX", u8 version, u64 stream file size,
+             u64 mtime seconds, u32 mtime nanoseconds, u32 flags,
+             u32 stream position at the end, u32 OOB count,
+             u32 index count
+     OOB     per block: u32 stream position, u64 file offset past it
+     index   per pulse: u32 stream position, u32 sample counter,
+                        u32 index counter
+
+   A sidecar whose size or mtime does not match the stream is rebuilt. */
+
+# define READER_INDEX_SUFFIX ".idx"
+# define READER_INDEX_VERSION 1
+# define READER_INDEX_HEADER_SIZE 44
+
+/* Header flags */
+# define READER_INDEX_COMPLETE 1
+
+/* One index pulse */
+struct stream_reader_index {
+  uint32_t streampos;      /* of the flux it came during */
+  uint32_t sample_counter; /* sample clocks into that flux */
+  uint32_t index_counter;  /* index clocks at the pulse */
+  uint64_t offset;         /* of streampos in the file */
+};
+
+struct stream_reader;
+
+extern struct stream_reader *stream_reader_open(const char *filename,
+						bool sidecar);
+extern void stream_reader_close(struct stream_reader *r);
+
+extern const uint8_t *stream_reader_data(const struct stream_reader *r,
+					 uint64_t *len);
+extern bool stream_reader_complete(const struct stream_reader *r);
+extern unsigned stream_reader_index_count(const struct stream_reader *r);
+extern const struct stream_reader_index *
+stream_reader_index(const struct stream_reader *r, unsigned n);
+extern unsigned stream_reader_revolutions(const struct stream_reader *r);
+extern bool stream_reader_revolution(const struct stream_reader *r,
+				     unsigned rev, const uint8_t **data,
+				     uint64_t *len);
+extern bool stream_reader_seek(const struct stream_reader *r,
+			       uint32_t streampos, uint64_t *offset);
+
+#endif /* OPENDTC_READER_H */
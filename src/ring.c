@@ -0,0 +1,78 @@
+/* ring.c -- single producer, single consumer pointer ring
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <config.h>
+#include <ring.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+bool ring_init(struct ring *r, unsigned size)
+{
+  unsigned n = 1;
+  while (n < size)
+    n <<= 1;
+  r->slots = malloc(n * sizeof(void *));
+  if (!r->slots) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  r->mask = n-1;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  return true;
+}
+
+void ring_free(struct ring *r)
+{
+  free(r->slots);
+  r->slots = NULL;
+}
+
+bool ring_push(struct ring *r, void *p)
+{
+  unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (head - tail > r->mask)
+    return false;
+  r->slots[head & r->mask] = p;
+  atomic_store_explicit(&r->head, head+1, memory_order_release);
+  return true;
+}
+
+void *ring_pop(struct ring *r)
+{
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+  void *p;
+  if (head == tail)
+    return NULL;
+  p = r->slots[tail & r->mask];
+  atomic_store_explicit(&r->tail, tail+1, memory_order_release);
+  return p;
+}
+
+unsigned ring_count(struct ring *r)
+{
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+  return head - tail;
+}
+
+unsigned ring_size(const struct ring *r)
+{
+  return r->mask + 1;
+}
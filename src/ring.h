@@ -0,0 +1,39 @@
+/* ring.h: single producer, single consumer pointer ring
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_RING_H
+# define OPENDTC_RING_H
+
+# include <stdbool.h>
+# include <stdatomic.h>
+
+struct ring {
+  void **slots;
+  unsigned mask;
+  /* head is only written by the producer, tail only by the consumer */
+  _Alignas(64) atomic_uint head;
+  _Alignas(64) atomic_uint tail;
+};
+
+extern bool ring_init(struct ring *r, unsigned size);
+extern void ring_free(struct ring *r);
+extern bool ring_push(struct ring *r, void *p);
+extern void *ring_pop(struct ring *r);
+extern unsigned ring_count(struct ring *r);
+extern unsigned ring_size(const struct ring *r);
+
+#endif /* OPENDTC_RING_H */
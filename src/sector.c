@@ -0,0 +1,452 @@
+/* sector.c -- decoding of IBM and Amiga sectors from flux intervals
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* The intervals of all revolutions are run through a PLL into one
+   bitstream of raw cells, which is then searched for address marks.
+   The cell size comes from the shortest common interval: two cells
+   for MFM, where IBM and Amiga layouts are tried, and one for FM.  A
+   sector counts as good if any revolution had good data. */
+
+#include <config.h>
+#include <sector.h>
+#include <flux.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define SECTOR_HISTOGRAM 512
+#define SECTOR_MAX_CELLS 64
+
+/* Raw bits between an ID and its data mark, at most */
+#define SECTOR_ID_DISTANCE 2000
+
+enum {
+  SECTOR_UNSEEN,
+  SECTOR_SEEN,
+  SECTOR_GOOD
+};
+
+struct sector_bits {
+  uint8_t *data;
+  uint32_t count, alloc;
+};
+
+struct sector_state {
+  struct sector_bits bits;
+  uint8_t state[256];
+};
+
+const char *sector_format_name(int format)
+{
+  switch (format) {
+  case SECTOR_FORMAT_IBM_MFM:
+    return "IBM MFM";
+  case SECTOR_FORMAT_IBM_FM:
+    return "IBM FM";
+  case SECTOR_FORMAT_AMIGA:
+    return "Amiga";
+  default:
+    return "unknown";
+  }
+}
+
+/* Most common interval among the short ones, in ticks */
+static uint32_t sector_shortest_peak(const struct flux_track *t)
+{
+  uint32_t hist[SECTOR_HISTOGRAM], i, max = 0, n;
+  memset(hist, 0, sizeof(hist));
+  n = (t->count > 200000? 200000 : t->count);
+  for (i = 0; i < n; i++)
+    if (t->ticks[i] < SECTOR_HISTOGRAM)
+      hist[t->ticks[i]]++;
+  /* Smooth out the jitter */
+  for (i = SECTOR_HISTOGRAM-1; i >= 3; --i) {
+    hist[i] += hist[i-1] + hist[i-2] + hist[i-3];
+    if (hist[i] > max)
+      max = hist[i];
+  }
+  if (!max)
+    return 0;
+  for (i = 3; i < SECTOR_HISTOGRAM-1; i++)
+    if (hist[i] > max / 4) {
+      while (i < SECTOR_HISTOGRAM-1 && hist[i+1] >= hist[i])
+	i++;
+      /* Undo the shift of the smoothing window */
+      return i - 1;
+    }
+  return 0;
+}
+
+static bool sector_put_bits(struct sector_bits *b, unsigned zeros)
+{
+  uint32_t need = (b->count + zeros + 1 + 7) / 8;
+  if (need > b->alloc) {
+    uint32_t n = (b->alloc? b->alloc*2 : 65536);
+    uint8_t *p;
+    while (n < need)
+      n *= 2;
+    if (!(p = realloc(b->data, n)))
+      return false;
+    memset(p + b->alloc, 0, n - b->alloc);
+    b->data = p;
+    b->alloc = n;
+  }
+  b->count += zeros;
+  b->data[b->count >> 3] |= 0x80 >> (b->count & 7);
+  b->count++;
+  return true;
+}
+
+/* Runs the intervals through a PLL with the given nominal cell size */
+static bool sector_pll(const struct flux_track *t, double cell,
+		       struct sector_bits *b)
+{
+  double period = cell, lo = cell * 0.9, hi = cell * 1.1;
+  uint32_t i;
+  if (b->data)
+    memset(b->data, 0, b->alloc);
+  b->count = 0;
+  for (i = 0; i < t->count; i++) {
+    double ticks = (t->ticks[i] == FLUX_LONG?
+		    flux_track_interval(t, i) : t->ticks[i]);
+    unsigned n;
+    if (ticks >= period * SECTOR_MAX_CELLS)
+      n = SECTOR_MAX_CELLS;
+    else {
+      n = (unsigned)(ticks / period + 0.5);
+      if (!n)
+	n = 1;
+      period += (ticks - n * period) / n * 0.05;
+      if (period < lo)
+	period = lo;
+      else if (period > hi)
+	period = hi;
+    }
+    if (!sector_put_bits(b, n - 1)) {
+      fprintf(stderr, "Out of memory!\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint32_t sector_raw(const struct sector_bits *b, uint32_t pos,
+			   unsigned n)
+{
+  uint32_t v = 0;
+  while (n-- > 0) {
+    v = (v << 1) | ((b->data[pos >> 3] >> (7 - (pos & 7))) & 1);
+    pos++;
+  }
+  return v;
+}
+
+/* The data bits of 16 raw MFM or FM cells */
+static uint8_t sector_byte(const struct sector_bits *b, uint32_t pos)
+{
+  uint32_t raw = sector_raw(b, pos, 16);
+  uint8_t v = 0;
+  int i;
+  for (i = 14; i >= 0; i -= 2)
+    v = (v << 1) | ((raw >> i) & 1);
+  return v;
+}
+
+static uint16_t sector_crc(uint16_t crc, const struct sector_bits *b,
+			   uint32_t pos, unsigned len)
+{
+  while (len-- > 0) {
+    int i;
+    crc ^= sector_byte(b, pos) << 8;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x8000? (crc << 1) ^ 0x1021 : crc << 1);
+    pos += 16;
+  }
+  return crc;
+}
+
+static void sector_mark(struct sector_state *s, unsigned sector, bool good)
+{
+  if (good)
+    s->state[sector] = SECTOR_GOOD;
+  else if (s->state[sector] == SECTOR_UNSEEN)
+    s->state[sector] = SECTOR_SEEN;
+}
+
+/* pos is the first cell after the mark, whose CRC is crc */
+static void sector_ibm_mark(struct sector_state *s, uint32_t pos,
+			    uint16_t crc, uint8_t mark, uint32_t *id_pos,
+			    int *id_sector, unsigned *id_size)
+{
+  const struct sector_bits *b = &s->bits;
+  if (mark == 0xfe) {
+    if (pos + 6*16 > b->count || sector_crc(crc, b, pos, 6))
+      return;
+    *id_pos = pos;
+    *id_sector = sector_byte(b, pos + 2*16);
+    *id_size = sector_byte(b, pos + 3*16) & 7;
+    sector_mark(s, *id_sector, false);
+  } else if ((mark == 0xfb || mark == 0xf8) && *id_sector >= 0 &&
+	     pos - *id_pos < SECTOR_ID_DISTANCE) {
+    unsigned len = 128u << *id_size;
+    if (pos + (len + 2) * 16 > b->count)
+      return;
+    sector_mark(s, *id_sector, !sector_crc(crc, b, pos, len + 2));
+    *id_sector = -1;
+  }
+}
+
+static void sector_scan_ibm_mfm(struct sector_state *s)
+{
+  const struct sector_bits *b = &s->bits;
+  uint32_t pos, id_pos = 0;
+  uint16_t shift = 0;
+  int id_sector = -1;
+  unsigned id_size = 0;
+  for (pos = 0; pos + 16 <= b->count; pos++) {
+    shift = (shift << 1) | ((b->data[pos >> 3] >> (7 - (pos & 7))) & 1);
+    /* Act on the last of the A1 syncs */
+    if (shift != 0x4489 || sector_raw(b, pos + 1, 16) == 0x4489)
+      continue;
+    /* The CRC of A1 A1 A1 */
+    sector_ibm_mark(s, pos + 17, sector_crc(0xcdb4, b, pos + 1, 1),
+		    sector_byte(b, pos + 1), &id_pos, &id_sector, &id_size);
+  }
+}
+
+static void sector_scan_ibm_fm(struct sector_state *s)
+{
+  const struct sector_bits *b = &s->bits;
+  uint32_t pos, id_pos = 0;
+  uint16_t shift = 0;
+  int id_sector = -1;
+  unsigned id_size = 0;
+  for (pos = 0; pos < b->count; pos++) {
+    uint8_t mark;
+    shift = (shift << 1) | ((b->data[pos >> 3] >> (7 - (pos & 7))) & 1);
+    /* Marks have clock pattern C7 */
+    if (shift == 0xf57e)
+      mark = 0xfe;
+    else if (shift == 0xf56f)
+      mark = 0xfb;
+    else if (shift == 0xf56a)
+      mark = 0xf8;
+    else
+      continue;
+    sector_ibm_mark(s, pos + 1, sector_crc(0xffff, b, pos - 15, 1), mark,
+		    &id_pos, &id_sector, &id_size);
+  }
+}
+
+/* A long stored as odd bits, then count longs later the even bits */
+static uint32_t sector_amiga_long(const struct sector_bits *b, uint32_t pos,
+				  unsigned count)
+{
+  return ((sector_raw(b, pos, 32) & 0x55555555) << 1) |
+    (sector_raw(b, pos + count*32, 32) & 0x55555555);
+}
+
+static uint32_t sector_amiga_checksum(const struct sector_bits *b,
+				      uint32_t pos, unsigned longs)
+{
+  uint32_t sum = 0;
+  while (longs-- > 0) {
+    sum ^= sector_raw(b, pos, 32);
+    pos += 32;
+  }
+  return sum & 0x55555555;
+}
+
+static void sector_scan_amiga(struct sector_state *s)
+{
+  const struct sector_bits *b = &s->bits;
+  uint32_t pos, shift = 0;
+  for (pos = 0; pos + 32 <= b->count; pos++) {
+    uint32_t p = pos + 1, info;
+    unsigned sector;
+    bool good;
+    shift = (shift << 1) | ((b->data[pos >> 3] >> (7 - (pos & 7))) & 1);
+    if (shift != 0x44894489 || sector_raw(b, p, 16) == 0x4489)
+      continue;
+    /* Info, label, header and data checksums, then the data */
+    if (p + 14*32 + 2*512*8 > b->count)
+      break;
+    info = sector_amiga_long(b, p, 1);
+    sector = (info >> 8) & 0xff;
+    if ((info >> 24) != 0xff ||
+	sector_amiga_checksum(b, p, 10) != sector_amiga_long(b, p + 10*32, 1))
+      continue;
+    good = (sector_amiga_checksum(b, p + 14*32, 256) ==
+	    sector_amiga_long(b, p + 12*32, 1));
+    sector_mark(s, sector, good);
+  }
+}
+
+static void sector_result(const struct sector_state *s, int format,
+			  struct sector_report *report)
+{
+  unsigned i;
+  report->format = format;
+  report->found = report->good = 0;
+  for (i = 0; i < 256; i++)
+    if (s->state[i] == SECTOR_GOOD) {
+      report->found++;
+      report->good++;
+    } else if (s->state[i] == SECTOR_SEEN) {
+      if (report->found - report->good < SECTOR_MAX)
+	report->bad[report->found - report->good] = i;
+      report->found++;
+    }
+}
+
+void sector_decode(const struct flux_track *t, struct sector_report *report)
+{
+  struct sector_state s;
+  uint32_t peak = sector_shortest_peak(t);
+  memset(&s, 0, sizeof(s));
+  memset(report, 0, sizeof(*report));
+  if (!peak)
+    return;
+  if (sector_pll(t, peak / 2.0, &s.bits)) {
+    sector_scan_ibm_mfm(&s);
+    sector_result(&s, SECTOR_FORMAT_IBM_MFM, report);
+    if (!report->found) {
+      sector_scan_amiga(&s);
+      sector_result(&s, SECTOR_FORMAT_AMIGA, report);
+    }
+  }
+  if (!report->found && sector_pll(t, peak, &s.bits)) {
+    sector_scan_ibm_fm(&s);
+    sector_result(&s, SECTOR_FORMAT_IBM_FM, report);
+  }
+  if (!report->found)
+    report->format = SECTOR_FORMAT_NONE;
+  free(s.bits.data);
+}
+
+/* Thread pool */
+
+struct sector_job {
+  struct flux_track *track;
+  struct sector_report report;
+  sem_t done;
+  struct sector_job *next;
+};
+
+static pthread_mutex_t sector_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sector_cond = PTHREAD_COND_INITIALIZER;
+static struct sector_job *sector_queue = NULL, **sector_queue_tail = &sector_queue;
+static pthread_t *sector_threads = NULL;
+static unsigned sector_thread_count = 0;
+static bool sector_quit = false;
+
+static void *sector_worker(void *arg)
+{
+  for (;;) {
+    struct sector_job *job;
+    pthread_mutex_lock(&sector_lock);
+    while (!sector_queue && !sector_quit)
+      pthread_cond_wait(&sector_cond, &sector_lock);
+    if (!(job = sector_queue)) {
+      pthread_mutex_unlock(&sector_lock);
+      return NULL;
+    }
+    if (!(sector_queue = job->next))
+      sector_queue_tail = &sector_queue;
+    pthread_mutex_unlock(&sector_lock);
+    sector_decode(job->track, &job->report);
+    sem_post(&job->done);
+  }
+}
+
+bool sector_pool_start(unsigned threads)
+{
+  if (sector_thread_count)
+    return true;
+  if (!(sector_threads = calloc(threads, sizeof(pthread_t)))) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  sector_quit = false;
+  while (sector_thread_count < threads &&
+	 !pthread_create(&sector_threads[sector_thread_count], NULL,
+			 sector_worker, NULL))
+    sector_thread_count++;
+  if (!sector_thread_count) {
+    fprintf(stderr, "Failed to start sector decoder thread\n");
+    free(sector_threads);
+    sector_threads = NULL;
+    return false;
+  }
+  return true;
+}
+
+/* Jobs still queued are decoded before the workers exit */
+void sector_pool_stop(void)
+{
+  unsigned i;
+  pthread_mutex_lock(&sector_lock);
+  sector_quit = true;
+  pthread_cond_broadcast(&sector_cond);
+  pthread_mutex_unlock(&sector_lock);
+  for (i = 0; i < sector_thread_count; i++)
+    pthread_join(sector_threads[i], NULL);
+  free(sector_threads);
+  sector_threads = NULL;
+  sector_thread_count = 0;
+}
+
+/* Takes over the track until it is handed back by sector_wait.  Without
+   a pool, the track is decoded right away. */
+struct sector_job *sector_submit(struct flux_track *t)
+{
+  struct sector_job *job = calloc(1, sizeof(struct sector_job));
+  if (!job) {
+    fprintf(stderr, "Out of memory!\n");
+    flux_track_free(t);
+    return NULL;
+  }
+  job->track = t;
+  sem_init(&job->done, 0, 0);
+  pthread_mutex_lock(&sector_lock);
+  if (sector_thread_count) {
+    *sector_queue_tail = job;
+    sector_queue_tail = &job->next;
+    pthread_cond_signal(&sector_cond);
+    pthread_mutex_unlock(&sector_lock);
+  } else {
+    pthread_mutex_unlock(&sector_lock);
+    sector_decode(t, &job->report);
+    sem_post(&job->done);
+  }
+  return job;
+}
+
+struct flux_track *sector_wait(struct sector_job *job,
+			       struct sector_report *report)
+{
+  struct flux_track *t = job->track;
+  while (sem_wait(&job->done))
+    ;
+  if (report)
+    *report = job->report;
+  sem_destroy(&job->done);
+  free(job);
+  return t;
+}
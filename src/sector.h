@@ -0,0 +1,55 @@
+/* sector.h: MFM and FM sector decoding
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_SECTOR_H
+# define OPENDTC_SECTOR_H
+
+# include <stdint.h>
+# include <stdbool.h>
+
+struct flux_track;
+struct sector_job;
+
+enum {
+  SECTOR_FORMAT_NONE,
+  SECTOR_FORMAT_IBM_MFM,
+  SECTOR_FORMAT_IBM_FM,
+  SECTOR_FORMAT_AMIGA
+};
+
+# define SECTOR_MAX 64
+
+struct sector_report {
+  int format;
+  /* Sectors whose header was seen, and how many of them had good data */
+  unsigned found, good;
+  /* Sector numbers of the ones without good data */
+  uint8_t bad[SECTOR_MAX];
+};
+
+extern const char *sector_format_name(int format);
+extern void sector_decode(const struct flux_track *t,
+			  struct sector_report *report);
+
+/* Decoding on a pool of worker threads */
+extern bool sector_pool_start(unsigned threads);
+extern void sector_pool_stop(void);
+extern struct sector_job *sector_submit(struct flux_track *t);
+extern struct flux_track *sector_wait(struct sector_job *job,
+				      struct sector_report *report);
+
+#endif /* OPENDTC_SECTOR_H */
@@ -0,0 +1,534 @@
+/* simflux.c -- synthesized and recorded KryoFlux stream sources
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <config.h>
+#include <simflux.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define SIMFLUX_INFO_INTERVAL 8192
+
+#define SIMFLUX_KFINFO "name=KryoFlux DiskSystem (simulated), version=3.00s, " \
+  "sck=24027428.5714285, ick=3003428.5714285"
+
+enum {
+  SIMFLUX_PHASE_INFO,
+  SIMFLUX_PHASE_DATA,
+  SIMFLUX_PHASE_END,
+  SIMFLUX_PHASE_EOF,
+  SIMFLUX_PHASE_DONE
+};
+
+static uint32_t simflux_random(struct simflux *sf)
+{
+  uint32_t x = sf->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return sf->rng = x;
+}
+
+static void simflux_put32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void simflux_put_oob(struct simflux *sf, unsigned type,
+			    const uint8_t *payload, unsigned size)
+{
+  sf->elem[0] = 0x0d;
+  sf->elem[1] = type;
+  sf->elem[2] = size;
+  sf->elem[3] = size >> 8;
+  memcpy(sf->elem+4, payload, size);
+  sf->elem_len = size+4;
+  sf->elem_oob = true;
+}
+
+static void simflux_put_flux(struct simflux *sf, uint32_t value)
+{
+  unsigned l = 0;
+  if (value >= 0x0e && value <= 0xff)
+    sf->elem[l++] = value;
+  else if (value < 0x800) {
+    sf->elem[l++] = value >> 8;
+    sf->elem[l++] = value;
+  } else {
+    while (value >= 0x10000) {
+      /* Overflow16 */
+      sf->elem[l++] = 0x0b;
+      value -= 0x10000;
+    }
+    /* Value16 */
+    sf->elem[l++] = 0x0c;
+    sf->elem[l++] = value >> 8;
+    sf->elem[l++] = value;
+  }
+  sf->elem_len = l;
+  sf->elem_oob = false;
+  sf->streampos += l;
+}
+
+static uint32_t simflux_rev_ticks(struct simflux *sf)
+{
+  /* 300 rpm with a little speed wobble */
+  return (uint32_t)(SIMFLUX_SCK * 0.2) + simflux_random(sf) % 2001 - 1000;
+}
+
+static uint32_t simflux_cell(struct simflux *sf)
+{
+  uint32_t r = simflux_random(sf);
+  if (sf->bits) {
+    /* Distance to the next one cell on the formatted track */
+    uint32_t n = 0;
+    do {
+      n++;
+      if (++sf->bitpos >= sf->nbits)
+	sf->bitpos = 0;
+    } while (!((sf->bits[sf->bitpos >> 3] >> (7 - (sf->bitpos & 7))) & 1) &&
+	     n < 64);
+    return n * sf->cell_ticks + r % 7 - 3;
+  }
+  if (!(r & 0xffff0000))
+    /* Unformatted area, exercises Value16 and Overflow16 */
+    return 0x800 + (r & 0xffff) * 2;
+  if (!(r & 0xfff00000))
+    /* Long cell, exercises Value */
+    return 300 + (r & 0x1ff);
+  /* MFM 2T/3T/4T cells of 1us with some jitter */
+  r >>= 20;
+  return ((r & 0xff) < 128? 48 : ((r & 0xff) < 205? 72 : 96))
+    + (r >> 8) % 7 - 3;
+}
+
+static bool simflux_next_synth(struct simflux *sf)
+{
+  uint8_t payload[12];
+
+  if (sf->info_countdown == 0) {
+    /* StreamInfo */
+    simflux_put32(payload, sf->streampos);
+    simflux_put32(payload+4, (uint32_t)(sf->total_ticks * 1000 / SIMFLUX_SCK));
+    simflux_put_oob(sf, 1, payload, 8);
+    sf->info_countdown = SIMFLUX_INFO_INTERVAL;
+    return true;
+  }
+
+  if (!sf->cell)
+    sf->cell = simflux_cell(sf);
+
+  if (sf->cell >= sf->ticks_to_index) {
+    /* Index */
+    simflux_put32(payload, sf->streampos);
+    simflux_put32(payload+4, sf->ticks_to_index);
+    simflux_put32(payload+8,
+		  (uint32_t)((sf->total_ticks + sf->ticks_to_index) / 8));
+    simflux_put_oob(sf, 2, payload, 12);
+    sf->ticks_to_index += simflux_rev_ticks(sf);
+    if (++sf->index_count > sf->revs && sf->revs)
+      sf->phase = SIMFLUX_PHASE_END;
+    return true;
+  }
+
+  simflux_put_flux(sf, sf->cell);
+  sf->ticks_to_index -= sf->cell;
+  sf->total_ticks += sf->cell;
+  sf->cell = 0;
+  sf->info_countdown = (sf->info_countdown > sf->elem_len?
+			sf->info_countdown - sf->elem_len : 0);
+  return true;
+}
+
+static bool simflux_next_replay(struct simflux *sf)
+{
+  const uint8_t *p;
+  size_t left;
+  unsigned l;
+
+ again:
+  p = sf->replay + sf->replay_pos;
+  left = sf->replay_len - sf->replay_pos;
+  if (!left) {
+    sf->phase = SIMFLUX_PHASE_END;
+    return false;
+  }
+  if (*p <= 7)
+    l = 2;
+  else if (*p >= 0xe)
+    l = 1;
+  else switch (*p) {
+  default:
+    /* Nop1-Nop3 */
+    l = *p - 7;
+    break;
+  case 0x0b:
+    l = 1;
+    break;
+  case 0x0c:
+    l = 3;
+    break;
+  case 0x0d:
+    if (left < 4) {
+      l = left;
+      break;
+    }
+    if (p[1] == 0x0d && p[2] == 0x0d && p[3] == 0x0d) {
+      l = 4;
+      sf->phase = SIMFLUX_PHASE_DONE;
+    } else
+      l = 4 + (p[2] | (p[3] << 8));
+    break;
+  }
+  if (l > left || l > sizeof(sf->elem)) {
+    /* Truncated recording, terminate the stream cleanly */
+    sf->phase = SIMFLUX_PHASE_END;
+    return false;
+  }
+  sf->replay_pos += l;
+  if (*p == 0x0d && l >= 13 && p[1] == 4 && !memcmp(p+4, "host_", 5))
+    /* Skip the host preamble, the device never sends that */
+    goto again;
+  memcpy(sf->elem, p, l);
+  sf->elem_len = l;
+  sf->elem_oob = (*p == 0x0d);
+  if (!sf->elem_oob)
+    sf->streampos += l;
+  return true;
+}
+
+static bool simflux_next(struct simflux *sf)
+{
+  uint8_t payload[8];
+
+  sf->elem_pos = 0;
+  sf->elem_len = 0;
+  switch (sf->phase) {
+  case SIMFLUX_PHASE_INFO:
+    simflux_put_oob(sf, 4, (const uint8_t *)SIMFLUX_KFINFO,
+		    sizeof(SIMFLUX_KFINFO));
+    sf->phase = SIMFLUX_PHASE_DATA;
+    return true;
+  case SIMFLUX_PHASE_DATA:
+    if (sf->replay) {
+      if (simflux_next_replay(sf))
+	return true;
+      if (sf->phase == SIMFLUX_PHASE_DONE)
+	return false;
+    } else
+      return simflux_next_synth(sf);
+    /* FALLTHRU */
+  case SIMFLUX_PHASE_END:
+    /* StreamEnd */
+    simflux_put32(payload, sf->streampos);
+    simflux_put32(payload+4, sf->result);
+    simflux_put_oob(sf, 3, payload, 8);
+    sf->phase = SIMFLUX_PHASE_EOF;
+    return true;
+  case SIMFLUX_PHASE_EOF:
+    memset(sf->elem, 0x0d, 4);
+    sf->elem_len = 4;
+    sf->elem_oob = true;
+    sf->phase = SIMFLUX_PHASE_DONE;
+    return true;
+  default:
+    return false;
+  }
+}
+
+void simflux_init(struct simflux *sf, uint32_t seed, unsigned revs)
+{
+  memset(sf, 0, sizeof(*sf));
+  sf->rng = (seed? seed : 0x4b464c58);
+  sf->revs = revs;
+  sf->phase = SIMFLUX_PHASE_INFO;
+  sf->ticks_to_index = simflux_random(sf) % simflux_rev_ticks(sf);
+  sf->info_countdown = SIMFLUX_INFO_INTERVAL;
+}
+
+bool simflux_init_replay(struct simflux *sf, const char *filename)
+{
+  FILE *f;
+  long size;
+
+  memset(sf, 0, sizeof(*sf));
+  f = fopen(filename, "rb");
+  if (!f) {
+    perror(filename);
+    return false;
+  }
+  if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET)) {
+    perror(filename);
+    fclose(f);
+    return false;
+  }
+  sf->replay = malloc(size? size : 1);
+  if (!sf->replay) {
+    fprintf(stderr, "Out of memory!\n");
+    fclose(f);
+    return false;
+  }
+  if (fread(sf->replay, 1, size, f) != size) {
+    perror(filename);
+    fclose(f);
+    simflux_free(sf);
+    return false;
+  }
+  fclose(f);
+  sf->replay_len = size;
+  /* Recordings already carry the device's own KFInfo */
+  sf->phase = SIMFLUX_PHASE_DATA;
+  return true;
+}
+
+void simflux_free(struct simflux *sf)
+{
+  free(sf->replay);
+  sf->replay = NULL;
+  free(sf->bits);
+  sf->bits = NULL;
+}
+
+/* Track formatting: the data is laid out the way a real controller
+   writes it, so that sector decoders have something to find */
+
+struct simflux_writer {
+  struct simflux *sf;
+  bool fm;
+  uint8_t prev;
+  uint16_t crc;
+};
+
+static void simflux_put_raw(struct simflux_writer *w, uint32_t raw,
+			    unsigned nbits)
+{
+  struct simflux *sf = w->sf;
+  while (nbits-- > 0) {
+    if (sf->bitpos >= sf->nbits)
+      return;
+    if ((raw >> nbits) & 1)
+      sf->bits[sf->bitpos >> 3] |= 0x80 >> (sf->bitpos & 7);
+    sf->bitpos++;
+  }
+}
+
+static uint16_t simflux_crc_byte(uint16_t crc, uint8_t b)
+{
+  int i;
+  crc ^= b << 8;
+  for (i = 0; i < 8; i++)
+    crc = (crc & 0x8000? (crc << 1) ^ 0x1021 : crc << 1);
+  return crc;
+}
+
+/* MFM or FM encoding of one byte, clock bits inserted */
+static uint16_t simflux_encode(struct simflux_writer *w, uint8_t b)
+{
+  uint16_t raw = 0;
+  int i;
+  for (i = 7; i >= 0; --i) {
+    unsigned d = (b >> i) & 1;
+    unsigned c = (w->fm? 1 : !(w->prev & 1) && !d);
+    raw = (raw << 2) | (c << 1) | d;
+    w->prev = d;
+  }
+  return raw;
+}
+
+static void simflux_put_byte(struct simflux_writer *w, uint8_t b)
+{
+  simflux_put_raw(w, simflux_encode(w, b), 16);
+  w->crc = simflux_crc_byte(w->crc, b);
+}
+
+static void simflux_put_bytes(struct simflux_writer *w, uint8_t b, unsigned n)
+{
+  while (n-- > 0)
+    simflux_put_byte(w, b);
+}
+
+static void simflux_put_crc(struct simflux_writer *w)
+{
+  uint16_t crc = w->crc;
+  simflux_put_byte(w, crc >> 8);
+  simflux_put_byte(w, crc);
+}
+
+/* Address mark with missing clock bits */
+static void simflux_put_mark(struct simflux_writer *w, uint8_t mark)
+{
+  if (w->fm) {
+    simflux_put_raw(w, (mark == 0xfe? 0xf57e : 0xf56f), 16);
+    w->crc = simflux_crc_byte(0xffff, mark);
+  } else {
+    int i;
+    for (i = 0; i < 3; i++)
+      simflux_put_raw(w, 0x4489, 16);
+    w->prev = 1;
+    w->crc = 0xcdb4; /* CRC of A1 A1 A1 */
+    simflux_put_byte(w, mark);
+  }
+  w->prev = mark & 1;
+}
+
+static void simflux_format_ibm(struct simflux_writer *w, unsigned track,
+			       unsigned side, int bad_sector)
+{
+  unsigned sectors = (w->fm? 16 : 18), size_code = (w->fm? 1 : 2);
+  unsigned gap = (w->fm? 0xff : 0x4e), sync = (w->fm? 6 : 12);
+  unsigned s, i;
+  simflux_put_bytes(w, gap, (w->fm? 40 : 80));
+  for (s = 1; s <= sectors; s++) {
+    simflux_put_bytes(w, 0, sync);
+    simflux_put_mark(w, 0xfe);
+    simflux_put_byte(w, track);
+    simflux_put_byte(w, side);
+    simflux_put_byte(w, s);
+    simflux_put_byte(w, size_code);
+    simflux_put_crc(w);
+    simflux_put_bytes(w, gap, (w->fm? 11 : 22));
+    simflux_put_bytes(w, 0, sync);
+    simflux_put_mark(w, 0xfb);
+    for (i = 0; i < (128u << size_code); i++)
+      simflux_put_byte(w, (uint8_t)(i + s));
+    if ((int)s == bad_sector)
+      w->crc ^= 1;
+    simflux_put_crc(w);
+    simflux_put_bytes(w, gap, (w->fm? 27 : 84));
+  }
+}
+
+static void simflux_put_amiga_longs(struct simflux_writer *w,
+				    const uint32_t *data, unsigned n)
+{
+  unsigned i, half;
+  /* Odd bits of all longs first, then the even bits */
+  for (half = 0; half < 2; half++)
+    for (i = 0; i < n; i++) {
+      uint32_t d = (half? data[i] : data[i] >> 1);
+      uint32_t raw = 0;
+      int b;
+      for (b = 15; b >= 0; --b) {
+	unsigned bit = (d >> (2*b)) & 1;
+	unsigned c = !(w->prev & 1) && !bit;
+	raw = (raw << 2) | (c << 1) | bit;
+	w->prev = bit;
+      }
+      simflux_put_raw(w, raw, 32);
+    }
+}
+
+/* XOR of the encoded longs, clock bits masked off */
+static uint32_t simflux_amiga_checksum(const uint32_t *data, unsigned n)
+{
+  uint32_t sum = 0;
+  while (n-- > 0) {
+    sum ^= (*data >> 1) ^ *data;
+    data++;
+  }
+  return sum & 0x55555555;
+}
+
+static void simflux_format_amiga(struct simflux_writer *w, unsigned track,
+				 unsigned side, int bad_sector)
+{
+  unsigned s, i;
+  simflux_put_bytes(w, 0, 200);
+  for (s = 0; s < 22; s++) {
+    uint32_t head[5], sum, data[128];
+    simflux_put_bytes(w, 0, 2);
+    simflux_put_raw(w, 0x44894489, 32);
+    w->prev = 1;
+    /* Info long and the 16 byte label */
+    memset(head, 0, sizeof(head));
+    head[0] = (0xffu << 24) | ((track*2 + side) << 16) | (s << 8) | (22 - s);
+    simflux_put_amiga_longs(w, head, 1);
+    simflux_put_amiga_longs(w, head + 1, 4);
+    sum = simflux_amiga_checksum(head, 1) ^ simflux_amiga_checksum(head + 1, 4);
+    simflux_put_amiga_longs(w, &sum, 1);
+    for (i = 0; i < 128; i++)
+      data[i] = 0x01010101u * (uint8_t)(i + s);
+    sum = simflux_amiga_checksum(data, 128);
+    if ((int)s == bad_sector)
+      sum ^= 1;
+    simflux_put_amiga_longs(w, &sum, 1);
+    simflux_put_amiga_longs(w, data, 128);
+  }
+}
+
+/* Replaces the random cells with a formatted track; bad_sector, if
+   not negative, gets a bad data checksum */
+bool simflux_format(struct simflux *sf, int format, unsigned track,
+		    unsigned side, int bad_sector)
+{
+  struct simflux_writer w;
+  if (format == SIMFLUX_FORMAT_RANDOM)
+    return true;
+  /* 1us cells, 2us for FM, at 300 rpm */
+  sf->cell_ticks = (format == SIMFLUX_FORMAT_IBM_FM? 48 : 24);
+  sf->nbits = (uint32_t)(SIMFLUX_SCK * 0.2 / sf->cell_ticks);
+  if (!(sf->bits = calloc((sf->nbits + 7) / 8, 1))) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  memset(&w, 0, sizeof(w));
+  w.sf = sf;
+  w.fm = (format == SIMFLUX_FORMAT_IBM_FM);
+  sf->bitpos = 0;
+  if (format == SIMFLUX_FORMAT_AMIGA)
+    simflux_format_amiga(&w, track, side, bad_sector);
+  else
+    simflux_format_ibm(&w, track, side, bad_sector);
+  /* Fill the rest of the track with gap bytes */
+  while (sf->bitpos < sf->nbits)
+    simflux_put_byte(&w, (w.fm? 0xff : (format == SIMFLUX_FORMAT_AMIGA?
+					  0 : 0x4e)));
+  sf->bitpos = 0;
+  return true;
+}
+
+void simflux_finish(struct simflux *sf, unsigned result)
+{
+  if (sf->phase < SIMFLUX_PHASE_END) {
+    sf->phase = SIMFLUX_PHASE_END;
+    sf->result = result;
+  }
+}
+
+uint32_t simflux_read(struct simflux *sf, uint8_t *buf, uint32_t len)
+{
+  uint32_t out = 0;
+  while (out < len) {
+    unsigned n;
+    if (sf->elem_pos >= sf->elem_len && !simflux_next(sf))
+      break;
+    n = sf->elem_len - sf->elem_pos;
+    /* Never split an OOB block over two transfers */
+    if (sf->elem_oob && n > len-out && out > 0)
+      break;
+    if (n > len-out)
+      n = len-out;
+    memcpy(buf+out, sf->elem+sf->elem_pos, n);
+    sf->elem_pos += n;
+    out += n;
+  }
+  return out;
+}
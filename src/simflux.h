@@ -0,0 +1,69 @@
+/* simflux.h: synthesized and recorded KryoFlux stream sources
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_SIMFLUX_H
+# define OPENDTC_SIMFLUX_H
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stddef.h>
+
+# define SIMFLUX_SCK 24027428.5714285
+# define SIMFLUX_ICK 3003428.5714285
+
+enum {
+  SIMFLUX_FORMAT_RANDOM,
+  SIMFLUX_FORMAT_IBM_MFM,
+  SIMFLUX_FORMAT_IBM_FM,
+  SIMFLUX_FORMAT_AMIGA
+};
+
+struct simflux {
+  /* Replay source, NULL when synthesizing */
+  uint8_t *replay;
+  size_t replay_len, replay_pos;
+
+  /* Synthesizer state */
+  uint32_t rng;
+  unsigned revs, index_count;
+  uint32_t rev_ticks, ticks_to_index, cell;
+  uint64_t total_ticks;
+  uint32_t info_countdown;
+
+  int phase;
+  unsigned result;
+  uint32_t streampos;
+
+  /* Formatted track, as raw MFM/FM cells, NULL for random cells */
+  uint8_t *bits;
+  uint32_t nbits, bitpos, cell_ticks;
+
+  /* Element currently being emitted */
+  uint8_t elem[128];
+  unsigned elem_len, elem_pos;
+  bool elem_oob;
+};
+
+extern void simflux_init(struct simflux *sf, uint32_t seed, unsigned revs);
+extern bool simflux_init_replay(struct simflux *sf, const char *filename);
+extern bool simflux_format(struct simflux *sf, int format, unsigned track,
+			   unsigned side, int bad_sector);
+extern void simflux_free(struct simflux *sf);
+extern void simflux_finish(struct simflux *sf, unsigned result);
+extern uint32_t simflux_read(struct simflux *sf, uint8_t *buf, uint32_t len);
+
+#endif /* OPENDTC_SIMFLUX_H */
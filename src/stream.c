@@ -22,178 +22,230 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <ring.h>
+#include <container.h>
+#include <fluxz.h>
+#include <output.h>
+#include <journal.h>
+#include <parser.h>
+#include <flux.h>
+#include <sector.h>
 
-static FILE *stream_file = NULL;
-
-static bool stream_complete = false, stream_failed = false;
-static bool result_found = false;
-static unsigned long current_streampos;
-static uint32_t skipcount = 0;
-
-static bool stream_validate_data(const uint8_t *data, uint32_t len)
-{
-  if (skipcount) {
-    uint32_t n = (skipcount > len? len : skipcount);
-    skipcount -= n;
-    data += n;
-    len -= n;
-    current_streampos += n;
-  }
-  while (len > 0) {
-    if (*data <= 7) {
-      /* Value */
-      if (len < 2) {
-	skipcount += 2-len;
-	current_streampos += len;
-	return true;
-      }
-      current_streampos += 2;
-      data += 2;
-      len -= 2;
-    } else if (*data >= 0xe) {
-      /* Sample */
-      data ++;
-      --len;
-      current_streampos ++;
-    } else switch(*data) {
-    default:
-      /* Nop1-Nop3 */
-      ; int noffset = *data - 7;
-      if (len < noffset) {
-	skipcount += noffset-len;
-	current_streampos += len;
-	return true;
-      }
-      current_streampos += noffset;
-      data += noffset;
-      len -= noffset;
-      break;
-    case 0x0b:
-      /* Overflow16 */
-      data ++;
-      --len;
-      current_streampos ++;
-      break;
-    case 0x0c:
-      /* Value16 */
-      if (len < 3) {
-	skipcount += 3-len;
-	current_streampos += len;
-	return true;
-      }
-      data += 3;
-      len -= 3;
-      current_streampos += 3;
-      break;
-    case 0x0d:
-      if (len < 4) {
-	fprintf(stderr, "No room for OOB header\n");
-	return false;
-      }
-      unsigned type = data[1];
-      unsigned size = data[2] | (data[3] << 8);
-      if (type == 0x0d && size == 0x0d0d) {
-	if (!result_found) {
-	  fprintf(stderr, "End of data marker encountered before end of stream marker\n");
-	  return false;
-	}
-	stream_complete = true;
-	return true;
-      }
-      if (len-4 < size) {
-	fprintf(stderr, "No room for OOB data\n");
-	return false;
-      }
-      if (type == 1 || type == 3) {
-	unsigned long streampos;
-	if (size < 4) {
-	  fprintf(stderr, "No room for stream position\n");
-	  return false;
-	}
-	streampos = data[4] | (data[5]<<8) | (data[6]<<16) | (data[7]<<24);
-	if (streampos != current_streampos) {
-	  fprintf(stderr, "Bad stream position %lu != %lu\n",
-		  streampos, current_streampos);
-	  return false;
-	}
-      }
-      if (type == 3) {
-	unsigned long result;
-	if (size < 8) {
-	  fprintf(stderr, "No room for result value\n");
-	  return false;
-	}
-	result_found = true;
-	result = data[8] | (data[9]<<8) | (data[10]<<16) | (data[11]<<24);
-	if (result != 0) {
-	  switch(result) {
-	  case 1:
-	    fprintf(stderr, "Buffering problem - data transfer delivery "
-		    "to host could not keep up with disk read\n");
-	    break;
-	  case 2:
-	    fprintf(stderr, "No index signal detected\n");
-	    break;
-	  default:
-	    fprintf(stderr, "Unknown stream end result %lu\n", result);
-	    break;
-	  }
-	  return false;
-	}
-      }
-      data += size+4;
-      len -= size+4;
-      break;
-    }
+/* Buffers handed over from the USB callback to the writer thread.  The
+   callback swaps the filled transfer buffer for the one in a spare
+   descriptor, so no data is copied on the way.  The pool is sized in
+   bytes, so that it covers the same time whatever the buffer size.
+
+   Each stream context has a writer thread of its own, which lives as
+   long as the context and works through jobs, one per track: a BEGIN
+   descriptor opens the file, DATA descriptors are validated and
+   written, and END closes the file and completes the job.  Since the
+   file is closed on the writer, the next track can be sought and
+   streamed in the meantime.
+
+   A capture is written under its name plus STREAM_PARTIAL_SUFFIX and
+   only renamed once the stream has been validated as complete, so a
+   file under the final name is always a whole one.  How soon the data
+   and the rename are made durable depends on the durability set. */
+#define STREAM_SPARE_POOL_SIZE  (128*6400)
+#define STREAM_MIN_SPARE_BUFFERS 8
+
+/* Control descriptors that can be queued at the same time */
+#define STREAM_MAX_CONTROL 8
+
+enum {
+  STREAM_BUFFER_DATA,
+  STREAM_BUFFER_BEGIN,
+  STREAM_BUFFER_END,
+  STREAM_BUFFER_QUIT
+};
+
+struct stream_buffer {
+  int kind;
+  uint8_t *data;
+  uint32_t len;
+  struct stream_job *job;
+};
+
+struct stream_job {
+  char *filename;
+  char *partname;  /* what is written until complete, if not filename */
+  FILE *file;
+  struct container *container;
+  unsigned track, side;
+  bool compress, decode, sectors;
+  struct flux_track *flux;
+  struct sector_job *sector_job;
+  /* Revolutions after which streaming is stopped, 0 to let it run */
+  unsigned stop_revs;
+  bool stop_sent;
+  struct stream_context *sc;
+  bool streaming, usb_failed, overrun, ok;
+  struct stream_stats stats;
+  sem_t done;
+  struct stream_buffer begin, end;
+};
+
+static struct stream_buffer stream_quit = { STREAM_BUFFER_QUIT };
+
+/* Everything about the captures from one device; contexts for
+   different devices are independent of each other */
+struct stream_context {
+  struct device *dev;
+
+  FILE *file;
+  struct fluxz *fluxz;
+
+  struct ring filled, spares;
+  struct stream_buffer *buffers;
+  uint32_t bufsize;
+  unsigned bufcount;
+  sem_t filled_sem;
+  pthread_t writer;
+  bool writer_running;
+  atomic_bool stop;
+  pthread_mutex_t stop_lock;
+  struct stream_job *current;
+  struct stream_stats last_stats;
+  bool compression;
+  struct fluxz *writer_fluxz;
+  bool flux_decoding;
+  struct flux_decoder decoder;
+  struct flux_track *last_flux;
+  bool sector_decoding;
+  struct sector_job *last_sectors;
+  bool early_stop;
+  int output;
+  int durability;
+  /* Complete streams waiting for stream_sync, by final name */
+  pthread_mutex_t unsynced_lock;
+  char **unsynced;
+  unsigned unsynced_count, unsynced_alloc;
+  /* Bytes written to the file of the last track, and so far to the
+     current one, and the CRC of those */
+  uint64_t last_written, written;
+  uint32_t crc;
+  int hash_alg;
+  struct hash hash;
+
+  struct stream_parser parser;
+  bool failed;
+  /* Where the writer times its writes, if anywhere */
+  struct telemetry_histogram *writes;
+};
+
+/* The device may be NULL when no capture is made, as in the benchmark */
+struct stream_context *stream_context_new(struct device *dev)
+{
+  struct stream_context *sc = calloc(1, sizeof(struct stream_context));
+  if (!sc) {
+    fprintf(stderr, "Out of memory!\n");
+    return NULL;
+  }
+  sc->dev = dev;
+  pthread_mutex_init(&sc->stop_lock, NULL);
+  pthread_mutex_init(&sc->unsynced_lock, NULL);
+  return sc;
+}
+
+void stream_context_free(struct stream_context *sc)
+{
+  if (!sc)
+    return;
+  stream_writer_stop(sc);
+  flux_track_free(sc->last_flux);
+  if (sc->last_sectors)
+    flux_track_free(sector_wait(sc->last_sectors, NULL));
+  pthread_mutex_destroy(&sc->stop_lock);
+  stream_sync(sc);
+  free(sc->unsynced);
+  pthread_mutex_destroy(&sc->unsynced_lock);
+  free(sc);
+}
+
+bool stream_validate_data(struct stream_context *sc,
+			  const uint8_t *data, uint32_t len)
+{
+  if (!stream_parser_feed(&sc->parser, data, len)) {
+    fprintf(stderr, "%s\n", sc->parser.error);
+    return false;
   }
   return true;
 }
 
-static bool stream_callback(const uint8_t *data, uint32_t len)
+/* Everything that goes into the file passes here, compressed or not */
+static bool stream_file_write(void *ctx, const uint8_t *data, uint32_t len)
 {
-  if (stream_complete || stream_failed || !stream_file)
+  struct stream_context *sc = ctx;
+  if (fwrite(data, 1, len, sc->file) != len) {
+    fprintf(stderr, "Failed to write data to file\n");
+    return false;
+  }
+  sc->written += len;
+  sc->crc = journal_crc(sc->crc, data, len);
+  hash_update(&sc->hash, data, len);
+  return true;
+}
+
+static bool stream_write(struct stream_context *sc,
+			 const uint8_t *data, uint32_t len)
+{
+  double t0 = (sc->writes? telemetry_now() : 0);
+  bool r;
+  if (sc->fluxz)
+    r = fluxz_write(sc->fluxz, data, len);
+  else
+    r = stream_file_write(sc, data, len);
+  if (sc->writes)
+    telemetry_record(sc->writes, telemetry_now() - t0);
+  return r;
+}
+
+bool stream_callback(struct stream_context *sc,
+		     const uint8_t *data, uint32_t len)
+{
+  if (sc->parser.complete || sc->failed || !sc->file)
     return false;
   if (!data) {
-    stream_failed = true;
+    sc->failed = true;
     return false;
   }
   if (!len)
     return true;
-  if (!stream_validate_data(data, len)) {
-    stream_failed = true;
+  if (!stream_validate_data(sc, data, len)) {
+    sc->failed = true;
     return false;
   }
-  if (fwrite(data, 1, len, stream_file) != len) {
-    fprintf(stderr, "Failed to write data to file\n");
-    stream_failed = true;
+  if (!stream_write(sc, data, len)) {
+    sc->failed = true;
     return false;
   }
-  return !stream_complete;
+  return !sc->parser.complete;
 }
 
-static bool stream_device_capture(void)
+void stream_reset(struct stream_context *sc, FILE *file)
 {
-  stream_complete = stream_failed = false;
-  result_found = false;
-  current_streampos = 0;
-  skipcount = 0;
-
-  if (!device_start_async_read(stream_callback))
-    return false;
-
-  if (!device_stream_on())
-    return false;
-
-  if (!device_finish_async_read())
-    return false;
-
-  if (!device_stream_off())
-    return false;
+  sc->file = file;
+  sc->fluxz = NULL;
+  sc->writes = NULL;
+  sc->written = 0;
+  sc->crc = 0;
+  hash_init(&sc->hash, sc->hash_alg);
+  stream_parser_init(&sc->parser);
+  sc->failed = false;
+}
 
-  return true;
+bool stream_succeeded(struct stream_context *sc)
+{
+  return sc->parser.complete && !sc->failed;
 }
 
-static bool stream_write_preamble(void)
+static bool stream_write_preamble(struct stream_context *sc)
 {
   uint8_t buf[128];
   time_t t = time(NULL);
@@ -208,28 +260,647 @@ static bool stream_write_preamble(void)
   buf[1] = 4;
   buf[2] = l;
   buf[3] = 0;
-  if (fwrite(buf, 1, l+4, stream_file) != l+4) {
-    fprintf(stderr, "Failed to write data to file\n");
+  return stream_write(sc, buf, l+4);
+}
+
+/* Called on the writer when a job needs no more data */
+static void stream_job_stop(struct stream_job *job)
+{
+  struct stream_context *sc = job->sc;
+  pthread_mutex_lock(&sc->stop_lock);
+  if (job->streaming) {
+    /* Stop the transfers right away instead of waiting for them to
+       time out */
+    atomic_store(&sc->stop, true);
+    if (sc->dev)
+      device_cancel_async_read(sc->dev);
+  }
+  pthread_mutex_unlock(&sc->stop_lock);
+}
+
+/* Asks the firmware to end the stream once enough revolutions are in;
+   the rest of the stream, up to the end markers, still comes as usual.
+   The request is not waited for: the USB callback may be waiting for
+   this thread, and the reply would need it to run. */
+static void stream_job_stop_early(struct stream_job *job)
+{
+  struct stream_context *sc = job->sc;
+  if (job->stop_sent || sc->parser.index_count <= job->stop_revs ||
+      sc->parser.streampos <= sc->parser.index_pos)
+    return;
+  job->stop_sent = true;
+  pthread_mutex_lock(&sc->stop_lock);
+  if (job->streaming && !device_request_stream_off(sc->dev))
+    sc->failed = true;
+  pthread_mutex_unlock(&sc->stop_lock);
+}
+
+static void stream_job_open(struct stream_job *job)
+{
+  struct stream_context *sc = job->sc;
+  if (job->container)
+    job->file = container_begin_entry(job->container, job->track, job->side);
+  else if (!(job->file = output_open((job->partname? job->partname :
+				      job->filename), sc->output,
+				     /* Room for a slightly longer track */
+				     sc->last_written + sc->last_written/8)))
+    perror(job->partname? job->partname : job->filename);
+  if (!job->file) {
+    stream_reset(sc, NULL);
+    sc->failed = true;
+    stream_job_stop(job);
+    return;
+  }
+  stream_reset(sc, job->file);
+  sc->writes = &job->stats.writes;
+  if (job->compress) {
+    /* Compression runs here on the writer, off the USB event path */
+    if (!sc->writer_fluxz && !(sc->writer_fluxz = fluxz_new())) {
+      sc->failed = true;
+      stream_job_stop(job);
+      return;
+    }
+    sc->fluxz = sc->writer_fluxz;
+    if (!fluxz_begin_sink(sc->fluxz, stream_file_write, sc)) {
+      sc->failed = true;
+      stream_job_stop(job);
+      return;
+    }
+  }
+  if (job->decode && (job->flux = flux_track_new()))
+    flux_decoder_init(&sc->decoder, job->flux);
+  if (!stream_write_preamble(sc)) {
+    sc->failed = true;
+    stream_job_stop(job);
+  }
+}
+
+static bool stream_rename(const char *from, const char *to)
+{
+  if (rename(from, to)) {
+    perror(to);
     return false;
   }
   return true;
 }
 
-bool stream_capture(const char *filename)
+/* Opening for reading is enough to flush the data written through
+   any descriptor */
+static bool stream_sync_file(const char *filename, bool wait)
 {
-  bool r;
-  stream_file = fopen(filename, "wb");
-  if (!stream_file) {
+  int fd = open(filename, O_RDONLY);
+  bool r = true;
+  if (fd < 0) {
     perror(filename);
     return false;
   }
-  r = stream_write_preamble();
-  if (r)
-    r = stream_device_capture();
-  if (fclose(stream_file)) {
-    perror(filename);
+  if (wait) {
+    if (fdatasync(fd)) {
+      perror(filename);
+      r = false;
+    }
+  }
+#ifdef SYNC_FILE_RANGE_WRITE
+  else
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+  close(fd);
+  return r;
+}
+
+/* Makes the renames in the directory of filename durable */
+static bool stream_sync_dir(const char *filename)
+{
+  const char *slash = strrchr(filename, '/');
+  char *dir = (slash? strndup(filename, slash - filename + 1) : NULL);
+  bool r = true;
+  int fd;
+  if (slash && !dir) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  if ((fd = open((dir? dir : "."), O_RDONLY|O_DIRECTORY)) < 0 ||
+      fsync(fd)) {
+    perror(dir? dir : ".");
     r = false;
   }
-  stream_file = NULL;
-  return r && stream_complete && !stream_failed;
+  if (fd >= 0)
+    close(fd);
+  free(dir);
+  return r;
+}
+
+static char *stream_partname(const char *filename)
+{
+  char *p = malloc(strlen(filename) + sizeof(STREAM_PARTIAL_SUFFIX));
+  if (p) {
+    strcpy(p, filename);
+    strcat(p, STREAM_PARTIAL_SUFFIX);
+  }
+  return p;
+}
+
+/* Gives a complete stream its final name, now or at stream_sync */
+static bool stream_job_commit(struct stream_job *job)
+{
+  struct stream_context *sc = job->sc;
+  char **n;
+  switch (sc->durability) {
+  case STREAM_SYNC_DISK:
+    /* Started now, the writeback is mostly done by stream_sync */
+    stream_sync_file(job->partname, false);
+    pthread_mutex_lock(&sc->unsynced_lock);
+    if (sc->unsynced_count == sc->unsynced_alloc) {
+      if (!(n = realloc(sc->unsynced, (sc->unsynced_alloc*2 + 16) *
+			sizeof(char *)))) {
+	pthread_mutex_unlock(&sc->unsynced_lock);
+	fprintf(stderr, "Out of memory!\n");
+	return false;
+      }
+      sc->unsynced = n;
+      sc->unsynced_alloc = sc->unsynced_alloc*2 + 16;
+    }
+    sc->unsynced[sc->unsynced_count++] = job->filename;
+    job->filename = NULL;
+    pthread_mutex_unlock(&sc->unsynced_lock);
+    return true;
+  case STREAM_SYNC_TRACK:
+    return
+      stream_sync_file(job->partname, true) &&
+      stream_rename(job->partname, job->filename) &&
+      stream_sync_dir(job->filename);
+  default:
+    return stream_rename(job->partname, job->filename);
+  }
+}
+
+/* The data of each file is on the disk before it is renamed, so that a
+   crash leaves no final name on an incomplete file; the directories
+   are synced once all are renamed */
+bool stream_sync(struct stream_context *sc)
+{
+  const char *lastdir = NULL;
+  size_t lastdirlen = 0;
+  char *part;
+  unsigned i;
+  bool r = true;
+  pthread_mutex_lock(&sc->unsynced_lock);
+  for (i = 0; i < sc->unsynced_count; i++) {
+    if (!(part = stream_partname(sc->unsynced[i]))) {
+      fprintf(stderr, "Out of memory!\n");
+      r = false;
+      continue;
+    }
+    if (!stream_sync_file(part, true) || !stream_rename(part, sc->unsynced[i]))
+      r = false;
+    free(part);
+  }
+  for (i = 0; i < sc->unsynced_count; i++) {
+    const char *slash = strrchr(sc->unsynced[i], '/');
+    size_t dirlen = (slash? slash - sc->unsynced[i] : 0);
+    if (!lastdir || dirlen != lastdirlen ||
+	strncmp(lastdir, sc->unsynced[i], dirlen)) {
+      if (!stream_sync_dir(sc->unsynced[i]))
+	r = false;
+      lastdir = sc->unsynced[i];
+      lastdirlen = dirlen;
+    }
+  }
+  for (i = 0; i < sc->unsynced_count; i++)
+    free(sc->unsynced[i]);
+  sc->unsynced_count = 0;
+  pthread_mutex_unlock(&sc->unsynced_lock);
+  return r;
+}
+
+static void stream_job_finish(struct stream_job *job)
+{
+  struct stream_context *sc = job->sc;
+  unsigned flags = 0;
+  if (job->usb_failed)
+    sc->failed = true;
+  if (job->overrun) {
+    fprintf(stderr, "Writer fell a whole buffer pool behind\n");
+    sc->failed = true;
+  }
+  if (sc->fluxz) {
+    /* Also an incomplete stream is finished, so it can be decoded */
+    if (!fluxz_finish(sc->fluxz))
+      sc->failed = true;
+    fluxz_get_sizes(sc->fluxz, &job->stats.raw, &job->stats.coded);
+    flags |= CONTAINER_ENTRY_COMPRESSED;
+  }
+  if (stream_succeeded(sc))
+    flags |= CONTAINER_ENTRY_COMPLETE;
+  if (job->flux && !flux_decoder_finish(&sc->decoder)) {
+    flux_track_free(job->flux);
+    job->flux = NULL;
+  }
+  if (job->flux && job->sectors) {
+    /* Decoded on the pool while the next track is captured */
+    job->sector_job = sector_submit(job->flux);
+    job->flux = NULL;
+  }
+  if (job->container) {
+    /* The entry is kept even if incomplete, like a partial .raw file */
+    if (job->file && !container_end_entry(job->container, flags))
+      sc->failed = true;
+  } else if (job->file && fclose(job->file)) {
+    perror(job->partname? job->partname : job->filename);
+    sc->failed = true;
+  } else if (job->file && job->partname && stream_succeeded(sc) &&
+	     !stream_job_commit(job)) {
+    /* An incomplete one keeps the partial name */
+    sc->failed = true;
+  }
+  job->file = NULL;
+  job->ok = stream_succeeded(sc);
+  sc->last_written = job->stats.written = sc->written;
+  job->stats.crc = sc->crc;
+  hash_final(&sc->hash, job->stats.digest);
+  stream_reset(sc, NULL);
+  sem_post(&job->done);
+}
+
+static void *stream_writer_main(void *arg)
+{
+  struct stream_context *sc = arg;
+  struct stream_job *job = NULL;
+  bool stopped = false;
+  for (;;) {
+    struct stream_buffer *sb;
+    bool stop = false;
+    while (sem_wait(&sc->filled_sem))
+      ;
+    sb = ring_pop(&sc->filled);
+    switch (sb->kind) {
+    case STREAM_BUFFER_QUIT:
+      return NULL;
+    case STREAM_BUFFER_BEGIN:
+      job = sb->job;
+      stopped = false;
+      stream_job_open(job);
+      continue;
+    case STREAM_BUFFER_END:
+      stream_job_finish(sb->job);
+      job = NULL;
+      continue;
+    }
+    if (job && !stopped) {
+      if (job->flux)
+	flux_decoder_feed(&sc->decoder, sb->data, sb->len);
+      if (!stream_callback(sc, sb->data, sb->len))
+	/* Complete or failed */
+	stop = stopped = true;
+    }
+    /* The buffer goes back before anything else is done about it */
+    ring_push(&sc->spares, sb);
+    if (stop)
+      stream_job_stop(job);
+    else if (job && !stopped && job->stop_revs)
+      stream_job_stop_early(job);
+  }
+}
+
+/* For a caller of stream_handoff that can wait, unlike the USB
+   callback */
+unsigned stream_spare_count(struct stream_context *sc)
+{
+  return ring_count(&sc->spares);
+}
+
+static void stream_queue(struct stream_context *sc,
+			 struct stream_buffer *sb)
+{
+  ring_push(&sc->filled, sb);
+  sem_post(&sc->filled_sem);
+}
+
+bool stream_handoff(void *ctx, uint8_t **bufp, uint32_t len)
+{
+  struct stream_context *sc = ctx;
+  struct stream_buffer *sb;
+  uint8_t *spare;
+  unsigned level;
+  if (!*bufp) {
+    sc->current->usb_failed = true;
+    return false;
+  }
+  if (atomic_load_explicit(&sc->stop, memory_order_relaxed))
+    return false;
+  if (!len)
+    return true;
+  if (!(sb = ring_pop(&sc->spares))) {
+    /* The writer is a whole pool behind.  Waiting here would hold up
+       the event handling of every board, so only this track is given
+       up, to be retried or reported. */
+    sc->current->stats.stalls++;
+    sc->current->overrun = true;
+    atomic_store(&sc->stop, true);
+    return false;
+  }
+  spare = sb->data;
+  sb->data = *bufp;
+  sb->len = len;
+  *bufp = spare;
+  stream_queue(sc, sb);
+  level = ring_count(&sc->filled);
+  if (level > sc->current->stats.peak)
+    sc->current->stats.peak = level;
+  return true;
+}
+
+static void stream_free_buffers(struct stream_context *sc)
+{
+  while (sc->bufcount > 0) {
+    --sc->bufcount;
+    device_free_buffer(sc->dev, sc->buffers[sc->bufcount].data,
+		       sc->bufsize);
+  }
+  free(sc->buffers);
+  sc->buffers = NULL;
+  ring_free(&sc->spares);
+  ring_free(&sc->filled);
+}
+
+bool stream_writer_start(struct stream_context *sc, uint32_t bufsize)
+{
+  unsigned i, count;
+
+  if (sc->writer_running) {
+    if (bufsize == sc->bufsize)
+      return true;
+    stream_writer_stop(sc);
+  }
+
+  count = STREAM_SPARE_POOL_SIZE / bufsize;
+  if (count < STREAM_MIN_SPARE_BUFFERS)
+    count = STREAM_MIN_SPARE_BUFFERS;
+  atomic_store(&sc->stop, false);
+  sc->bufsize = bufsize;
+  if (!ring_init(&sc->filled, count + STREAM_MAX_CONTROL))
+    return false;
+  if (!ring_init(&sc->spares, count)) {
+    ring_free(&sc->filled);
+    return false;
+  }
+  sc->buffers = calloc(count, sizeof(struct stream_buffer));
+  if (!sc->buffers) {
+    fprintf(stderr, "Out of memory!\n");
+    stream_free_buffers(sc);
+    return false;
+  }
+  for (i = 0; i < count; i++) {
+    if (!(sc->buffers[i].data = device_alloc_buffer(sc->dev, bufsize))) {
+      fprintf(stderr, "Out of memory!\n");
+      stream_free_buffers(sc);
+      return false;
+    }
+    sc->buffers[i].kind = STREAM_BUFFER_DATA;
+    sc->bufcount++;
+    ring_push(&sc->spares, &sc->buffers[i]);
+  }
+  sem_init(&sc->filled_sem, 0, 0);
+  if (pthread_create(&sc->writer, NULL, stream_writer_main, sc)) {
+    fprintf(stderr, "Failed to start writer thread\n");
+    sem_destroy(&sc->filled_sem);
+    stream_free_buffers(sc);
+    return false;
+  }
+  sc->writer_running = true;
+  return true;
+}
+
+void stream_writer_stop(struct stream_context *sc)
+{
+  if (!sc->writer_running)
+    return;
+  stream_queue(sc, &stream_quit);
+  pthread_join(sc->writer, NULL);
+  sem_destroy(&sc->filled_sem);
+  stream_free_buffers(sc);
+  fluxz_free(sc->writer_fluxz);
+  sc->writer_fluxz = NULL;
+  sc->writer_running = false;
+}
+
+/* Takes effect from the next job */
+void stream_set_compression(struct stream_context *sc, bool compress)
+{
+  sc->compression = compress;
+}
+
+/* One of STREAM_SYNC_*; takes effect from the next job */
+void stream_set_durability(struct stream_context *sc, int durability)
+{
+  sc->durability = durability;
+}
+
+/* One of HASH_*; takes effect from the next job */
+void stream_set_hash(struct stream_context *sc, int alg)
+{
+  sc->hash_alg = alg;
+}
+
+/* How the files of the tracks are written, one of OUTPUT_*; takes
+   effect from the next job */
+void stream_set_output(struct stream_context *sc, int backend)
+{
+  sc->output = backend;
+}
+
+/* Decodes the flux intervals on the writer while capturing; takes
+   effect from the next job */
+void stream_set_flux_decoding(struct stream_context *sc, bool decode)
+{
+  sc->flux_decoding = decode;
+}
+
+/* The flux of the track last waited for, which the caller then owns;
+   NULL if decoding was off or failed */
+struct flux_track *stream_take_flux(struct stream_context *sc)
+{
+  struct flux_track *t = sc->last_flux;
+  sc->last_flux = NULL;
+  return t;
+}
+
+/* Also hands the flux to the sector decoder pool; implies flux decoding */
+void stream_set_sector_decoding(struct stream_context *sc, bool decode)
+{
+  sc->sector_decoding = decode;
+}
+
+/* Streams without a revolution limit in the firmware, and stops once
+   the device's number of revolutions has been received; takes effect
+   from the next job */
+void stream_set_early_stop(struct stream_context *sc, bool stop)
+{
+  sc->early_stop = stop;
+  device_set_revolution_limit(sc->dev, !stop);
+}
+
+/* The sector decoding of the track last waited for, which the caller
+   then waits for with sector_wait; the flux then comes from there
+   instead of from stream_take_flux */
+struct sector_job *stream_take_sectors(struct stream_context *sc)
+{
+  struct sector_job *job = sc->last_sectors;
+  sc->last_sectors = NULL;
+  return job;
+}
+
+/* Jobs are begun and closed on the thread running the capture, never
+   while stream_handoff may run.  A partial file is renamed to filename
+   once complete. */
+static struct stream_job *stream_job_new(struct stream_context *sc,
+					 const char *filename, bool partial,
+					 struct container *container,
+					 unsigned track, unsigned side)
+{
+  struct stream_job *job = calloc(1, sizeof(struct stream_job));
+  if (!job || (filename && !(job->filename = strdup(filename))) ||
+      (partial && !(job->partname = stream_partname(filename)))) {
+    fprintf(stderr, "Out of memory!\n");
+    if (job)
+      free(job->filename);
+    free(job);
+    return NULL;
+  }
+  job->container = container;
+  job->track = track;
+  job->side = side;
+  job->compress = sc->compression;
+  job->decode = sc->flux_decoding || sc->sector_decoding;
+  job->sectors = sc->sector_decoding;
+  job->stop_revs = (sc->early_stop? device_get_revolutions(sc->dev) : 0);
+  job->sc = sc;
+  sem_init(&job->done, 0, 0);
+  job->stats.size = sc->bufcount;
+  job->begin.kind = STREAM_BUFFER_BEGIN;
+  job->begin.job = job;
+  job->end.kind = STREAM_BUFFER_END;
+  job->end.job = job;
+  pthread_mutex_lock(&sc->stop_lock);
+  atomic_store(&sc->stop, false);
+  job->streaming = true;
+  sc->current = job;
+  pthread_mutex_unlock(&sc->stop_lock);
+  stream_queue(sc, &job->begin);
+  return job;
+}
+
+struct stream_job *stream_job_begin(struct stream_context *sc,
+				    const char *filename)
+{
+  return stream_job_new(sc, filename, false, NULL, 0, 0);
+}
+
+/* The container must stay open until the job has been waited for */
+struct stream_job *stream_job_begin_entry(struct stream_context *sc,
+					  struct container *container,
+					  unsigned track, unsigned side)
+{
+  return stream_job_new(sc, NULL, false, container, track, side);
+}
+
+void stream_job_close(struct stream_job *job)
+{
+  struct stream_context *sc = job->sc;
+  pthread_mutex_lock(&sc->stop_lock);
+  job->streaming = false;
+  pthread_mutex_unlock(&sc->stop_lock);
+  stream_queue(sc, &job->end);
+}
+
+bool stream_job_wait(struct stream_job *job)
+{
+  struct stream_context *sc = job->sc;
+  bool r;
+  while (sem_wait(&job->done))
+    ;
+  r = job->ok;
+  sc->last_stats = job->stats;
+  flux_track_free(sc->last_flux);
+  sc->last_flux = job->flux;
+  if (sc->last_sectors)
+    flux_track_free(sector_wait(sc->last_sectors, NULL));
+  sc->last_sectors = job->sector_job;
+  sem_destroy(&job->done);
+  free(job->filename);
+  free(job->partname);
+  free(job);
+  return r;
+}
+
+void stream_get_stats(struct stream_context *sc, struct stream_stats *stats)
+{
+  *stats = sc->last_stats;
+}
+
+static bool stream_device_capture(struct stream_context *sc)
+{
+  if (!device_start_async_read(sc->dev, stream_handoff, sc))
+    return false;
+
+  if (!device_stream_on(sc->dev)) {
+    device_cancel_async_read(sc->dev);
+    device_finish_async_read(sc->dev);
+    return false;
+  }
+
+  /* Stream off is sent even after a failure, which also waits out an
+     early one still on its way */
+  if (!device_finish_async_read(sc->dev)) {
+    device_stream_off(sc->dev);
+    return false;
+  }
+
+  if (!device_stream_off(sc->dev))
+    return false;
+
+  return true;
+}
+
+static struct stream_job *stream_capture_job(struct stream_job *job)
+{
+  if (!stream_device_capture(job->sc))
+    job->usb_failed = true;
+  device_get_transfer_stats(job->sc->dev, &job->stats.usb);
+  stream_job_close(job);
+  return job;
+}
+
+/* Streams one track into a new job and returns once streaming is done;
+   the file may still be open on the writer at that point */
+struct stream_job *stream_capture_begin(struct stream_context *sc,
+					const char *filename)
+{
+  struct stream_job *job;
+  if (!stream_writer_start(sc, device_async_buffer_size(sc->dev)) ||
+      !(job = stream_job_new(sc, filename, true, NULL, 0, 0)))
+    return NULL;
+  return stream_capture_job(job);
+}
+
+struct stream_job *stream_capture_begin_entry(struct stream_context *sc,
+					      struct container *container,
+					      unsigned track, unsigned side)
+{
+  struct stream_job *job;
+  if (!stream_writer_start(sc, device_async_buffer_size(sc->dev)) ||
+      !(job = stream_job_begin_entry(sc, container, track, side)))
+    return NULL;
+  return stream_capture_job(job);
+}
+
+bool stream_capture_end(struct stream_job *job)
+{
+  return stream_job_wait(job);
+}
+
+bool stream_capture(struct stream_context *sc, const char *filename)
+{
+  struct stream_job *job = stream_capture_begin(sc, filename);
+  return job && stream_capture_end(job);
 }
@@ -20,7 +20,83 @@
 
 # include <stdint.h>
 # include <stdbool.h>
+# include <stdio.h>
+# include <telemetry.h>
+# include <hash.h>
 
-extern bool stream_capture(const char *filename);
+struct stream_stats {
+  unsigned size;    /* spare buffers in the writer pool */
+  unsigned peak;    /* most buffers queued for the writer at once */
+  unsigned stalls;  /* times the USB callback found no spare, which
+		       ends the capture */
+  uint64_t raw;     /* stream bytes, when compressing */
+  uint64_t coded;   /* bytes stored after compression */
+  uint64_t written; /* bytes in the file */
+  uint32_t crc;     /* CRC-32 of the file, as in the journal */
+  char digest[HASH_HEX_SIZE];  /* of the file, if a hash is set */
+  struct telemetry_transfers usb;    /* the transfers of the track */
+  struct telemetry_histogram writes; /* time per write on the writer */
+};
+
+/* Added to the name of a stream file until it is complete */
+# define STREAM_PARTIAL_SUFFIX ".part"
+
+/* When the stream files are made durable */
+enum {
+  STREAM_SYNC_NONE,   /* left to the operating system */
+  STREAM_SYNC_TRACK,  /* each before it gets its final name */
+  STREAM_SYNC_DISK    /* all together at stream_sync */
+};
+
+struct stream_context;
+struct stream_job;
+struct device;
+struct container;
+struct flux_track;
+struct sector_job;
+
+extern struct stream_context *stream_context_new(struct device *dev);
+extern void stream_context_free(struct stream_context *sc);
+extern bool stream_capture(struct stream_context *sc, const char *filename);
+extern struct stream_job *stream_capture_begin(struct stream_context *sc,
+					       const char *filename);
+extern struct stream_job *stream_capture_begin_entry(struct stream_context *sc,
+						     struct container *container,
+						     unsigned track,
+						     unsigned side);
+extern bool stream_capture_end(struct stream_job *job);
+extern void stream_get_stats(struct stream_context *sc,
+			     struct stream_stats *stats);
+extern void stream_set_compression(struct stream_context *sc, bool compress);
+extern void stream_set_output(struct stream_context *sc, int backend);
+extern void stream_set_durability(struct stream_context *sc, int durability);
+extern void stream_set_hash(struct stream_context *sc, int alg);
+/* Completes the streams left to be made durable together */
+extern bool stream_sync(struct stream_context *sc);
+extern void stream_set_flux_decoding(struct stream_context *sc, bool decode);
+extern struct flux_track *stream_take_flux(struct stream_context *sc);
+extern void stream_set_sector_decoding(struct stream_context *sc,
+				       bool decode);
+extern struct sector_job *stream_take_sectors(struct stream_context *sc);
+extern void stream_set_early_stop(struct stream_context *sc, bool stop);
+
+/* Lower level access to the capture path, used by the benchmark */
+extern void stream_reset(struct stream_context *sc, FILE *file);
+extern bool stream_validate_data(struct stream_context *sc,
+				 const uint8_t *data, uint32_t len);
+extern bool stream_callback(struct stream_context *sc,
+			    const uint8_t *data, uint32_t len);
+extern bool stream_succeeded(struct stream_context *sc);
+extern bool stream_writer_start(struct stream_context *sc, uint32_t bufsize);
+extern void stream_writer_stop(struct stream_context *sc);
+extern struct stream_job *stream_job_begin(struct stream_context *sc,
+					   const char *filename);
+extern struct stream_job *stream_job_begin_entry(struct stream_context *sc,
+						 struct container *container,
+						 unsigned track, unsigned side);
+extern bool stream_handoff(void *ctx, uint8_t **bufp, uint32_t len);
+extern unsigned stream_spare_count(struct stream_context *sc);
+extern void stream_job_close(struct stream_job *job);
+extern bool stream_job_wait(struct stream_job *job);
 
 #endif /* OPENDTC_STREAM_H */
@@ -0,0 +1,130 @@
+/* telemetry.c -- timing statistics of captures
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Everything here is cheap enough to run on every transfer and every
+   write: a clock read, a few adds and a bucket index.  The statistics
+   are only put together into text when a track is reported. */
+
+#include <config.h>
+#include <telemetry.h>
+#include <string.h>
+#include <time.h>
+
+double telemetry_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void telemetry_record(struct telemetry_histogram *h, double t)
+{
+  uint64_t us = (t > 0? t * 1e6 : 0);
+  unsigned b = (us? 64 - __builtin_clzll(us) : 0);
+  if (b >= TELEMETRY_BUCKETS)
+    b = TELEMETRY_BUCKETS - 1;
+  h->buckets[b]++;
+  h->count++;
+  h->total += t;
+  if (t > h->max)
+    h->max = t;
+}
+
+/* The upper end of the bucket holding the p'th fraction of the times,
+   in seconds */
+double telemetry_percentile(const struct telemetry_histogram *h, double p)
+{
+  unsigned long n = 0, want = p * h->count;
+  unsigned b;
+  if (!h->count)
+    return 0;
+  for (b = 0; b < TELEMETRY_BUCKETS - 1; b++)
+    if ((n += h->buckets[b]) > want || n == h->count)
+      break;
+  return ((double)(1ULL << b) * 1e-6 < h->max?
+	  (double)(1ULL << b) * 1e-6 : h->max);
+}
+
+/* For each transfer completed; in_flight is the number of transfers
+   still queued at the device besides this one */
+void telemetry_completion(struct telemetry_transfers *t, double now,
+			  uint32_t bytes, unsigned in_flight)
+{
+  unsigned slot;
+  if (in_flight >= UINT16_MAX)
+    in_flight = UINT16_MAX - 1;
+  if (t->completions++) {
+    telemetry_record(&t->gaps, now - t->last);
+    if (in_flight < t->in_flight_min)
+      t->in_flight_min = in_flight;
+  } else {
+    t->first = now;
+    t->in_flight_min = in_flight;
+  }
+  t->last = now;
+  t->duration = now - t->first;
+  t->bytes += bytes;
+  t->in_flight_total += in_flight;
+  slot = (now - t->first) / TELEMETRY_TRACE_SLOT;
+  if (slot >= TELEMETRY_TRACE_SLOTS)
+    return;
+  /* Slots without completions are left at UINT16_MAX */
+  while (t->trace_count <= slot)
+    t->in_flight_trace[t->trace_count++] = UINT16_MAX;
+  if (in_flight < t->in_flight_trace[slot])
+    t->in_flight_trace[slot] = in_flight;
+}
+
+/* JSON members, without separators around them; times in microseconds */
+void telemetry_write_histogram(FILE *f, const char *name,
+			       const struct telemetry_histogram *h)
+{
+  unsigned b, n = TELEMETRY_BUCKETS;
+  while (n > 0 && !h->buckets[n-1])
+    --n;
+  fprintf(f, "\"%s\":{\"count\":%lu,\"mean\":%.1f,\"p50\":%.1f,"
+	  "\"p99\":%.1f,\"max\":%.1f,\"buckets\":[", name, h->count,
+	  (h->count? h->total * 1e6 / h->count : 0.0),
+	  telemetry_percentile(h, 0.5) * 1e6,
+	  telemetry_percentile(h, 0.99) * 1e6, h->max * 1e6);
+  for (b = 0; b < n; b++)
+    fprintf(f, "%s%lu", (b? "," : ""), h->buckets[b]);
+  fprintf(f, "]}");
+}
+
+void telemetry_write_transfers(FILE *f, const char *name,
+			       const struct telemetry_transfers *t)
+{
+  unsigned i;
+  fprintf(f, "\"%s\":{\"completions\":%lu,\"bytes\":%llu,"
+	  "\"duration\":%.6f,\"rate\":%.0f,", name, t->completions,
+	  (unsigned long long)t->bytes, t->duration,
+	  (t->duration > 0? t->bytes / t->duration : 0.0));
+  telemetry_write_histogram(f, "gaps", &t->gaps);
+  putc(',', f);
+  telemetry_write_histogram(f, "callbacks", &t->callbacks);
+  fprintf(f, ",\"in_flight_min\":%u,\"in_flight_mean\":%.1f,"
+	  "\"in_flight_trace\":[", t->in_flight_min,
+	  (t->completions?
+	   (double)t->in_flight_total / t->completions : 0.0));
+  for (i = 0; i < t->trace_count; i++)
+    if (t->in_flight_trace[i] == UINT16_MAX)
+      fprintf(f, "%snull", (i? "," : ""));
+    else
+      fprintf(f, "%s%u", (i? "," : ""), t->in_flight_trace[i]);
+  fprintf(f, "]}");
+}
@@ -0,0 +1,65 @@
+/* telemetry.h: timing statistics of captures
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef OPENDTC_TELEMETRY_H
+# define OPENDTC_TELEMETRY_H
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stdio.h>
+
+/* Bucket 0 counts times below 1 us, bucket i times from 2^(i-1) up to
+   2^i us, and the last bucket everything longer */
+# define TELEMETRY_BUCKETS 24
+
+/* The transfers left queued are traced in slots of this many seconds */
+# define TELEMETRY_TRACE_SLOT  0.1
+# define TELEMETRY_TRACE_SLOTS 256
+
+struct telemetry_histogram {
+  unsigned long count;
+  double total, max;  /* seconds */
+  unsigned long buckets[TELEMETRY_BUCKETS];
+};
+
+/* The transfers of one capture, as seen by the USB layer */
+struct telemetry_transfers {
+  unsigned long completions;
+  uint64_t bytes;
+  double first, last;                   /* completion times */
+  double duration;                      /* from the first to the last */
+  struct telemetry_histogram gaps;      /* between two completions */
+  struct telemetry_histogram callbacks; /* spent in the callback */
+  unsigned in_flight_min;               /* fewest transfers left queued */
+  uint64_t in_flight_total;
+  /* The fewest transfers queued during each slot */
+  unsigned trace_count;
+  uint16_t in_flight_trace[TELEMETRY_TRACE_SLOTS];
+};
+
+extern double telemetry_now(void);
+extern void telemetry_record(struct telemetry_histogram *h, double t);
+extern double telemetry_percentile(const struct telemetry_histogram *h,
+				   double p);
+extern void telemetry_completion(struct telemetry_transfers *t, double now,
+				 uint32_t bytes, unsigned in_flight);
+extern void telemetry_write_histogram(FILE *f, const char *name,
+				      const struct telemetry_histogram *h);
+extern void telemetry_write_transfers(FILE *f, const char *name,
+				      const struct telemetry_transfers *t);
+
+#endif /* OPENDTC_TELEMETRY_H */
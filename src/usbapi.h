@@ -21,10 +21,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "usbimpl.h"
+#include "telemetry.h"
 
 extern bool usbapi_init(void);
 extern void usbapi_exit(void);
+extern bool usbapi_start_event_thread(bool realtime, int cpu);
 extern usbapi_handle usbapi_open(uint16_t vid, uint16_t pid, unsigned num);
+/* Like usbapi_open, but waits up to timeout ms for the device to appear */
+extern usbapi_handle usbapi_wait_open(uint16_t vid, uint16_t pid,
+				      unsigned num, unsigned timeout);
 extern void usbapi_close(usbapi_handle hdl);
 extern bool usbapi_claim_interface(usbapi_handle hdl, int ifc);
 extern bool usbapi_release_interface(usbapi_handle hdl, int ifc);
@@ -37,11 +42,55 @@ extern int32_t usbapi_sync_control_in(usbapi_handle hdl, uint8_t reqtype,
 				      uint16_t index, uint8_t *buf,
 				      uint32_t len, unsigned timeout,
 				      bool silent_nak);
-extern usbapi_async_handle usbapi_async_bulk_in(usbapi_handle hdl, int ep,
-						int bufcnt, uint32_t bufsize,
-						unsigned timeout,
-						bool (*callback)(const uint8_t *, uint32_t));
+
+/* One of the requests of usbapi_control_in_batch; len is set to the
+   length of the reply, or to -1 if the request failed */
+struct usbapi_control {
+  uint8_t request;
+  uint16_t value, index;
+  uint8_t *buf;
+  uint32_t size;
+  int32_t len;
+};
+
+/* The requests are queued on the control pipe all at once and carried
+   out in order; false if any of them failed */
+extern bool usbapi_control_in_batch(usbapi_handle hdl, uint8_t reqtype,
+				    struct usbapi_control *reqs,
+				    unsigned count, unsigned timeout);
+
+/* Queues one request without waiting for it.  done is called from the
+   event handling once the reply is in req, or len is -1; req and its
+   buffer must stay valid until then. */
+extern bool usbapi_control_in_async(usbapi_handle hdl, uint8_t reqtype,
+				    struct usbapi_control *req,
+				    unsigned timeout,
+				    void (*done)(void *ctx,
+						 struct usbapi_control *req),
+				    void *ctx);
+
+extern uint8_t *usbapi_alloc_buffer(usbapi_handle hdl, uint32_t size);
+extern void usbapi_free_buffer(usbapi_handle hdl, uint8_t *buf, uint32_t size);
+
+/* An async handle can be submitted again once finished.  The callback
+   gets the context given to usbapi_async_submit and a pointer to the
+   transfer buffer, which is NULL if the transfer failed.  With several
+   devices open, it may run on a thread finishing another device's
+   transfers.  It may take over the buffer by storing another one from
+   usbapi_alloc_buffer in its place; the transfer is then resubmitted
+   with that buffer instead.  */
+extern usbapi_async_handle usbapi_async_alloc_bulk_in(usbapi_handle hdl,
+						      int ep, int bufcnt,
+						      uint32_t bufsize,
+						      unsigned timeout);
+extern bool usbapi_async_submit(usbapi_handle hdl, usbapi_async_handle async,
+				bool (*callback)(void *, uint8_t **, uint32_t),
+				void *ctx);
 extern bool usbapi_async_finish(usbapi_handle hdl, usbapi_async_handle snchdl);
 extern bool usbapi_async_cancel(usbapi_handle hdl, usbapi_async_handle async);
+extern void usbapi_async_free(usbapi_handle hdl, usbapi_async_handle async);
+/* The transfers since the handle was last submitted */
+extern void usbapi_async_get_stats(usbapi_handle hdl, usbapi_async_handle async,
+				   struct telemetry_transfers *stats);
 
 #endif /* OPENDTC_USBAPI_H */
@@ -18,6 +18,10 @@
 #ifndef OPENDTC_USBIMPL_H
 # define OPENDTC_USBIMPL_H
 
+#ifdef USBIMPL_SIM
+#include "usbimpl_sim.h"
+#else
 #include "usbimpl_libusb.h"
+#endif
 
 #endif /* OPENDTC_USBIMPL_H */
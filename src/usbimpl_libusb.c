@@ -20,17 +20,61 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define HAVE_LIBUSB_DEV_MEM
+#define HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+#endif
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+#define HAVE_LIBUSB_HOTPLUG
+#endif
+
+/* Seconds between attempts to open a device being waited for */
+#define WAIT_POLL         0.05
+#define WAIT_POLL_HOTPLUG 0.25
 
 struct usbimpl_libusb_async_struct {
   int bufcnt;
   uint32_t bufsize;
-  unsigned submitted;
-  bool (*callback)(const uint8_t *, uint32_t);
+  /* Changed by callbacks on whichever thread handles the events */
+  atomic_uint submitted;
+  atomic_bool stopping;  /* set by usbapi_async_cancel */
+  int finished;
+  bool (*callback)(void *, uint8_t **, uint32_t);
+  void *ctx;
+  struct telemetry_transfers stats;
   struct libusb_transfer *transfers[];
 };
 
 static libusb_context *libusb_ctx = NULL;
 
+#ifdef HAVE_LIBUSB_DEV_MEM
+/* Buffers from libusb_dev_mem_alloc, which need a different free */
+static uint8_t **devmem_buffers = NULL;
+static unsigned devmem_count = 0, devmem_alloc = 0;
+static pthread_mutex_t devmem_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* With the event thread running, all completions are processed there
+   and usbapi_async_finish only waits for finish_cond */
+static pthread_t event_thread;
+static bool event_thread_running = false;
+static atomic_bool event_thread_quit, event_thread_failed;
+static pthread_mutex_t finish_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finish_cond = PTHREAD_COND_INITIALIZER;
+
+/* Counts the devices reported by the hotplug callback */
+static pthread_mutex_t arrival_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arrival_cond = PTHREAD_COND_INITIALIZER;
+static unsigned arrivals = 0;
+
 bool usbapi_init(void)
 {
   int ret;
@@ -40,49 +84,229 @@ bool usbapi_init(void)
   return false;
 }
 
+static void usbapi_stop_event_thread(void)
+{
+  if (!event_thread_running)
+    return;
+  atomic_store(&event_thread_quit, true);
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+  libusb_interrupt_event_handler(libusb_ctx);
+#endif
+  pthread_join(event_thread, NULL);
+  event_thread_running = false;
+}
+
 void usbapi_exit(void)
 {
+  usbapi_stop_event_thread();
+#ifdef HAVE_LIBUSB_DEV_MEM
+  free(devmem_buffers);
+  devmem_buffers = NULL;
+  devmem_count = devmem_alloc = 0;
+#endif
   if (libusb_ctx != NULL) {
     libusb_exit(libusb_ctx);
     libusb_ctx = NULL;
   }
 }
 
-usbapi_handle usbapi_open(uint16_t vid, uint16_t pid, unsigned num)
+static void *usbapi_event_main(void *arg)
+{
+  while (!atomic_load(&event_thread_quit)) {
+    struct timeval tv = { 1, 0 };
+    int ret = libusb_handle_events_timeout_completed(libusb_ctx, &tv, NULL);
+    if (ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+      fprintf(stderr, "Failed to handle events: %s.", libusb_error_name(ret));
+      /* The capture threads handle the events themselves from now on */
+      pthread_mutex_lock(&finish_lock);
+      atomic_store(&event_thread_failed, true);
+      pthread_cond_broadcast(&finish_cond);
+      pthread_mutex_unlock(&finish_lock);
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* A cpu below 0 leaves the thread unpinned.  Real-time scheduling and
+   locking the memory need privileges; without them, the thread runs
+   at normal priority. */
+bool usbapi_start_event_thread(bool realtime, int cpu)
+{
+  pthread_attr_t attr;
+  int ret;
+  if (event_thread_running)
+    return true;
+  atomic_store(&event_thread_quit, false);
+  atomic_store(&event_thread_failed, false);
+  pthread_attr_init(&attr);
+  if (cpu >= 0) {
+    cpu_set_t set;
+    if (cpu >= CPU_SETSIZE) {
+      fprintf(stderr, "No CPU %d\n", cpu);
+      pthread_attr_destroy(&attr);
+      return false;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+  if (realtime) {
+    struct sched_param sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = (sched_get_priority_min(SCHED_FIFO) +
+			 sched_get_priority_max(SCHED_FIFO)) / 2;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &sp);
+  }
+  ret = pthread_create(&event_thread, &attr, usbapi_event_main, NULL);
+  if (ret == EPERM && realtime) {
+    fprintf(stderr, "Not permitted to use real-time scheduling\n");
+    realtime = false;
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+    ret = pthread_create(&event_thread, &attr, usbapi_event_main, NULL);
+  }
+  pthread_attr_destroy(&attr);
+  if (ret) {
+    fprintf(stderr, "Failed to start USB event thread: %s\n", strerror(ret));
+    return false;
+  }
+  event_thread_running = true;
+  /* Keeps the transfer buffers and the stacks from being paged out */
+  if (realtime && mlockall(MCL_CURRENT | MCL_FUTURE))
+    perror("mlockall");
+  return true;
+}
+
+/* ret is set to why no handle was returned */
+static usbapi_handle usbapi_find(uint16_t vid, uint16_t pid, unsigned num,
+				 int *ret)
 {
   libusb_device **devlist;
   libusb_device *dev;
   struct libusb_device_descriptor des;
-  struct libusb_device_handle *hdl;
-  int i, ret;
+  struct libusb_device_handle *hdl = NULL;
+  int i;
 
+  *ret = LIBUSB_ERROR_NOT_FOUND;
   libusb_get_device_list(libusb_ctx, &devlist);
   for (i = 0; (dev = devlist[i]) != NULL; i++) {
-    if ((ret = libusb_get_device_descriptor(dev, &des)) != 0) {
-      fprintf(stderr, "Failed to get device descriptor: %s.",
-	      libusb_error_name(ret));
-      continue;
-    }
-    if (des.idVendor != vid || des.idProduct != pid) {
+    if (libusb_get_device_descriptor(dev, &des) != 0 ||
+	des.idVendor != vid || des.idProduct != pid) {
       continue;
     }
     if (num > 0) {
       --num;
       continue;
     }
-    if (!(ret = libusb_open(dev, &hdl))) {
-      libusb_free_device_list(devlist, 1);
-      return hdl;
-    } else {
-      fprintf(stderr, "Failed to open device: %s.", libusb_error_name(ret));
-      libusb_free_device_list(devlist, 1);
-      return NULL;
-    }
+    if ((*ret = libusb_open(dev, &hdl)) != 0)
+      hdl = NULL;
+    break;
   }
-  fprintf(stderr, "No device with vendor id 0x%04x and product id 0x%04x found\n",
-	  vid, pid);
   libusb_free_device_list(devlist, 1);
-  return NULL;
+  return hdl;
+}
+
+static void usbapi_report_not_opened(uint16_t vid, uint16_t pid, int ret)
+{
+  if (ret == LIBUSB_ERROR_NOT_FOUND)
+    fprintf(stderr, "No device with vendor id 0x%04x and product id 0x%04x found\n",
+	    vid, pid);
+  else
+    fprintf(stderr, "Failed to open device: %s.", libusb_error_name(ret));
+}
+
+usbapi_handle usbapi_open(uint16_t vid, uint16_t pid, unsigned num)
+{
+  int ret;
+  usbapi_handle hdl = usbapi_find(vid, pid, num, &ret);
+  if (hdl == NULL)
+    usbapi_report_not_opened(vid, pid, ret);
+  return hdl;
+}
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+static int LIBUSB_CALL usbapi_arrived(libusb_context *ctx, libusb_device *dev,
+				      libusb_hotplug_event event, void *arg)
+{
+  pthread_mutex_lock(&arrival_lock);
+  arrivals++;
+  pthread_cond_broadcast(&arrival_cond);
+  pthread_mutex_unlock(&arrival_lock);
+  return 0;
+}
+#endif
+
+/* Wait at most t seconds for a device to arrive after the count was
+   last seen at seen */
+static void usbapi_wait_arrival(unsigned seen, double t)
+{
+  struct timespec ts;
+  struct timeval tv;
+  if (!event_thread_running) {
+    /* Nobody else delivers the hotplug events */
+    tv.tv_sec = (time_t)t;
+    tv.tv_usec = (t - tv.tv_sec) * 1e6;
+    libusb_handle_events_timeout_completed(libusb_ctx, &tv, NULL);
+    return;
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += (time_t)t;
+  ts.tv_nsec += (t - (time_t)t) * 1e9;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&arrival_lock);
+  while (arrivals == seen &&
+	 pthread_cond_timedwait(&arrival_cond, &arrival_lock, &ts) == 0)
+    ;
+  pthread_mutex_unlock(&arrival_lock);
+}
+
+/* Opening is retried quietly until the timeout, since a device that has
+   just arrived may not be accessible yet */
+usbapi_handle usbapi_wait_open(uint16_t vid, uint16_t pid, unsigned num,
+			       unsigned timeout)
+{
+  double deadline = telemetry_now() + timeout * 1e-3, poll = WAIT_POLL, left;
+  usbapi_handle hdl;
+  unsigned seen;
+  int ret;
+#ifdef HAVE_LIBUSB_HOTPLUG
+  libusb_hotplug_callback_handle cb;
+  bool hotplug = false;
+
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+      libusb_hotplug_register_callback(libusb_ctx,
+				       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+				       0, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY,
+				       usbapi_arrived, NULL, &cb) == 0) {
+    /* Only a safety net for arrivals just before registering */
+    hotplug = true;
+    poll = WAIT_POLL_HOTPLUG;
+  }
+#endif
+
+  for (;;) {
+    pthread_mutex_lock(&arrival_lock);
+    seen = arrivals;
+    pthread_mutex_unlock(&arrival_lock);
+    if ((hdl = usbapi_find(vid, pid, num, &ret)) != NULL)
+      break;
+    if ((left = deadline - telemetry_now()) <= 0) {
+      usbapi_report_not_opened(vid, pid, ret);
+      break;
+    }
+    usbapi_wait_arrival(seen, (left < poll? left : poll));
+  }
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+  if (hotplug)
+    libusb_hotplug_deregister_callback(libusb_ctx, cb);
+#endif
+  return hdl;
 }
 
 void usbapi_close(usbapi_handle hdl)
@@ -166,19 +390,245 @@ int32_t usbapi_sync_control_in(usbapi_handle hdl, uint8_t reqtype,
   }
 }
 
+/* The transfers of a control batch; pending includes one reference
+   held while submitting, so that done is not set too early */
+struct usbimpl_libusb_batch {
+  unsigned pending;
+  int done;
+};
+
+static void usbapi_batch_release(struct usbimpl_libusb_batch *batch)
+{
+  pthread_mutex_lock(&finish_lock);
+  if (!--batch->pending) {
+    batch->done = 1;
+    pthread_cond_broadcast(&finish_cond);
+  }
+  pthread_mutex_unlock(&finish_lock);
+}
+
+static void LIBUSB_CALL usbapi_batch_callback(struct libusb_transfer *xfer)
+{
+  usbapi_batch_release(xfer->user_data);
+}
+
+bool usbapi_control_in_batch(usbapi_handle hdl, uint8_t reqtype,
+			     struct usbapi_control *reqs, unsigned count,
+			     unsigned timeout)
+{
+  struct usbimpl_libusb_batch batch = { 1, 0 };
+  struct libusb_transfer **xfers;
+  unsigned i, submitted;
+  uint8_t *buf;
+  bool r = true;
+  int ret;
+
+  if (!(xfers = calloc(count, sizeof(*xfers)))) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  for (submitted = 0; submitted < count; submitted++) {
+    struct usbapi_control *req = &reqs[submitted];
+    if (!(xfers[submitted] = libusb_alloc_transfer(0)) ||
+	!(buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + req->size))) {
+      fprintf(stderr, "Out of memory!\n");
+      break;
+    }
+    libusb_fill_control_setup(buf, reqtype|LIBUSB_ENDPOINT_IN, req->request,
+			      req->value, req->index, req->size);
+    libusb_fill_control_transfer(xfers[submitted], hdl, buf,
+				 usbapi_batch_callback, &batch, timeout);
+    xfers[submitted]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    pthread_mutex_lock(&finish_lock);
+    if (!(ret = libusb_submit_transfer(xfers[submitted])))
+      batch.pending++;
+    pthread_mutex_unlock(&finish_lock);
+    if (ret) {
+      fprintf(stderr, "Control in transfer failed: %s.\n",
+	      libusb_error_name(ret));
+      break;
+    }
+  }
+  usbapi_batch_release(&batch);
+
+  if (event_thread_running) {
+    pthread_mutex_lock(&finish_lock);
+    while (!batch.done && !atomic_load(&event_thread_failed))
+      pthread_cond_wait(&finish_cond, &finish_lock);
+    pthread_mutex_unlock(&finish_lock);
+  }
+  /* The transfers time out by themselves, so this ends even if event
+     handling keeps failing */
+  while (!batch.done)
+    if ((ret = libusb_handle_events_completed(libusb_ctx, &batch.done))) {
+      fprintf(stderr, "Failed to handle events: %s.", libusb_error_name(ret));
+      r = false;
+    }
+
+  for (i = 0; i < count; i++) {
+    reqs[i].len = -1;
+    if (i >= submitted) {
+      r = false;
+    } else if (xfers[i]->status == LIBUSB_TRANSFER_COMPLETED) {
+      reqs[i].len = xfers[i]->actual_length;
+      memcpy(reqs[i].buf, libusb_control_transfer_get_data(xfers[i]),
+	     reqs[i].len);
+    } else {
+      fprintf(stderr, "Control in transfer failed: status %d.\n",
+	      xfers[i]->status);
+      r = false;
+    }
+  }
+  for (i = 0; i < count && xfers[i]; i++)
+    libusb_free_transfer(xfers[i]);
+  free(xfers);
+  return r;
+}
+
+struct usbimpl_libusb_control {
+  struct usbapi_control *req;
+  void (*done)(void *ctx, struct usbapi_control *req);
+  void *ctx;
+};
+
+static void LIBUSB_CALL usbapi_control_callback(struct libusb_transfer *xfer)
+{
+  struct usbimpl_libusb_control *c = xfer->user_data;
+  struct usbapi_control *req = c->req;
+  if (xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    req->len = xfer->actual_length;
+    memcpy(req->buf, libusb_control_transfer_get_data(xfer), req->len);
+  } else {
+    fprintf(stderr, "Control in transfer failed: status %d.\n",
+	    xfer->status);
+    req->len = -1;
+  }
+  c->done(c->ctx, req);
+  free(c);
+  libusb_free_transfer(xfer);
+}
+
+bool usbapi_control_in_async(usbapi_handle hdl, uint8_t reqtype,
+			     struct usbapi_control *req, unsigned timeout,
+			     void (*done)(void *ctx,
+					  struct usbapi_control *req),
+			     void *ctx)
+{
+  struct usbimpl_libusb_control *c = malloc(sizeof(*c));
+  struct libusb_transfer *xfer = libusb_alloc_transfer(0);
+  uint8_t *buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + req->size);
+  int ret;
+  if (!c || !xfer || !buf) {
+    fprintf(stderr, "Out of memory!\n");
+    free(c);
+    free(buf);
+    libusb_free_transfer(xfer);
+    return false;
+  }
+  c->req = req;
+  c->done = done;
+  c->ctx = ctx;
+  libusb_fill_control_setup(buf, reqtype|LIBUSB_ENDPOINT_IN, req->request,
+			    req->value, req->index, req->size);
+  libusb_fill_control_transfer(xfer, hdl, buf, usbapi_control_callback, c,
+			       timeout);
+  xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+  if ((ret = libusb_submit_transfer(xfer))) {
+    fprintf(stderr, "Control in transfer failed: %s.\n",
+	    libusb_error_name(ret));
+    free(c);
+    libusb_free_transfer(xfer);
+    return false;
+  }
+  return true;
+}
+
+#ifdef HAVE_LIBUSB_DEV_MEM
+static bool usbapi_devmem_reserve(void)
+{
+  uint8_t **newbuffers;
+  if (devmem_count < devmem_alloc)
+    return true;
+  newbuffers = realloc(devmem_buffers,
+		       (devmem_alloc*2 + 64) * sizeof(uint8_t *));
+  if (newbuffers == NULL)
+    return false;
+  devmem_buffers = newbuffers;
+  devmem_alloc = devmem_alloc*2 + 64;
+  return true;
+}
+#endif
+
+uint8_t *usbapi_alloc_buffer(usbapi_handle hdl, uint32_t size)
+{
+  void *buf;
+#ifdef HAVE_LIBUSB_DEV_MEM
+  /* Memory mapped from usbfs can be used for DMA directly, saving the
+     kernel a bounce buffer per transfer.  Not all kernels support it. */
+  pthread_mutex_lock(&devmem_lock);
+  if (hdl != NULL && usbapi_devmem_reserve() &&
+      (buf = libusb_dev_mem_alloc(hdl, size)) != NULL) {
+    devmem_buffers[devmem_count++] = buf;
+    pthread_mutex_unlock(&devmem_lock);
+    return buf;
+  }
+  pthread_mutex_unlock(&devmem_lock);
+#endif
+  if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), size))
+    return NULL;
+  return buf;
+}
+
+void usbapi_free_buffer(usbapi_handle hdl, uint8_t *buf, uint32_t size)
+{
+#ifdef HAVE_LIBUSB_DEV_MEM
+  unsigned i;
+  pthread_mutex_lock(&devmem_lock);
+  for (i = 0; i < devmem_count; i++)
+    if (devmem_buffers[i] == buf) {
+      devmem_buffers[i] = devmem_buffers[--devmem_count];
+      pthread_mutex_unlock(&devmem_lock);
+      libusb_dev_mem_free(hdl, buf, size);
+      return;
+    }
+  pthread_mutex_unlock(&devmem_lock);
+#endif
+  free(buf);
+}
+
+/* A transfer is no longer submitted */
+static void usbapi_async_release(usbapi_async_handle async)
+{
+  if (atomic_fetch_sub(&async->submitted, 1) == 1) {
+    pthread_mutex_lock(&finish_lock);
+    async->finished = 1;
+    pthread_cond_broadcast(&finish_cond);
+    pthread_mutex_unlock(&finish_lock);
+  }
+}
+
 static void usbapi_async_callback(struct libusb_transfer *xfer)
 { 
-  uint8_t *buffer;
+  uint8_t *nobuffer = NULL, **buffer;
   uint32_t length;
   usbapi_async_handle async = xfer->user_data;
+  double now = 0;
+  unsigned submitted;
+  bool more;
 
   if (xfer->status == LIBUSB_TRANSFER_CANCELLED) {
-    --async->submitted;
+    usbapi_async_release(async);
     return;
   }
   if (xfer->status == LIBUSB_TRANSFER_COMPLETED) {
-    buffer = xfer->buffer;
+    buffer = &xfer->buffer;
     length = xfer->actual_length;
+    now = telemetry_now();
+    /* This transfer is still counted as submitted, and while
+       usbapi_async_submit is running, so is its guard */
+    submitted = atomic_load(&async->submitted);
+    telemetry_completion(&async->stats, now, length,
+			 (submitted > 1? submitted - 1 : 0));
   } else {
     switch (xfer->status) {
     case LIBUSB_TRANSFER_ERROR:
@@ -200,10 +650,13 @@ static void usbapi_async_callback(struct libusb_transfer *xfer)
       fprintf(stderr, "Unknown status %d\n", xfer->status);
       break;
     }
-    buffer = NULL;
+    buffer = &nobuffer;
     length = 0;
   }
-  if (async->callback(buffer, length)) {
+  more = async->callback(async->ctx, buffer, length);
+  if (now)
+    telemetry_record(&async->stats.callbacks, telemetry_now() - now);
+  if (more && !atomic_load(&async->stopping)) {
     int ret = libusb_submit_transfer(xfer);
     if (ret) {
       fprintf(stderr, "Failed to resubmit transfer: %s.",
@@ -213,16 +666,16 @@ static void usbapi_async_callback(struct libusb_transfer *xfer)
     }
   } else
     usbapi_async_cancel(xfer->dev_handle, async);
-  --async->submitted;
+  usbapi_async_release(async);
 }
 
-static bool usbapi_async_bulk_in_start(usbapi_handle hdl,
+static bool usbapi_async_bulk_in_alloc(usbapi_handle hdl,
 				       usbapi_async_handle async,
 				       int ep, unsigned timeout)
 {
   int i;
   for (i=0; i<async->bufcnt; i++) {
-    uint8_t *buffer = malloc(async->bufsize);
+    uint8_t *buffer = usbapi_alloc_buffer(hdl, async->bufsize);
     if (buffer == NULL) {
       fprintf(stderr, "Out of memory!\n");
       return false;
@@ -230,7 +683,7 @@ static bool usbapi_async_bulk_in_start(usbapi_handle hdl,
     async->transfers[i] = libusb_alloc_transfer(0);
     if (async->transfers[i] == NULL) {
       fprintf(stderr, "Out of memory!\n");
-      free(buffer);
+      usbapi_free_buffer(hdl, buffer, async->bufsize);
       return false;
     }
     libusb_fill_bulk_transfer(async->transfers[i], hdl,
@@ -239,23 +692,17 @@ static bool usbapi_async_bulk_in_start(usbapi_handle hdl,
 			      buffer, async->bufsize,
 			      usbapi_async_callback, async, timeout);
   }
-  for (i=0; i<async->bufcnt; i++) {
-    int ret = libusb_submit_transfer(async->transfers[i]);
-    if (ret) {
-      fprintf(stderr, "Failed to submit transfer: %s.",
-	      libusb_error_name(ret));
-      return false;
-    }
-    async->submitted++;
-  }
   return true;
 }
 
-static bool usbapi_async_check(void)
+/* Without the event thread, all devices still share the one context;
+   whichever capture thread gets to handle the events completes the
+   transfers of the others as well */
+static bool usbapi_async_check(usbapi_async_handle async)
 {
   struct timeval tv = { 1, 0 };
-  int ret = libusb_handle_events_timeout_completed(libusb_ctx,
-						   &tv, NULL);
+  int ret = libusb_handle_events_timeout_completed(libusb_ctx, &tv,
+						   &async->finished);
   if (ret) {
     fprintf(stderr, "Failed to handle events: %s.", libusb_error_name(ret));
     return false;
@@ -264,10 +711,9 @@ static bool usbapi_async_check(void)
   }
 }
 
-usbapi_async_handle usbapi_async_bulk_in(usbapi_handle hdl, int ep,
-					 int bufcnt, uint32_t bufsize,
-					 unsigned timeout,
-					 bool (*callback)(const uint8_t *, uint32_t))
+usbapi_async_handle usbapi_async_alloc_bulk_in(usbapi_handle hdl, int ep,
+					       int bufcnt, uint32_t bufsize,
+					       unsigned timeout)
 {
   int i;
   struct usbimpl_libusb_async_struct *async =
@@ -278,42 +724,94 @@ usbapi_async_handle usbapi_async_bulk_in(usbapi_handle hdl, int ep,
   memset(async, 0, sizeof(*async));
   async->bufcnt = bufcnt;
   async->bufsize = bufsize;
-  async->callback = callback;
-  async->submitted = 0;
+  async->callback = NULL;
+  atomic_init(&async->submitted, 0);
+  atomic_init(&async->stopping, false);
+  async->finished = 1;
   for (i=0; i<bufcnt; i++)
     async->transfers[i] = NULL;
-  if (!usbapi_async_bulk_in_start(hdl, async, ep, timeout)) {
-    usbapi_async_cancel(hdl, async);
-    usbapi_async_finish(hdl, async);
+  if (!usbapi_async_bulk_in_alloc(hdl, async, ep, timeout)) {
+    usbapi_async_free(hdl, async);
     async = NULL;
   }
   return async;
 }
 
+bool usbapi_async_submit(usbapi_handle hdl, usbapi_async_handle async,
+			 bool (*callback)(void *, uint8_t **, uint32_t),
+			 void *ctx)
+{
+  bool ok = true;
+  int i;
+  async->callback = callback;
+  async->ctx = ctx;
+  memset(&async->stats, 0, sizeof(async->stats));
+  atomic_store(&async->stopping, false);
+  async->finished = 0;
+  /* Transfers can complete as soon as they are submitted, so each is
+     counted first, and a guard count keeps the total from reaching zero
+     before the last one is in */
+  atomic_store(&async->submitted, 1);
+  for (i=0; i<async->bufcnt && !atomic_load(&async->stopping); i++) {
+    int ret;
+    atomic_fetch_add(&async->submitted, 1);
+    if ((ret = libusb_submit_transfer(async->transfers[i]))) {
+      atomic_fetch_sub(&async->submitted, 1);
+      fprintf(stderr, "Failed to submit transfer: %s.",
+	      libusb_error_name(ret));
+      ok = false;
+      break;
+    }
+    /* A cancel that came in between missed this one */
+    if (atomic_load(&async->stopping))
+      libusb_cancel_transfer(async->transfers[i]);
+  }
+  usbapi_async_release(async);
+  if (!ok) {
+    usbapi_async_cancel(hdl, async);
+    usbapi_async_finish(hdl, async);
+  }
+  return ok;
+}
+
 bool usbapi_async_finish(usbapi_handle hdl, usbapi_async_handle async)
 {
   bool r = true;
-  int i;
   if (async != NULL) {
-    while (async->submitted)
-      if (!usbapi_async_check())
+    if (event_thread_running) {
+      pthread_mutex_lock(&finish_lock);
+      while (atomic_load(&async->submitted) &&
+	     !atomic_load(&event_thread_failed))
+	pthread_cond_wait(&finish_cond, &finish_lock);
+      pthread_mutex_unlock(&finish_lock);
+    }
+    while (atomic_load(&async->submitted))
+      if (!usbapi_async_check(async))
 	r = false;
+  }
+  return r;
+}
+
+void usbapi_async_free(usbapi_handle hdl, usbapi_async_handle async)
+{
+  int i;
+  if (async != NULL) {
     for (i=0; i<async->bufcnt; i++) {
       if (async->transfers[i] != NULL) {
-	free(async->transfers[i]->buffer);
+	usbapi_free_buffer(hdl, async->transfers[i]->buffer, async->bufsize);
 	libusb_free_transfer(async->transfers[i]);
 	async->transfers[i] = NULL;
       }
     }
     free(async);
   }
-  return r;
 }
 
 bool usbapi_async_cancel(usbapi_handle hdl, usbapi_async_handle async)
 {
   bool r = true;
   int i, ret;
+  atomic_store(&async->stopping, true);
   for (i=0; i<async->bufcnt; i++) {
     if (async->transfers[i] != NULL) {
       ret = libusb_cancel_transfer(async->transfers[i]);
@@ -326,3 +824,9 @@ bool usbapi_async_cancel(usbapi_handle hdl, usbapi_async_handle async)
   }
   return r;
 }
+
+void usbapi_async_get_stats(usbapi_handle hdl, usbapi_async_handle async,
+			    struct telemetry_transfers *stats)
+{
+  *stats = async->stats;
+}
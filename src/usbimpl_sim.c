@@ -0,0 +1,632 @@
+/* usbimpl_sim.c -- Simulated USB implementation
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* This emulates a KryoFlux board well enough to drive device.c and
+   stream.c without any hardware attached: the SAM-BA bootloader used
+   for firmware upload, the vendor control requests of the firmware,
+   and streaming of synthesized or recorded flux data.  It is configured
+   through the environment:
+
+   OPENDTC_SIM_BOARDS    number of boards attached (default 1)
+   OPENDTC_SIM_FIRMWARE  non-zero to start with firmware already loaded
+   OPENDTC_SIM_STREAM    recorded stream file to replay instead of
+                         synthesizing MFM-like flux
+   OPENDTC_SIM_SEED      seed for the flux synthesizer
+   OPENDTC_SIM_RATE      stream data rate in bytes/s, 0 for unlimited
+   OPENDTC_SIM_FIFO      device side FIFO size in bytes
+   OPENDTC_SIM_RENUM_MS  time the board is gone during renumeration
+   OPENDTC_SIM_FORMAT    ibm, fm or amiga to synthesize a formatted
+                         track instead of random cells
+   OPENDTC_SIM_BAD_SECTOR  sector written with a bad data checksum
+   OPENDTC_SIM_BAD_READS   reads of each track that get the bad sector,
+                         0 for all of them
+
+   With a rate set, the host must keep up: if the data not yet taken by
+   the callback exceeds the device FIFO plus the queued transfers, the
+   stream is terminated with result 1, just like the real firmware.  */
+
+#include <config.h>
+#include <usbapi.h>
+#include <simflux.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define SIM_VID 0x03eb
+#define SIM_PID 0x6124
+
+#define SIM_BL_VERSION "v1.4 Nov 10 2004 14:03:14"
+
+#define SIM_MAX_BOARDS 16
+
+struct usbimpl_sim_board {
+  unsigned index;
+  bool fw_present;
+  unsigned generation;
+  struct timespec absent_until;
+
+  /* Bootloader */
+  uint8_t *mem;
+  uint32_t mem_base, mem_size;
+  uint32_t write_offs, write_left;
+  uint32_t read_offs, read_left;
+  char reply[64];
+  unsigned reply_len;
+
+  /* Firmware */
+  int side, track;
+  unsigned reads[256][2];
+  bool flux_valid, overflow;
+  /* Stream off may come from another thread than the one reading */
+  atomic_bool stop_requested;
+  struct simflux flux;
+  struct timespec stream_start;
+  uint64_t delivered;
+};
+
+struct usbimpl_sim_handle_struct {
+  struct usbimpl_sim_board *board;
+  unsigned generation;
+};
+
+struct usbimpl_sim_async_struct {
+  int bufcnt;
+  uint32_t bufsize;
+  unsigned timeout;
+  atomic_bool cancelled;
+  bool (*callback)(void *, uint8_t **, uint32_t);
+  void *ctx;
+  uint8_t *buffer;
+  struct telemetry_transfers stats;
+};
+
+static struct {
+  bool fw_present;
+  const char *replay;
+  unsigned long boards, seed, rate, fifo, renum_ms;
+  int format, bad_sector;
+  unsigned long bad_reads;
+} sim_config;
+
+static struct usbimpl_sim_board sim_boards[SIM_MAX_BOARDS];
+
+static unsigned long sim_env(const char *name, unsigned long def)
+{
+  const char *v = getenv(name);
+  char *e;
+  unsigned long r;
+  if (!v || !*v)
+    return def;
+  r = strtoul(v, &e, 0);
+  if (*e) {
+    fprintf(stderr, "Ignoring invalid %s: %s\n", name, v);
+    return def;
+  }
+  return r;
+}
+
+static int sim_format(const char *v)
+{
+  if (!v || !*v)
+    return SIMFLUX_FORMAT_RANDOM;
+  if (!strcmp(v, "ibm"))
+    return SIMFLUX_FORMAT_IBM_MFM;
+  if (!strcmp(v, "fm"))
+    return SIMFLUX_FORMAT_IBM_FM;
+  if (!strcmp(v, "amiga"))
+    return SIMFLUX_FORMAT_AMIGA;
+  fprintf(stderr, "Ignoring invalid OPENDTC_SIM_FORMAT: %s\n", v);
+  return SIMFLUX_FORMAT_RANDOM;
+}
+
+static double sim_elapsed(const struct timespec *since)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) * 1e-9;
+}
+
+static void sim_sleep(double s)
+{
+  struct timespec ts;
+  if (s <= 0)
+    return;
+  ts.tv_sec = (time_t)s;
+  ts.tv_nsec = (long)((s - ts.tv_sec) * 1e9);
+  nanosleep(&ts, NULL);
+}
+
+static struct usbimpl_sim_board *sim_board_of(usbapi_handle hdl)
+{
+  if (hdl->generation != hdl->board->generation)
+    return NULL;
+  return hdl->board;
+}
+
+static void sim_reply(struct usbimpl_sim_board *board, const char *s)
+{
+  snprintf(board->reply, sizeof(board->reply), "%s\n\r", s);
+  board->reply_len = strlen(board->reply);
+}
+
+static void sim_bootloader_command(struct usbimpl_sim_board *board,
+				   const uint8_t *buf, uint32_t len)
+{
+  char cmd[64];
+  unsigned long addr, size;
+
+  if (len >= sizeof(cmd))
+    len = sizeof(cmd)-1;
+  memcpy(cmd, buf, len);
+  cmd[len] = 0;
+  switch (cmd[0]) {
+  case 'N':
+    sim_reply(board, "");
+    break;
+  case 'V':
+    sim_reply(board, SIM_BL_VERSION);
+    break;
+  case 'S':
+    if (sscanf(cmd+1, "%lx,%lx#", &addr, &size) == 2) {
+      uint8_t *mem = realloc(board->mem, size? size : 1);
+      if (mem) {
+	board->mem = mem;
+	board->mem_base = addr;
+	board->mem_size = size;
+	board->write_offs = 0;
+	board->write_left = size;
+      }
+    }
+    break;
+  case 'R':
+    if (sscanf(cmd+1, "%lx,%lx#", &addr, &size) == 2) {
+      board->read_offs = addr - board->mem_base;
+      board->read_left = size;
+    }
+    break;
+  case 'G':
+    /* Jump to firmware; the board drops off the bus and renumerates */
+    board->fw_present = true;
+    board->generation++;
+    clock_gettime(CLOCK_MONOTONIC, &board->absent_until);
+    board->absent_until.tv_sec += sim_config.renum_ms / 1000;
+    board->absent_until.tv_nsec += (sim_config.renum_ms % 1000) * 1000000L;
+    if (board->absent_until.tv_nsec >= 1000000000L) {
+      board->absent_until.tv_sec++;
+      board->absent_until.tv_nsec -= 1000000000L;
+    }
+    break;
+  }
+}
+
+static void sim_stream_start(struct usbimpl_sim_board *board, unsigned revs)
+{
+  if (board->flux_valid)
+    simflux_free(&board->flux);
+  board->flux_valid = false;
+  if (sim_config.replay) {
+    if (!simflux_init_replay(&board->flux, sim_config.replay))
+      return;
+  } else {
+    unsigned *reads = &board->reads[board->track & 0xff][board->side & 1];
+    bool bad = !sim_config.bad_reads || *reads < sim_config.bad_reads;
+    simflux_init(&board->flux, sim_config.seed + board->index*1000 +
+		 board->track*2 + board->side + 1, revs);
+    if (!simflux_format(&board->flux, sim_config.format,
+			board->track, board->side,
+			(bad? sim_config.bad_sector : -1)))
+      return;
+    ++*reads;
+  }
+  board->flux_valid = true;
+  board->overflow = false;
+  atomic_store(&board->stop_requested, false);
+  board->delivered = 0;
+  clock_gettime(CLOCK_MONOTONIC, &board->stream_start);
+}
+
+static uint32_t sim_stream_read(struct usbimpl_sim_board *board,
+				usbapi_async_handle async)
+{
+  double elapsed = 0;
+  uint32_t n;
+
+  if (!board->flux_valid)
+    return 0;
+  if (atomic_exchange(&board->stop_requested, false))
+    simflux_finish(&board->flux, 0);
+  if (sim_config.rate && !board->overflow) {
+    double produced;
+    elapsed = sim_elapsed(&board->stream_start);
+    produced = elapsed * sim_config.rate;
+    if (produced > board->delivered + sim_config.fifo +
+	(double)async->bufcnt * async->bufsize) {
+      board->overflow = true;
+      simflux_finish(&board->flux, 1);
+    }
+  }
+  n = simflux_read(&board->flux, async->buffer, async->bufsize);
+  if (n && sim_config.rate && !board->overflow)
+    sim_sleep((double)(board->delivered + n) / sim_config.rate - elapsed);
+  board->delivered += n;
+  return n;
+}
+
+static int32_t sim_firmware_request(struct usbimpl_sim_board *board,
+				    uint8_t request, uint16_t index,
+				    uint8_t *buf, uint32_t len)
+{
+  static const char * const names[] = {
+    [0x05] = "reset", [0x06] = "device", [0x07] = "motor",
+    [0x08] = "density", [0x09] = "side", [0x0a] = "track",
+    [0x0b] = "stream", [0x0c] = "minTrack", [0x0d] = "maxTrack",
+  };
+  char reply[256];
+  unsigned value = index & 0xff;
+  uint32_t l;
+
+  switch (request) {
+  case 0x09:
+    board->side = value;
+    break;
+  case 0x0a:
+    board->track = value;
+    break;
+  case 0x0b:
+    if (value)
+      sim_stream_start(board, index >> 8);
+    else
+      atomic_store(&board->stop_requested, true);
+    break;
+  }
+
+  if (request == 0x80)
+    snprintf(reply, sizeof(reply), "status=%u", value);
+  else if (request == 0x81)
+    snprintf(reply, sizeof(reply), "inf=%u, name=KryoFlux DiskSystem "
+	     "(simulated), version=3.00s, hwid=1, hwrv=1, "
+	     "sck=24027428.5714285, ick=3003428.5714285", value);
+  else if (request < sizeof(names)/sizeof(names[0]) && names[request])
+    snprintf(reply, sizeof(reply), "%s=%u", names[request], value);
+  else
+    return -1;
+  l = strlen(reply)+1;
+  if (l > len)
+    l = len;
+  memcpy(buf, reply, l);
+  return l;
+}
+
+bool usbapi_init(void)
+{
+  unsigned i;
+  sim_config.boards = sim_env("OPENDTC_SIM_BOARDS", 1);
+  if (sim_config.boards > SIM_MAX_BOARDS)
+    sim_config.boards = SIM_MAX_BOARDS;
+  sim_config.fw_present = sim_env("OPENDTC_SIM_FIRMWARE", 0) != 0;
+  sim_config.replay = getenv("OPENDTC_SIM_STREAM");
+  if (sim_config.replay && !*sim_config.replay)
+    sim_config.replay = NULL;
+  sim_config.seed = sim_env("OPENDTC_SIM_SEED", 0);
+  sim_config.rate = sim_env("OPENDTC_SIM_RATE", 0);
+  sim_config.fifo = sim_env("OPENDTC_SIM_FIFO", 8192);
+  sim_config.renum_ms = sim_env("OPENDTC_SIM_RENUM_MS", 200);
+  sim_config.format = sim_format(getenv("OPENDTC_SIM_FORMAT"));
+  sim_config.bad_sector = (int)sim_env("OPENDTC_SIM_BAD_SECTOR", -1);
+  sim_config.bad_reads = sim_env("OPENDTC_SIM_BAD_READS", 0);
+
+  memset(sim_boards, 0, sizeof(sim_boards));
+  for (i = 0; i < SIM_MAX_BOARDS; i++) {
+    sim_boards[i].index = i;
+    sim_boards[i].fw_present = sim_config.fw_present;
+  }
+  return true;
+}
+
+void usbapi_exit(void)
+{
+  unsigned i;
+  for (i = 0; i < SIM_MAX_BOARDS; i++) {
+    if (sim_boards[i].flux_valid)
+      simflux_free(&sim_boards[i].flux);
+    free(sim_boards[i].mem);
+  }
+  memset(sim_boards, 0, sizeof(sim_boards));
+}
+
+/* The simulated board produces its data on the thread finishing the
+   transfers, so there are no events to hand to a thread of their own */
+bool usbapi_start_event_thread(bool realtime, int cpu)
+{
+  return true;
+}
+
+static bool sim_attached(uint16_t vid, uint16_t pid, unsigned num)
+{
+  return vid == SIM_VID && pid == SIM_PID && num < sim_config.boards &&
+    sim_elapsed(&sim_boards[num].absent_until) >= 0;
+}
+
+usbapi_handle usbapi_open(uint16_t vid, uint16_t pid, unsigned num)
+{
+  usbapi_handle hdl;
+  if (!sim_attached(vid, pid, num)) {
+    fprintf(stderr, "No device with vendor id 0x%04x and product id 0x%04x found\n",
+	    vid, pid);
+    return NULL;
+  }
+  hdl = malloc(sizeof(*hdl));
+  if (!hdl) {
+    fprintf(stderr, "Out of memory!\n");
+    return NULL;
+  }
+  hdl->board = &sim_boards[num];
+  hdl->generation = sim_boards[num].generation;
+  return hdl;
+}
+
+/* A board comes back once absent_until has passed, which stands in for
+   the hotplug event */
+usbapi_handle usbapi_wait_open(uint16_t vid, uint16_t pid, unsigned num,
+			       unsigned timeout)
+{
+  double deadline = telemetry_now() + timeout * 1e-3;
+  while (!sim_attached(vid, pid, num) && telemetry_now() < deadline)
+    usleep(1000);
+  return usbapi_open(vid, pid, num);
+}
+
+void usbapi_close(usbapi_handle hdl)
+{
+  free(hdl);
+}
+
+bool usbapi_claim_interface(usbapi_handle hdl, int ifc)
+{
+  if (!sim_board_of(hdl)) {
+    fprintf(stderr, "Claim interface failed: LIBUSB_ERROR_NO_DEVICE.\n");
+    return false;
+  }
+  return true;
+}
+
+bool usbapi_release_interface(usbapi_handle hdl, int ifc)
+{
+  /* The board is still attached for a moment after the jump to the
+     firmware, so releasing a stale handle is not an error */
+  return true;
+}
+
+bool usbapi_sync_bulk_out(usbapi_handle hdl, int ep, uint8_t *buf,
+			  uint32_t len, unsigned timeout)
+{
+  struct usbimpl_sim_board *board = sim_board_of(hdl);
+  if (!board) {
+    fprintf(stderr, "Bulk out transfer failed: LIBUSB_ERROR_NO_DEVICE.\n");
+    return false;
+  }
+  if (board->fw_present) {
+    sim_sleep(timeout / 1000.0);
+    fprintf(stderr, "Bulk out transfer failed: LIBUSB_ERROR_TIMEOUT.\n");
+    return false;
+  }
+  if (board->write_left) {
+    uint32_t n = (len > board->write_left? board->write_left : len);
+    memcpy(board->mem + board->write_offs, buf, n);
+    board->write_offs += n;
+    board->write_left -= n;
+  } else
+    sim_bootloader_command(board, buf, len);
+  return true;
+}
+
+int32_t usbapi_sync_bulk_in(usbapi_handle hdl, int ep, uint8_t *buf,
+			    uint32_t len, unsigned timeout)
+{
+  struct usbimpl_sim_board *board = sim_board_of(hdl);
+  uint32_t n;
+  if (!board) {
+    fprintf(stderr, "Bulk in transfer failed: LIBUSB_ERROR_NO_DEVICE.\n");
+    return -1;
+  }
+  if (!board->fw_present && board->read_left) {
+    n = (len > board->read_left? board->read_left : len);
+    if (board->read_offs + n <= board->mem_size)
+      memcpy(buf, board->mem + board->read_offs, n);
+    else
+      memset(buf, 0, n);
+    board->read_offs += n;
+    board->read_left -= n;
+    return n;
+  }
+  if (!board->fw_present && board->reply_len) {
+    n = (len > board->reply_len? board->reply_len : len);
+    memcpy(buf, board->reply, n);
+    memmove(board->reply, board->reply+n, board->reply_len-n);
+    board->reply_len -= n;
+    return n;
+  }
+  sim_sleep(timeout / 1000.0);
+  fprintf(stderr, "Bulk in transfer failed: LIBUSB_ERROR_TIMEOUT.\n");
+  return -1;
+}
+
+int32_t usbapi_sync_control_in(usbapi_handle hdl, uint8_t reqtype,
+			       uint8_t request, uint16_t value, uint16_t index,
+			       uint8_t *buf, uint32_t len, unsigned timeout,
+			       bool silent_nak)
+{
+  struct usbimpl_sim_board *board = sim_board_of(hdl);
+  int32_t ret;
+  if (!board) {
+    fprintf(stderr, "Bulk in transfer failed: LIBUSB_ERROR_NO_DEVICE.\n");
+    return -1;
+  }
+  if (board->fw_present &&
+      (ret = sim_firmware_request(board, request, index, buf, len)) >= 0)
+    return ret;
+  if (silent_nak)
+    return -2;
+  fprintf(stderr, "Bulk in transfer failed: LIBUSB_ERROR_PIPE.\n");
+  return -1;
+}
+
+bool usbapi_control_in_batch(usbapi_handle hdl, uint8_t reqtype,
+			     struct usbapi_control *reqs, unsigned count,
+			     unsigned timeout)
+{
+  bool r = true;
+  unsigned i;
+  for (i = 0; i < count; i++)
+    if ((reqs[i].len = usbapi_sync_control_in(hdl, reqtype, reqs[i].request,
+					      reqs[i].value, reqs[i].index,
+					      reqs[i].buf, reqs[i].size,
+					      timeout, false)) < 0)
+      r = false;
+  return r;
+}
+
+/* Carried out right away; the simulated board has no event handling to
+   wait for */
+bool usbapi_control_in_async(usbapi_handle hdl, uint8_t reqtype,
+			     struct usbapi_control *req, unsigned timeout,
+			     void (*done)(void *ctx,
+					  struct usbapi_control *req),
+			     void *ctx)
+{
+  req->len = usbapi_sync_control_in(hdl, reqtype, req->request, req->value,
+				     req->index, req->buf, req->size,
+				     timeout, false);
+  done(ctx, req);
+  return true;
+}
+
+uint8_t *usbapi_alloc_buffer(usbapi_handle hdl, uint32_t size)
+{
+  void *buf;
+  if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), size))
+    return NULL;
+  return buf;
+}
+
+void usbapi_free_buffer(usbapi_handle hdl, uint8_t *buf, uint32_t size)
+{
+  free(buf);
+}
+
+usbapi_async_handle usbapi_async_alloc_bulk_in(usbapi_handle hdl, int ep,
+					       int bufcnt, uint32_t bufsize,
+					       unsigned timeout)
+{
+  struct usbimpl_sim_async_struct *async =
+    malloc(sizeof(struct usbimpl_sim_async_struct));
+  if (!async)
+    return NULL;
+  async->buffer = usbapi_alloc_buffer(hdl, bufsize);
+  if (!async->buffer) {
+    fprintf(stderr, "Out of memory!\n");
+    free(async);
+    return NULL;
+  }
+  async->bufcnt = bufcnt;
+  async->bufsize = bufsize;
+  async->timeout = timeout;
+  atomic_init(&async->cancelled, true);
+  async->callback = NULL;
+  return async;
+}
+
+bool usbapi_async_submit(usbapi_handle hdl, usbapi_async_handle async,
+			 bool (*callback)(void *, uint8_t **, uint32_t),
+			 void *ctx)
+{
+  async->callback = callback;
+  async->ctx = ctx;
+  memset(&async->stats, 0, sizeof(async->stats));
+  atomic_store(&async->cancelled, false);
+  return true;
+}
+
+/* All transfers are taken to be queued again as soon as they complete */
+static bool sim_async_complete(usbapi_async_handle async, uint32_t n)
+{
+  double now = telemetry_now();
+  bool more;
+  telemetry_completion(&async->stats, now, n, async->bufcnt - 1);
+  more = async->callback(async->ctx, &async->buffer, n);
+  telemetry_record(&async->stats.callbacks, telemetry_now() - now);
+  return more;
+}
+
+bool usbapi_async_finish(usbapi_handle hdl, usbapi_async_handle async)
+{
+  uint8_t *nobuffer = NULL;
+  if (async != NULL) {
+    while (!atomic_load(&async->cancelled)) {
+      struct usbimpl_sim_board *board = sim_board_of(hdl);
+      uint32_t n;
+      if (!board) {
+	fprintf(stderr, "Device was disconnected\n");
+	async->callback(async->ctx, &nobuffer, 0);
+	break;
+      }
+      n = sim_stream_read(board, async);
+      if (!n) {
+	/* Nothing more to send; the transfers stay pending until they
+	   are cancelled or time out */
+	unsigned ms;
+	for (ms = 0; ms < async->timeout; ms++) {
+	  if (atomic_load(&async->cancelled))
+	    break;
+	  sim_sleep(0.001);
+	}
+	if (ms < async->timeout)
+	  break;
+	fprintf(stderr, "Transfer timed out\n");
+	async->callback(async->ctx, &nobuffer, 0);
+	break;
+      }
+      if (!sim_async_complete(async, n))
+	break;
+    }
+    atomic_store(&async->cancelled, true);
+  }
+  return true;
+}
+
+bool usbapi_async_cancel(usbapi_handle hdl, usbapi_async_handle async)
+{
+  atomic_store(&async->cancelled, true);
+  return true;
+}
+
+void usbapi_async_free(usbapi_handle hdl, usbapi_async_handle async)
+{
+  if (async != NULL) {
+    usbapi_free_buffer(hdl, async->buffer, async->bufsize);
+    free(async);
+  }
+}
+
+void usbapi_async_get_stats(usbapi_handle hdl, usbapi_async_handle async,
+			    struct telemetry_transfers *stats)
+{
+  *stats = async->stats;
+}
@@ -0,0 +1,362 @@
+/* verify.c -- offline verification of captured streams
+
+   Copyright 2013 Marcus Comstedt
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Runs existing captures through the same parser that checked them
+   during capture.  Plain .raw files are mapped and parsed in one go;
+   compressed streams are decoded straight into the parser.  Files are
+   handed out to one worker thread per core. */
+
+#include <config.h>
+#include <parser.h>
+#include <container.h>
+#include <fluxz.h>
+#include <flux.h>
+#include <reader.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define MAX_THREADS 256
+
+static int opt_threads = 0;
+static bool opt_quiet = false;
+static bool opt_flux = false;
+static bool opt_index = false;
+
+static char **verify_files;
+static unsigned verify_count;
+static atomic_uint verify_next;
+static atomic_uint verify_streams, verify_failed;
+static atomic_ullong verify_bytes;
+
+static bool parse_intoption(char *optstr, int offs, int *optval,
+			    int lo_limit, int hi_limit)
+{
+  char *e;
+  long v = strtol(optstr+offs, &e, 10);
+  if (!optstr[offs] || *e || v < lo_limit || v > hi_limit) {
+    fprintf(stderr, "Out of range %d...%d: %s\n", lo_limit, hi_limit, optstr);
+    return false;
+  }
+  *optval = v;
+  return true;
+}
+
+static int parse_options(int argc, char **argv)
+{
+  int i;
+  for (i=1; i<argc; i++)
+    if (argv[i][0] != '-')
+      break;
+    else switch(argv[i][1]) {
+    case 'h':
+      printf("Usage: %s [options] files...\n"
+	     "-i      : index the streams, keeping the index in <file>"
+	     READER_INDEX_SUFFIX "\n"
+	     "          and list where each revolution starts\n"
+	     "-j<n>   : number of worker threads (default one per core)\n"
+	     "-q      : only report streams that fail verification\n"
+	     "-r      : decode the flux and report the revolutions\n"
+	     "Files may be .raw or .rawz streams or .dtc containers.\n",
+	     argv[0]);
+      exit(0);
+      break;
+    case 'i':
+      opt_index = true;
+      break;
+    case 'j':
+      if (!parse_intoption(argv[i], 2, &opt_threads, 1, MAX_THREADS))
+	return -1;
+      break;
+    case 'q':
+      opt_quiet = true;
+      break;
+    case 'r':
+      opt_flux = true;
+      break;
+    default:
+      fprintf(stderr, "Invalid command: %s\n", argv[i]);
+      return -1;
+    }
+  return i;
+}
+
+/* Per thread state */
+struct verify_context {
+  struct stream_parser parser;
+  struct fluxz *fluxz;
+  struct flux_decoder decoder;
+  struct flux_track *flux;
+};
+
+static void verify_report(struct verify_context *v, const char *name,
+			  const char *entry, const char *error)
+{
+  char info[64] = "";
+  unsigned revs;
+  atomic_fetch_add(&verify_streams, 1);
+  if (error)
+    atomic_fetch_add(&verify_failed, 1);
+  else if (opt_quiet)
+    return;
+  if (!error && v->flux && (revs = flux_track_revolutions(v->flux))) {
+    uint64_t ticks = 0;
+    unsigned r;
+    for (r = 0; r < revs; r++)
+      ticks += flux_track_revolution_ticks(v->flux, r);
+    snprintf(info, sizeof(info), ", %u revolutions at %.2f rpm, "
+	     "%u flux/rev", revs, 60.0 * v->flux->sck * revs / ticks,
+	     (unsigned)((v->flux->index_flux[revs] - v->flux->index_flux[0])
+			/ revs));
+  }
+  /* One call per line, so that lines from different threads don't mix */
+  printf("%s%s%s: %s%s\n", name, (entry? ":" : ""), (entry? entry : ""),
+	 (error? error : "ok"), info);
+}
+
+static void verify_begin(struct verify_context *v)
+{
+  stream_parser_init(&v->parser);
+  if (opt_flux) {
+    flux_track_free(v->flux);
+    if ((v->flux = flux_track_new()))
+      flux_decoder_init(&v->decoder, v->flux);
+  }
+}
+
+static bool verify_feed(struct verify_context *v,
+			const uint8_t *data, uint32_t len)
+{
+  if (v->flux && !flux_decoder_feed(&v->decoder, data, len)) {
+    flux_track_free(v->flux);
+    v->flux = NULL;
+  }
+  return stream_parser_feed(&v->parser, data, len);
+}
+
+static const char *verify_result(struct verify_context *v, bool ok)
+{
+  struct stream_parser *p = &v->parser;
+  if (!ok)
+    return (p->error[0]? p->error : "read error");
+  if (!p->complete)
+    return "Stream is incomplete";
+  return NULL;
+}
+
+static bool verify_sink(void *ctx, const uint8_t *data, uint32_t len)
+{
+  struct verify_context *v = ctx;
+  atomic_fetch_add_explicit(&verify_bytes, len, memory_order_relaxed);
+  if (v->parser.complete)
+    return true;
+  return verify_feed(v, data, len);
+}
+
+static const char *verify_memory(struct verify_context *v,
+				 const uint8_t *data, uint64_t len)
+{
+  bool ok = true;
+  verify_begin(v);
+  while (ok && len > 0 && !v->parser.complete) {
+    uint32_t n = (len > 0x40000000? 0x40000000 : len);
+    ok = verify_feed(v, data, n);
+    data += n;
+    len -= n;
+  }
+  return verify_result(v, ok);
+}
+
+static const char *verify_compressed(struct verify_context *v, FILE *f)
+{
+  verify_begin(v);
+  if (!fluxz_decode(v->fluxz, f, verify_sink, v) && !v->parser.error[0])
+    return "Bad compressed stream";
+  return verify_result(v, !v->parser.error[0]);
+}
+
+static const uint8_t *verify_map(const char *name, uint64_t *size)
+{
+  struct stat st;
+  void *m;
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    return NULL;
+  }
+  m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return NULL;
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return m;
+}
+
+static void verify_container(struct verify_context *v, const char *name,
+			     const uint8_t *data)
+{
+  struct container *c = container_open(name);
+  unsigned i;
+  if (!c) {
+    verify_report(v, name, NULL, "Bad container");
+    return;
+  }
+  for (i = 0; i < c->count; i++) {
+    const struct container_entry *e = &c->entries[i];
+    const char *error;
+    char entry[16];
+    if (container_find(c, e->track, e->side) != e)
+      continue;
+    snprintf(entry, sizeof(entry), "%02u.%u", e->track, e->side);
+    if (e->flags & CONTAINER_ENTRY_COMPRESSED) {
+      if (fseeko(c->file, e->offset, SEEK_SET))
+	error = "Seek failed";
+      else
+	error = verify_compressed(v, c->file);
+    } else {
+      error = verify_memory(v, data + e->offset, e->length);
+      atomic_fetch_add_explicit(&verify_bytes, e->length,
+				memory_order_relaxed);
+    }
+    verify_report(v, name, entry, error);
+  }
+  container_free(c);
+}
+
+/* One call per line here too; use -j1 to keep each file's lines
+   together */
+static void verify_index(const char *name)
+{
+  struct stream_reader *r = stream_reader_open(name, true);
+  unsigned rev, revs;
+  if (!r)
+    return;
+  revs = stream_reader_revolutions(r);
+  for (rev = 0; rev < revs; rev++) {
+    const struct stream_reader_index *x = stream_reader_index(r, rev);
+    const uint8_t *data;
+    uint64_t len;
+    stream_reader_revolution(r, rev, &data, &len);
+    printf("%s: revolution %u at stream position %lu, offset %llu, "
+	   "%llu bytes\n", name, rev, (unsigned long)x->streampos,
+	   (unsigned long long)x->offset, (unsigned long long)len);
+  }
+  stream_reader_close(r);
+}
+
+static void verify_file(struct verify_context *v, const char *name)
+{
+  uint64_t size;
+  const uint8_t *data = verify_map(name, &size);
+  if (!data) {
+    verify_report(v, name, NULL, "Can not read file");
+    return;
+  }
+  if (size >= CONTAINER_HEADER_SIZE && !memcmp(data, "ODTCCONT", 8))
+    verify_container(v, name, data);
+  else if (fluxz_is_compressed(data, size)) {
+    FILE *f = fopen(name, "rb");
+    if (!f)
+      verify_report(v, name, NULL, "Can not read file");
+    else {
+      verify_report(v, name, NULL, verify_compressed(v, f));
+      fclose(f);
+    }
+  } else {
+    verify_report(v, name, NULL, verify_memory(v, data, size));
+    atomic_fetch_add_explicit(&verify_bytes, size, memory_order_relaxed);
+  }
+  /* Incomplete streams are indexed as far as they go */
+  if (opt_index && !v->parser.error[0] &&
+      !(size >= CONTAINER_HEADER_SIZE && !memcmp(data, "ODTCCONT", 8)))
+    verify_index(name);
+  munmap((void *)data, size);
+}
+
+static void *verify_worker(void *arg)
+{
+  struct verify_context *v = calloc(1, sizeof(struct verify_context));
+  unsigned i;
+  if (!v || !(v->fluxz = fluxz_new())) {
+    free(v);
+    return NULL;
+  }
+  while ((i = atomic_fetch_add(&verify_next, 1)) < verify_count)
+    verify_file(v, verify_files[i]);
+  flux_track_free(v->flux);
+  fluxz_free(v->fluxz);
+  free(v);
+  return NULL;
+}
+
+int main (int argc, char *argv[])
+{
+  pthread_t threads[MAX_THREADS];
+  struct timespec t0, t1;
+  double elapsed;
+  int i, n;
+  int arg = parse_options(argc, argv);
+  if (arg < 0)
+    return 1;
+  if (arg >= argc) {
+    fprintf(stderr, "No files specified\n");
+    return 1;
+  }
+  verify_files = argv + arg;
+  verify_count = argc - arg;
+  if (!(n = opt_threads)) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = (cpus < 1? 1 : (cpus > MAX_THREADS? MAX_THREADS : cpus));
+  }
+  if (n > verify_count)
+    n = verify_count;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < n; i++)
+    if (pthread_create(&threads[i], NULL, verify_worker, NULL)) {
+      fprintf(stderr, "Failed to start worker thread\n");
+      break;
+    }
+  if (!i)
+    return 1;
+  n = i;
+  for (i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+  if (atomic_load(&verify_next) < verify_count) {
+    /* Workers that could not allocate their decoder leave files behind */
+    fprintf(stderr, "Out of memory!\n");
+    return 1;
+  }
+  printf("%u streams verified, %u failed, %.1f MB/s\n",
+	 atomic_load(&verify_streams), atomic_load(&verify_failed),
+	 (elapsed > 0? atomic_load(&verify_bytes) / elapsed / 1e6 : 0.0));
+  return (atomic_load(&verify_failed)? 1 : 0);
+}